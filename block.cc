@@ -40,7 +40,18 @@ Block::~Block()
 
 Block & Block::operator=(const Block &rhs)
 {
-  return *(new (this) Block(rhs));
+  if (this!=&rhs) { 
+    // keep our buffer if it is already the right size
+    if (data==0 || length!=rhs.length) { 
+      if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
+	throw GenericException();
+      }
+    }
+    memcpy(data,rhs.data,rhs.length);
+    lastaccessed=rhs.lastaccessed;
+    dirty=rhs.dirty;
+  }
+  return *this;
 }
 
 
@@ -50,6 +61,11 @@ Block & Block::operator=(const Block &rhs)
 ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
 {
   BYTE_T *d;
+
+  // keys read into the same Block again and again keep their buffer
+  if (data && newlen==length) { 
+    return ERROR_NOERROR;
+  }
   
   try {
     d = new BYTE_T [newlen];
@@ -86,17 +102,18 @@ static char low2hex(BYTE_T x)
 
 
 
-#define MAX(x,y) ((x)>(y) ? (x) : (y))
-
+// Blocks of different lengths compare bytewise over the common
+// prefix, with the shorter one first on a tie
 bool Block::operator<(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))<0;
+  int c=memcmp(data,rhs.data,MIN(length,rhs.length));
+  return c<0 || (c==0 && length<rhs.length);
 }
 
 
 bool Block::operator==(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))==0;
+  return length==rhs.length && memcmp(data,rhs.data,length)==0;
 }
 
 ostream & Block::Print(ostream &os) const
@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <string.h>
+#include <sched.h>
+#include <algorithm>
 #include "btree.h"
 
 KeyValuePair::KeyValuePair()
@@ -27,48 +30,116 @@ KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
  SIZE_T valuesize,
  BufferCache *cache,
- bool unique) 
+ bool unique,
+ SIZE_T format,
+ SIZE_T minfill,
+ SIZE_T leaffill,
+ SIZE_T interiorfill,
+ bool linked,
+ bool shadow) 
 {
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
+  superblock.info.format=format;
+  superblock.info.minfill=minfill;
+  superblock.info.leaffill=leaffill;
+  superblock.info.interiorfill=interiorfill;
+  // a shadow paged writer goes alone, so it has no use for right links,
+  // and nor does a buffered one, whose changes all start at the root
+  superblock.info.linked=linked && !shadow && format!=BTREE_FORMAT_BUFFERED;
+  superblock.info.shadow=shadow && format!=BTREE_FORMAT_BUFFERED;
+  superblock.info.filterblocks=0;
   buffercache=cache;
   // note: ignoring unique now
 
-  //Calculate maximum number of keys per bllock
-  SIZE_T blockSize = buffercache->GetBlockSize();
-  maxNumKeys = (blockSize - sizeof(NodeMetadata))/(16);
+  // the split thresholds depend on the block size, so wait for Attach
+  maxLeafKeys=0;
+  maxInteriorKeys=0;
+  optimistic=true;
+  numrestarts=0;
+  pthread_mutex_init(&alloclock,0);
+  Init();
 }
 
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  optimistic=true;
+  numrestarts=0;
+  pthread_mutex_init(&alloclock,0);
+  Init();
 }
 
 
-//
-// Note, will not attach!
-//
-BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
-{
-  buffercache=rhs.buffercache;
-  superblock_index=rhs.superblock_index;
-  superblock=rhs.superblock;
-}
-
 BTreeIndex::~BTreeIndex()
 {
-  // shouldn't have to do anything
+  pthread_mutex_destroy(&alloclock);
+  pthread_key_delete(shadowkey);
+  pthread_mutex_destroy(&writerlock);
+  pthread_mutex_destroy(&snapshotlock);
+  pthread_key_delete(txnkey);
+  pthread_rwlock_destroy(&applylock);
+  pthread_mutex_destroy(&memtablelock);
+  pthread_mutex_destroy(&mergelock);
+  pthread_mutex_destroy(&filterlock);
+  pthread_mutex_destroy(&resultlock);
+  delete resultcache;
 }
 
 
-BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
+void BTreeIndex::Init()
 {
-  return *(new(this)BTreeIndex(rhs));
+  pthread_key_create(&txnkey,0);
+  pthread_rwlock_init(&applylock,0);
+  applyseq=0;
+  pthread_mutex_init(&mergelock,0);
+  pthread_mutex_init(&memtablelock,0);
+  memtablesize=0;
+  nummerges=0;
+  nummerged=0;
+  nummergeleaves=0;
+  pthread_mutex_init(&filterlock,0);
+  numfilterprobes=0;
+  numfilterskips=0;
+  pthread_mutex_init(&resultlock,0);
+  resultcache=0;
+  pthread_key_create(&shadowkey,0);
+  pthread_mutex_init(&writerlock,0);
+  pthread_mutex_init(&snapshotlock,0);
+  nextfree=0;
+  shadowsync=true;
+  version=0;
+  numretired=0;
 }
 
 
+// The free list is shared, so changes to it are logged as operations
+// of their own that commit at once, whatever becomes of the one that
+// asked for them
 ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 {
+  MutexGuard guard(&alloclock);
+
+  if (superblock.info.shadow) { 
+    // In block order, wrapping around, so that what one commit writes
+    // lies together
+    set<SIZE_T>::iterator f=freeblocks.lower_bound(nextfree);
+    if (f==freeblocks.end()) { 
+      f=freeblocks.begin();
+    }
+    if (f==freeblocks.end()) { 
+      return ERROR_NOSPACE;
+    }
+    n=*f;
+    freeblocks.erase(f);
+    nextfree=n+1;
+    BTreeShadow *s=GetShadow();
+    if (s) { 
+      s->fresh.insert(n);
+    }
+    buffercache->NotifyAllocateBlock(n);
+    return ERROR_NOERROR;
+  }
+
   n=superblock.info.freelist;
 
   if (n==0) { 
@@ -77,13 +148,15 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 
   BTreeNode node;
 
-  node.Unserialize(buffercache,n);
+  node.Unserialize(buffercache,n,superblock.info);
 
   assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
 
   superblock.info.freelist=node.info.freelist;
 
+  buffercache->BeginOperation();
   superblock.Serialize(buffercache,superblock_index);
+  buffercache->CommitOperation();
 
   buffercache->NotifyAllocateBlock(n);
 
@@ -93,9 +166,28 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
+  MutexGuard guard(&alloclock);
   BTreeNode node;
 
-  node.Unserialize(buffercache,n);
+  if (superblock.info.shadow) { 
+    BTreeShadow *s=GetShadow();
+    if (s && !s->fresh.erase(n)) { 
+      // the committed version still uses it until the commit
+      map<SIZE_T, SIZE_T>::iterator c=s->copies.find(n);
+      if (c!=s->copies.end()) { 
+	freeblocks.insert((*c).second);
+	buffercache->NotifyDeallocateBlock((*c).second);
+	s->copies.erase(c);
+      }
+      s->superseded.push_back(n);
+      return ERROR_NOERROR;
+    }
+    freeblocks.insert(n);
+    buffercache->NotifyDeallocateBlock(n);
+    return ERROR_NOERROR;
+  }
+
+  node.Unserialize(buffercache,n,superblock.info);
 
   assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
 
@@ -103,843 +195,3599 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
   node.info.freelist=superblock.info.freelist;
 
+  buffercache->BeginOperation();
+
   node.Serialize(buffercache,n);
 
   superblock.info.freelist=n;
 
   superblock.Serialize(buffercache,superblock_index);
 
+  buffercache->CommitOperation();
+
   buffercache->NotifyDeallocateBlock(n);
 
   return ERROR_NOERROR;
 
 }
 
-ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+BTreeShadow *BTreeIndex::GetShadow() const
 {
-  ERROR_T rc;
+  if (!superblock.info.shadow) { 
+    return 0;
+  }
+  return (BTreeShadow *)pthread_getspecific(shadowkey);
+}
 
-  superblock_index=initblock;
-  assert(superblock_index==0);
 
-  if (create) {
-    // build a super block, root node, and a free space list
-    //
-    // Superblock at superblock_index
-    // root node at superblock_index+1
-    // free space list for rest
-    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
-     superblock.info.keysize,
-     superblock.info.valuesize,
-     buffercache->GetBlockSize());
-    newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
-    newsuperblock.info.numkeys=0;
+SIZE_T BTreeIndex::GetRoot() const
+{
+  BTreeShadow *s=GetShadow();
 
-    buffercache->NotifyAllocateBlock(superblock_index);
+  return s ? s->root : superblock.info.rootnode;
+}
 
-    rc=newsuperblock.Serialize(buffercache,superblock_index);
 
-    if (rc) { 
-      return rc;
+ERROR_T BTreeIndex::ReadNode(const SIZE_T node, BTreeNode &b) const
+{
+  BTreeShadow *s=GetShadow();
+
+  if (s) { 
+    map<SIZE_T, SIZE_T>::const_iterator c=s->copies.find(node);
+    if (c!=s->copies.end()) { 
+      return b.Unserialize(buffercache,(*c).second,superblock.info);
     }
-    
-    BTreeNode newrootnode(BTREE_ROOT_NODE,
-     superblock.info.keysize,
-     superblock.info.valuesize,
-     buffercache->GetBlockSize());
-    newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
-    newrootnode.info.numkeys=0;
+  }
+  return b.Unserialize(buffercache,node,superblock.info);
+}
 
-    buffercache->NotifyAllocateBlock(superblock_index+1);
 
-    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+// Nodes keep pointing at the committed blocks of their children, and
+// it is the commit that points them at the copies instead
+ERROR_T BTreeIndex::WriteNode(const SIZE_T node, const BTreeNode &b)
+{
+  BTreeShadow *s=GetShadow();
+  SIZE_T n=node;
+  ERROR_T rc;
 
-    if (rc) { 
-      return rc;
+  if (s && !s->fresh.count(node)) { 
+    map<SIZE_T, SIZE_T>::iterator c=s->copies.find(node);
+    if (c==s->copies.end()) { 
+      rc=AllocateNode(n);
+      if (rc) { return rc; }
+      s->fresh.erase(n);
+      s->copies[node]=n;
+    } else {
+      n=(*c).second;
     }
+  }
+  return b.Serialize(buffercache,n);
+}
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) { 
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-       superblock.info.keysize,
-       superblock.info.valuesize,
-       buffercache->GetBlockSize());
-      newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
-      
-      rc = newfreenode.Serialize(buffercache,i);
 
-      if (rc) {
-       return rc;
-     }
+bool BTreeIndex::BeginShadow()
+{
+  if (!superblock.info.shadow || GetShadow()) { 
+    return false;
+  }
+  pthread_mutex_lock(&writerlock);
+  BTreeShadow *s=new BTreeShadow;
+  s->root=superblock.info.rootnode;
+  pthread_setspecific(shadowkey,s);
+  return true;
+}
 
-   }
- }
 
-  // OK, now, mounting the btree is simply a matter of reading the superblock 
+ERROR_T BTreeIndex::EndShadow(const bool began, const ERROR_T rc)
+{
+  if (!began) { 
+    return rc;
+  }
+  BTreeShadow *s=GetShadow();
+  ERROR_T result=rc;
 
- return superblock.Unserialize(buffercache,initblock);
+  if (!result) { 
+    result=CommitShadow(*s);
+  }
+  if (result) { 
+    AbortShadow(*s);
+  }
+  pthread_setspecific(shadowkey,0);
+  delete s;
+  pthread_mutex_unlock(&writerlock);
+  return result;
 }
 
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+// Nothing committed points at the new blocks, so they are simply free
+// again, and the blocks let go of are still in use
+void BTreeIndex::AbortShadow(BTreeShadow &s)
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  MutexGuard guard(&alloclock);
+
+  for (map<SIZE_T, SIZE_T>::iterator c=s.copies.begin(); c!=s.copies.end(); c++) { 
+    freeblocks.insert((*c).second);
+    buffercache->NotifyDeallocateBlock((*c).second);
+  }
+  for (set<SIZE_T>::iterator f=s.fresh.begin(); f!=s.fresh.end(); f++) { 
+    freeblocks.insert(*f);
+    buffercache->NotifyDeallocateBlock(*f);
+  }
+  s.copies.clear();
+  s.fresh.clear();
+  s.superseded.clear();
 }
 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-  const BTreeOp op,
-  const KEY_T &key,
-  VALUE_T &value)
+// Only the nodes on the way down to a change can have changed below
+// them, and those the descents went through, so nothing else is read
+ERROR_T BTreeIndex::RelinkShadow(BTreeShadow &s, const SIZE_T node, bool &changed)
 {
   BTreeNode b;
+  SIZE_T i, ptr;
+  bool below, relinked=false;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
-
-  rc= b.Unserialize(buffercache,node);
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+  changed=s.copies.count(node) || s.fresh.count(node);
+  if (!changed && !s.touched.count(node)) { 
+    return ERROR_NOERROR;
   }
-
-  switch (b.info.nodetype) { 
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) { //STRUCTURED SO EQUIVALENT KEY VALUES ARE TO THE LEFT
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to 
-	// this one, if it exists
-       rc=b.GetPtr(offset,ptr);
-       if (rc) { return rc; }
-       return LookupOrUpdateInternal(ptr,op,key,value);
-     }
-   }
-    // if we got here, we need to go to the next pointer, if it exists
-   if (b.info.numkeys>0) { 
-    rc=b.GetPtr(b.info.numkeys,ptr);
-    if (rc) { return rc; }
-    return LookupOrUpdateInternal(ptr,op,key,value);
-  } else {
-      // There are no keys at all on this node, so nowhere to go
-    return ERROR_NONEXISTENT;
+  rc=ReadNode(node,b);
+  if (rc) { return rc; }
+  if (b.info.nodetype!=BTREE_ROOT_NODE && b.info.nodetype!=BTREE_INTERIOR_NODE) { 
+    return ERROR_NOERROR;
   }
-  break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-  for (offset=0;offset<b.info.numkeys;offset++) { 
-    rc=b.GetKey(offset,testkey);
-    if (rc) {  return rc; }
-    if (testkey==key) { 
-     if (op==BTREE_OP_LOOKUP) { 
-       return b.GetVal(offset,value);
-     } else { 
-      rc =  b.SetVal(offset, value);
-      if(rc) {return rc;}
-      rc = b.Serialize(buffercache, node);
-      return rc;
+  for (i=0; b.info.numkeys>0 && i<=b.info.numkeys; i++) { 
+    rc=b.GetPtr(i,ptr);
+    if (rc) { return rc; }
+    rc=RelinkShadow(s,ptr,below);
+    if (rc) { return rc; }
+    map<SIZE_T, SIZE_T>::iterator c=s.copies.find(ptr);
+    if (c!=s.copies.end()) { 
+      rc=b.SetPtr(i,(*c).second);
+      if (rc) { return rc; }
+      relinked=true;
     }
+    changed=changed || below;
   }
-}
-return ERROR_NONEXISTENT;
-break;
-default:
-    // We can't be looking at anything other than a root, internal, or leaf
-return ERROR_INSANE;
-break;
-}  
-
-return ERROR_INSANE;
+  if (changed || relinked) { 
+    changed=true;
+    return WriteNode(node,b);
+  }
+  return ERROR_NOERROR;
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+// The new version goes to the disk first, and the superblock after it,
+// so that a crash at any point leaves one version or the other whole.
+// The new blocks were handed out in order, so they mostly follow one
+// another on the disk.  Readers still on the old version are waited
+// for before its blocks go back on the free list.  With a log, the
+// relinking and the superblock are logged like any other change, or
+// recovery would replay older images of those blocks over them.
+ERROR_T BTreeIndex::CommitShadow(BTreeShadow &s)
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
+  vector<SIZE_T> blocks;
+  SIZE_T newroot;
+  bool changed;
   ERROR_T rc;
-  unsigned i;
 
-  if (dt==BTREE_DEPTH_DOT) { 
-    os << nodenum << " [ label=\""<<nodenum<<": ";
-  } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
-  } else {
+  buffercache->BeginOperation();
+  rc=RelinkShadow(s,s.root,changed);
+  buffercache->CommitOperation();
+  if (rc) { return rc; }
+  if (!changed) { 
+    // e.g. an insert of a key that was there already
+    AbortShadow(s);
+    return ERROR_NOERROR;
   }
+  map<SIZE_T, SIZE_T>::iterator c=s.copies.find(s.root);
+  newroot=(c!=s.copies.end()) ? (*c).second : s.root;
 
-  switch (b.info.nodetype) { 
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-    if (dt==BTREE_SORTED_KEYVAL) {
-    } else {
-      if (dt==BTREE_DEPTH_DOT) { 
-      } else { 
-       os << "Interior: ";
-     }
-     for (offset=0;offset<=b.info.numkeys;offset++) { 
-       rc=b.GetPtr(offset,ptr);
-       if (rc) { return rc; }
-       os << "*" << ptr << " ";
-	// Last pointer
-       if (offset==b.info.numkeys) break;
-       rc=b.GetKey(offset,key);
-       if (rc) {  return rc; }
-       for (i=0;i<b.info.keysize;i++) { 
-         os << key.data[i];
-       }
-       os << " ";
-     }
-   }
-   break;
-   case BTREE_LEAF_NODE:
-   if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
-   } else {
-    os << "Leaf: ";
+  for (c=s.copies.begin(); c!=s.copies.end(); c++) { 
+    blocks.push_back((*c).second);
   }
-  for (offset=0;offset<b.info.numkeys;offset++) { 
-    if (offset==0) { 
-	// special case for first pointer
-     rc=b.GetPtr(offset,ptr);
-     if (rc) { return rc; }
-     if (dt!=BTREE_SORTED_KEYVAL) { 
-       os << "*" << ptr << " ";
-     }
-   }
-   if (dt==BTREE_SORTED_KEYVAL) { 
-     os << "(";
-   }
-   rc=b.GetKey(offset,key);
-   if (rc) {  return rc; }
-   for (i=0;i<b.info.keysize;i++) { 
-     os << key.data[i];
-   }
-   if (dt==BTREE_SORTED_KEYVAL) { 
-     os << ",";
-   } else {
-     os << " ";
-   }
-   rc=b.GetVal(offset,value);
-   if (rc) {  return rc; }
-   for (i=0;i<b.info.valuesize;i++) { 
-     os << value.data[i];
-   }
-   if (dt==BTREE_SORTED_KEYVAL) { 
-     os << ")\n";
-} else {
-	os << " ";
+  blocks.insert(blocks.end(),s.fresh.begin(),s.fresh.end());
+  // and the filter, which has the new keys already
+  for (SIZE_T i=0; i<superblock.info.filterblocks; i++) { 
+    blocks.push_back(superblock_index+2+i);
+  }
+  sort(blocks.begin(),blocks.end());
+  for (SIZE_T i=0; i<blocks.size(); i++) { 
+    rc=buffercache->CleanBlock(blocks[i]);
+    if (rc) { return rc; }
+  }
+  rc=buffercache->SyncDisk(shadowsync);
+  if (rc) { return rc; }
+
+  BTreeNode newsuperblock;
+  {
+    MutexGuard guard(&alloclock);
+    newsuperblock=superblock;
+  }
+  newsuperblock.info.rootnode=newroot;
+  buffercache->BeginOperation();
+  rc=newsuperblock.Serialize(buffercache,superblock_index);
+  buffercache->CommitOperation();
+  if (!rc) { 
+    rc=buffercache->CleanBlock(superblock_index);
+  }
+  if (!rc) { 
+    rc=buffercache->SyncDisk(shadowsync);
+  }
+  if (rc) { 
+    return rc;
+  }
+
+  MutexGuard guard(&snapshotlock);
+  __atomic_store_n(&superblock.info.rootnode,newroot,__ATOMIC_SEQ_CST);
+  version++;
+  // the old version's own blocks, for its snapshots
+  vector<SIZE_T> old(s.superseded);
+  for (c=s.copies.begin(); c!=s.copies.end(); c++) { 
+    old.push_back((*c).first);
+  }
+  numretired+=old.size();
+  retired.push_back(make_pair(version,old));
+  ReclaimRetired();
+  // none of it is to be undone now
+  s.copies.clear();
+  s.fresh.clear();
+  s.superseded.clear();
+  return ERROR_NOERROR;
 }
+
+
+// Blocks retired by the commit that made version v are only reachable
+// from older versions.  The caller holds snapshotlock.
+void BTreeIndex::ReclaimRetired()
+{
+  SIZE_T oldest=snapshots.empty() ? version : (*snapshots.begin()).first;
+  MutexGuard guard(&alloclock);
+
+  while (!retired.empty() && retired.front().first<=oldest) { 
+    vector<SIZE_T> &blocks=retired.front().second;
+    for (SIZE_T i=0; i<blocks.size(); i++) { 
+      freeblocks.insert(blocks[i]);
+      buffercache->NotifyDeallocateBlock(blocks[i]);
+    }
+    numretired-=blocks.size();
+    retired.pop_front();
+  }
 }
-break;
-default:
-if (dt==BTREE_DEPTH_DOT) { 
-  os << "Unknown("<<b.info.nodetype<<")";
-} else {
-  os << "Unsupported Node Type " << b.info.nodetype ;
+
+
+ERROR_T BTreeIndex::OpenSnapshot(BTreeSnapshot &snap) const
+{
+  if (!superblock.info.shadow) { 
+    return ERROR_UNIMPL;
+  }
+  CloseSnapshot(snap);
+  MutexGuard guard(&snapshotlock);
+  snap.index=this;
+  snap.root=superblock.info.rootnode;
+  snap.version=version;
+  snapshots[version]++;
+  return ERROR_NOERROR;
 }
+
+
+// What it kept from being reused waits for the next commit
+void BTreeIndex::CloseSnapshot(BTreeSnapshot &snap) const
+{
+  if (snap.index!=this) { 
+    return;
+  }
+  MutexGuard guard(&snapshotlock);
+  map<SIZE_T, SIZE_T>::iterator o=snapshots.find(snap.version);
+  if (o!=snapshots.end() && --(*o).second==0) { 
+    snapshots.erase(o);
+  }
+  snap.index=0;
 }
-if (dt==BTREE_DEPTH_DOT) { 
-  os << "\" ]";
+
+
+SIZE_T BTreeIndex::GetNumSnapshots() const
+{
+  MutexGuard guard(&snapshotlock);
+  SIZE_T n=0;
+
+  for (map<SIZE_T, SIZE_T>::const_iterator o=snapshots.begin(); o!=snapshots.end(); o++) { 
+    n+=(*o).second;
+  }
+  return n;
 }
-return ERROR_NOERROR;
+
+
+BTreeSnapshot::~BTreeSnapshot()
+{
+  Close();
 }
 
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+
+void BTreeSnapshot::Close()
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  if (index) { 
+    index->CloseSnapshot(*this);
+  }
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+
+// Every block the committed tree reaches, nodes and overflow chains, is
+// in use, and every other one but the superblock and the filter is free
+ERROR_T BTreeIndex::BuildFreeBlocks()
 {
-  //This is really a B+ tree (with optional sequentially linked leaf nodes).
-  //This means that on every key you split, you need to include that key AGAIN in it's >= diskblock, so that is eventually included in a leaf node with it's key/value pair.
-  //This is also what makes deleting a key a nightmare, since you have to get rid of ALL instances of the ky (including the leaf version with the value), and then rebalance.
-  // page 636 in the book has good diagrams of this
-  //cout << "Started insert" << endl;
+  vector<bool> used(buffercache->GetNumBlocks(),false);
+  BTreeWalk w;
+  BTreeNode o;
+  SIZE_T i, n;
+  bool done=false;
+  ERROR_T rc;
 
-  //======ALGORITHM======
-  VALUE_T val;
-
-  //Lookup and attempt to update key
-  ERROR_T retCode = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, val);
-
-  //cout << "Finished LookupOrUpdateInternal" << endl;
-
-  switch(retCode) {
-    //If there is no error in the update call, end function, declare update successful.
-    case ERROR_NOERROR:
-    //std::cout << "Key already existed, value updated."<<std::endl;
-    return ERROR_INSERT;
-    //If the key doesn't exist (as expected), begin insert functionality
-    case ERROR_NONEXISTENT:
-      //traverse to find the leaf
-      //Use a stack of pointers to track the path down to the node where the key would go.
-    BTreeNode leafNode;
-    BTreeNode rootNode;
-    BTreeNode rightLeafNode;
-    ERROR_T rc;
-    SIZE_T leafPtr;
-    SIZE_T rightLeafPtr;
-
-    SIZE_T rootPtr = superblock.info.rootnode;
-    rootNode.Unserialize(buffercache, rootPtr);
-    initBlock = false;
-    if (rootNode.info.numkeys != 0) {
-      initBlock = true;
+  used[superblock_index]=true;
+  for (i=0; i<superblock.info.filterblocks; i++) { 
+    used[superblock_index+2+i]=true;
+  }
+  rc=WalkFirst(superblock.info.rootnode,w);
+  while (!rc && !done) { 
+    BTreeNode &b=w.node[w.depth];
+    if (w.block[w.depth]>=used.size()) { 
+      return ERROR_INSANE;
     }
-    
-    rootNode.Serialize(buffercache, rootPtr);
+    used[w.block[w.depth]]=true;
+    if (b.info.nodetype==BTREE_LEAF_NODE) { 
+      for (i=0; i<b.info.numkeys; i++) { 
+	for (n=ValueChain(b,i); n!=0; memcpy(&n,o.data,sizeof(SIZE_T))) { 
+	  if (n>=used.size()) { 
+	    return ERROR_INSANE;
+	  }
+	  used[n]=true;
+	  rc=o.Unserialize(buffercache,n,superblock.info);
+	  if (rc) { return rc; }
+	}
+      }
+    }
+    rc=WalkNext(w,done);
+  }
+  if (rc) { return rc; }
+
+  MutexGuard snapshots(&snapshotlock);
+  MutexGuard guard(&alloclock);
+  retired.clear();
+  numretired=0;
+  freeblocks.clear();
+  for (n=0; n<used.size(); n++) { 
+    if (!used[n]) { 
+      freeblocks.insert(freeblocks.end(),n);
+    }
+  }
+  nextfree=0;
+  return ERROR_NOERROR;
+}
+
+BTreeNode BTreeIndex::NewNode(const int nodetype) const
+{
+  BTreeNode b(nodetype,
+	      superblock.info.keysize,
+	      superblock.info.valuesize,
+	      superblock.info.blocksize,
+	      superblock.info.format);
+  memcpy(&b.info.format,&superblock.info.format,BTREE_SETTINGS_BYTES);
+  return b;
+}
+
+
+// Fixed format split thresholds: the real number of entries a leaf or
+// interior node of this index holds, scaled by the index's fill targets,
+// but never below what a split needs nor above what the node holds.
+// Attach does not create an index whose nodes hold fewer than that.
+static SIZE_T FillThreshold(const SIZE_T slots, const SIZE_T fill)
+{
+  SIZE_T n = (fill>0 && fill<100) ? slots*fill/100 : slots;
+  if (n<BTREE_MIN_SPLIT_KEYS) { 
+    n=BTREE_MIN_SPLIT_KEYS;
+  }
+  return (n>slots) ? slots : n;
+}
+
+void BTreeIndex::ComputeFanout()
+{
+  if (superblock.info.format==BTREE_FORMAT_SLOTTED) { 
+    // slotted nodes split on free bytes, see IsOverfull
+    maxLeafKeys=0;
+    maxInteriorKeys=0;
+    return;
+  }
+  maxLeafKeys=FillThreshold(superblock.info.GetNumSlotsAsLeaf(),superblock.info.leaffill);
+  maxInteriorKeys=FillThreshold(superblock.info.GetNumSlotsAsInterior(),superblock.info.interiorfill);
+}
+
+
+// A node is overfull once it could not take one more entry
+bool BTreeIndex::IsOverfull(const BTreeNode &b) const
+{
+  if (b.IsSlotted()) { 
+    return b.GetReclaimableBytes() < b.info.GetMaxRecordBytes()+sizeof(SlotEntry);
+  } else if (b.info.nodetype==BTREE_LEAF_NODE) { 
+    return b.info.numkeys >= maxLeafKeys;
+  } else {
+    return b.info.numkeys >= maxInteriorKeys;
+  }
+}
+
+
+// A node is safe if it would not be overfull even after taking a new
+// entry and, for slotted nodes, having the separators a redistribution
+// below it may replace grow to the largest record.  Updates of fixed
+// size values never change a node's shape.
+bool BTreeIndex::IsSafe(const BTreeNode &b, const BTreeOp op) const
+{
+  if (op==BTREE_OP_LOOKUP || (op==BTREE_OP_UPDATE && !b.IsSlotted())) { 
+    return true;
+  }
+  if (b.IsSlotted()) { 
+    return b.GetReclaimableBytes() >= (BTREE_MAX_SPLIT_FANIN+2)*(b.info.GetMaxRecordBytes()+sizeof(SlotEntry));
+  } else if (b.info.nodetype==BTREE_LEAF_NODE) { 
+    return b.info.numkeys+1 < maxLeafKeys;
+  } else {
+    return b.info.numkeys+1 < maxInteriorKeys;
+  }
+}
+
+
+void BTreeIndex::UnlatchPath(BTreePath &path, const SIZE_T keep)
+{
+  if (path.superlatched) { 
+    buffercache->UnlatchBlock(superblock_index);
+    path.superlatched=false;
+  }
+  for (; path.latched+keep<path.depth; path.latched++) { 
+    buffercache->UnlatchBlock(path.block[path.latched]);
+  }
+}
+
+
+// Space a key of interior node b takes, in the units IsOverfull counts
+static SIZE_T InteriorWeight(const BTreeNode &b, const KEY_T &key)
+{
+  if (b.IsSlotted()) { 
+    return key.length+sizeof(SIZE_T)+sizeof(SlotEntry);
+  } else {
+    return 1;
+  }
+}
+
+
+// Tell the cache how far node is from the root, so that it can keep
+// the top levels pinned
+void BTreeIndex::TagLevel(const SIZE_T node, const SIZE_T depth) const
+{
+  if (buffercache->GetPinnedLevels()>0) {
+    buffercache->SetBlockLevel(node,depth);
+  }
+}
+
+
+// How many full siblings are split into one more node.  k full nodes
+// become k+1 nodes that are k/(k+1) full, so we pick the smallest k
+// that meets the index's target occupancy.
+SIZE_T BTreeIndex::SplitFanIn() const
+{
+  SIZE_T k;
+  for (k=1; k<BTREE_MAX_SPLIT_FANIN && 100*k<superblock.info.minfill*(k+1); k++) { 
+  }
+  return k;
+}
+
+
+ERROR_T BTreeIndex::CheckSizes(const KEY_T &key, const VALUE_T &value) const
+{
+  if (superblock.info.format!=BTREE_FORMAT_SLOTTED) { 
+    return ERROR_NOERROR;
+  }
+  if ((superblock.info.keysize && key.length>superblock.info.keysize) ||
+      (superblock.info.valuesize && value.length>superblock.info.valuesize)) { 
+    return ERROR_SIZE;
+  }
+  // the key itself must fit in a record next to an overflow reference,
+  // which Attach made sure of for keys up to keysize
+  if (key.length+sizeof(OverflowRef)>superblock.info.GetMaxRecordBytes()) { 
+    return ERROR_SIZE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::StoreValue(const KEY_T &key, const VALUE_T &value, VALUE_T &stored, bool &overflow)
+{
+  overflow=false;
+
+  if (superblock.info.format==BTREE_FORMAT_SLOTTED ? 
+      (key.length+value.length>superblock.info.GetMaxRecordBytes() || 
+       value.length>superblock.info.overflowsize) :
+      superblock.info.HasOverflowValues()) { 
+    OverflowRef ref;
+    ERROR_T rc=WriteOverflow(value,ref.block);
+    if (rc) { return rc; }
+    ref.length=value.length;
+    stored.Resize(sizeof(ref),false);
+    memcpy(stored.data,&ref,sizeof(ref));
+    overflow=true;
+  } else {
+    stored=value;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::GetValue(const BTreeNode &b, const SIZE_T offset, VALUE_T &value) const
+{
+  ERROR_T rc=b.GetVal(offset,value);
+
+  if (rc || !b.IsValOverflow(offset)) { 
+    return rc;
+  }
+
+  OverflowRef ref;
+  memcpy(&ref,value.data,sizeof(ref));
+  return ReadOverflow(ref.block,ref.length,value);
+}
+
+
+SIZE_T BTreeIndex::ValueChain(const BTreeNode &b, const SIZE_T offset) const
+{
+  if (!b.IsValOverflow(offset)) { 
+    return 0;
+  }
+
+  OverflowRef ref;
+  memcpy(&ref,b.ResolveVal(offset),sizeof(ref));
+  return ref.block;
+}
+
+
+ERROR_T BTreeIndex::WriteOverflow(const VALUE_T &value, SIZE_T &first)
+{
+  SIZE_T per=superblock.info.GetNumOverflowBytes();
+  SIZE_T numblocks=(value.length+per-1)/per;
+  SIZE_T next=0;
+  ERROR_T rc;
+
+  // Written back to front so that each block knows its successor
+  for (SIZE_T i=numblocks;i>0;i--) { 
+    SIZE_T n;
+    SIZE_T start=(i-1)*per;
+    SIZE_T len=(value.length-start<per) ? value.length-start : per;
+
+    rc=AllocateNode(n);
+    if (rc) { 
+      if (next) { 
+	FreeOverflow(next);
+      }
+      return rc;
+    }
+    BTreeNode b=NewNode(BTREE_OVERFLOW_NODE);
+    memcpy(b.data,&next,sizeof(SIZE_T));
+    memcpy(b.data+sizeof(SIZE_T),value.data+start,len);
+    rc=b.Serialize(buffercache,n);
+    if (rc) { return rc; }
+    next=n;
+  }
+  first=next;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ReadOverflow(const SIZE_T &first, const SIZE_T length, VALUE_T &value) const
+{
+  SIZE_T per=superblock.info.GetNumOverflowBytes();
+  SIZE_T done=0;
+  SIZE_T n=first;
+  BTreeNode b;
+  ERROR_T rc;
+
+  value.Resize(length,false);
+
+  while (done<length) { 
+    rc=b.Unserialize(buffercache,n,superblock.info);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_OVERFLOW_NODE) { 
+      return ERROR_INSANE;
+    }
+    SIZE_T len=(length-done<per) ? length-done : per;
+    memcpy(value.data+done,b.data+sizeof(SIZE_T),len);
+    done+=len;
+    memcpy(&n,b.data,sizeof(SIZE_T));
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FreeOverflow(const SIZE_T &first)
+{
+  SIZE_T n=first;
+  BTreeNode b;
+  ERROR_T rc;
+
+  while (n!=0) { 
+    rc=b.Unserialize(buffercache,n,superblock.info);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_OVERFLOW_NODE) { 
+      return ERROR_INSANE;
+    }
+    rc=DeallocateNode(n);
+    if (rc) { return rc; }
+    memcpy(&n,b.data,sizeof(SIZE_T));
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+{
+  ERROR_T rc;
+
+  superblock_index=initblock;
+  assert(superblock_index==0);
+
+  // as in SetMemtableSize, for a log set up after the memtable
+  if (memtablesize && buffercache->GetWriteAheadLog()) { 
+    return ERROR_BADCONFIG;
+  }
+
+  // whatever was in memory before is gone, as after a crash
+  pthread_mutex_lock(&memtablelock);
+  memtable.clear();
+  merging.clear();
+  pthread_mutex_unlock(&memtablelock);
+  if (resultcache) { 
+    MutexGuard guard(&resultlock);
+    resultcache->Clear();
+  }
+
+  if (create) {
+    // build a super block, root node, and a free space list
+    //
+    // Superblock at superblock_index
+    // root node at superblock_index+1
+    // filter blocks, if any, after it
+    // free space list for rest
+    SIZE_T firstfree=superblock_index+2+superblock.info.filterblocks;
+    if (firstfree>=buffercache->GetNumBlocks()) { 
+      return ERROR_NOSPACE;
+    }
+    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
+     superblock.info.keysize,
+     superblock.info.valuesize,
+     buffercache->GetBlockSize(),
+     superblock.info.format);
+    newsuperblock.info.rootnode=superblock_index+1;
+    newsuperblock.info.freelist=firstfree;
+    newsuperblock.info.filterblocks=superblock.info.filterblocks;
+    newsuperblock.info.numkeys=0;
+    newsuperblock.info.minfill=superblock.info.minfill;
+    newsuperblock.info.leaffill=superblock.info.leaffill;
+    newsuperblock.info.interiorfill=superblock.info.interiorfill;
+    newsuperblock.info.linked=superblock.info.linked;
+    newsuperblock.info.shadow=superblock.info.shadow;
+
+    // Values that would leave fewer than BTREE_MIN_LEAF_SLOTS entries
+    // in a leaf are kept in overflow blocks instead
+    SIZE_T leafbytes;
+    if (superblock.info.format==BTREE_FORMAT_SLOTTED) { 
+      leafbytes=(newsuperblock.info.GetNumDataBytes()-BTREE_SLOTTED_HEADER)/BTREE_MIN_LEAF_SLOTS;
+    } else {
+      leafbytes=(newsuperblock.info.GetNumDataBytes()-sizeof(SIZE_T)-newsuperblock.info.GetHighKeyBytes())/BTREE_MIN_LEAF_SLOTS;
+      leafbytes=(leafbytes>superblock.info.keysize) ? leafbytes-superblock.info.keysize : 0;
+    }
+    newsuperblock.info.overflowsize = (leafbytes>sizeof(OverflowRef)) ? leafbytes : sizeof(OverflowRef);
+
+    // A slotted index must take keys of keysize, each in a record next
+    // to a reference to its value's overflow chain
+    if (superblock.info.format==BTREE_FORMAT_SLOTTED && superblock.info.keysize &&
+	superblock.info.keysize+sizeof(OverflowRef)>newsuperblock.info.GetMaxRecordBytes()) { 
+      return ERROR_SIZE;
+    }
+
+    // A fixed node must hold enough entries to be split.  A B-link
+    // node has given up keysize bytes to its high key by now, so an
+    // index that would only work unlinked is turned away too.
+    if (superblock.info.format!=BTREE_FORMAT_SLOTTED && 
+	(newsuperblock.info.GetNumSlotsAsLeaf()<BTREE_MIN_SPLIT_KEYS ||
+	 newsuperblock.info.GetNumSlotsAsInterior()<BTREE_MIN_SPLIT_KEYS)) { 
+      return ERROR_SIZE;
+    }
+
+    // A buffered interior node must still be able to split, and to
+    // hold a message
+    if (superblock.info.format==BTREE_FORMAT_BUFFERED && 
+	(newsuperblock.info.GetNumSlotsAsInterior()<=BTREE_MIN_SPLIT_KEYS ||
+	 newsuperblock.info.GetNumMessageSlots()<1)) { 
+      return ERROR_SIZE;
+    }
+
+    buffercache->NotifyAllocateBlock(superblock_index);
+
+    rc=newsuperblock.Serialize(buffercache,superblock_index);
+
+    if (rc) { 
+      return rc;
+    }
+    
+    BTreeNode newrootnode(BTREE_ROOT_NODE,
+     superblock.info.keysize,
+     superblock.info.valuesize,
+     buffercache->GetBlockSize(),
+     superblock.info.format);
+    newrootnode.info.rootnode=superblock_index+1;
+    newrootnode.info.freelist=firstfree;
+    newrootnode.info.numkeys=0;
+    newrootnode.info.overflowsize=newsuperblock.info.overflowsize;
+    newrootnode.info.linked=newsuperblock.info.linked;
+
+    buffercache->NotifyAllocateBlock(superblock_index+1);
+
+    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+
+    if (rc) { 
+      return rc;
+    }
+
+    // an empty filter
+    for (SIZE_T i=superblock_index+2; i<firstfree; i++) { 
+      BTreeNode newfilternode(BTREE_FILTER_NODE,
+       superblock.info.keysize,
+       superblock.info.valuesize,
+       buffercache->GetBlockSize(),
+       superblock.info.format);
+
+      buffercache->NotifyAllocateBlock(i);
+      rc=newfilternode.Serialize(buffercache,i);
+      if (rc) { 
+	return rc;
+      }
+    }
+
+    // a shadow paged index finds its free blocks at attach instead
+    for (SIZE_T i=firstfree; !newsuperblock.info.shadow && i<buffercache->GetNumBlocks();i++) { 
+      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
+       superblock.info.keysize,
+       superblock.info.valuesize,
+       buffercache->GetBlockSize(),
+       superblock.info.format);
+      newfreenode.info.rootnode=superblock_index+1;
+      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
+      
+      rc = newfreenode.Serialize(buffercache,i);
+
+      if (rc) {
+       return rc;
+     }
+
+   }
+ }
+
+  // OK, now, mounting the btree is simply a matter of reading the superblock 
+
+ rc=superblock.Unserialize(buffercache,initblock);
+ if (rc) { 
+   return rc;
+ }
+ ComputeFanout();
+ rc=LoadFilter();
+ if (rc) { 
+   return rc;
+ }
+ if (superblock.info.shadow) { 
+   return BuildFreeBlocks();
+ }
+ return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+{
+  ERROR_T rc=MergeMemtable();
+  if (rc) { 
+    return rc;
+  }
+
+  MutexGuard guard(&alloclock);
+
+  return superblock.Serialize(buffercache,superblock_index);
+}
+
+
+// The child of interior node b that key belongs under.  A separator is
+// the largest key of its left subtree, so equal keys go left.
+static ERROR_T FindChild(const BTreeNode &b, const KEY_T &key, KEY_T &testkey, SIZE_T &ptr)
+{
+  ERROR_T rc;
+  SIZE_T offset;
+
+  if (b.info.numkeys==0) { 
+    // There are no keys at all on this node, so nowhere to go
+    return ERROR_NONEXISTENT;
+  }
+  for (offset=0;offset<b.info.numkeys;offset++) { 
+    rc=b.GetKey(offset,testkey);
+    if (rc) {  return rc; }
+    if (key<testkey || key==testkey) { 
+      break;
+    }
+  }
+  // either the first key that's at least as large, or the last pointer
+  return b.GetPtr(offset,ptr);
+}
+
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const BTreeOp op,
+  const KEY_T &key,
+  VALUE_T &value,
+  SIZE_T *oldchain)
+{
+  BTreePath path;
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  KEY_T testkey;
+
+  path.whole = (oldchain != 0);
+  rc = LookupLeaf(key, path, b, op);
+
+  // Scan through keys looking for matching value
+  for (offset=0;rc==ERROR_NOERROR && offset<b.info.numkeys;offset++) { 
+    rc=b.GetKey(offset,testkey);
+    if (rc) {  break; }
+    if (testkey==key) { 
+      if (op==BTREE_OP_LOOKUP) { 
+	rc = GetValue(b,offset,value);
+      } else { 
+	VALUE_T stored;
+	bool overflow;
+	// the old chain goes once nothing points at it
+	SIZE_T chain = ValueChain(b, offset);
+	if (!oldchain) { 
+	  buffercache->BeginOperation();
+	}
+	rc = StoreValue(key, value, stored, overflow);
+	if(!rc) {rc = b.SetVal(offset, stored, overflow);}
+	if(!rc) {rc = WriteNode(path.block[path.depth-1], b);}
+	if (!rc && IsOverfull(b)) { 
+	  // A longer value can leave a slotted leaf without its reserve
+	  rc = Rebalance(path);
+	}
+	if (oldchain) { 
+	  UnlatchPath(path);
+	  *oldchain = rc ? 0 : chain;
+	  return rc;
+	}
+	LSN_T lsn = 0;
+	if (rc) { 
+	  AbortOperation();
+	} else {
+	  lsn = buffercache->CommitOperation();
+	}
+	UnlatchPath(path);
+	if (!rc && chain) { 
+	  rc = FreeOverflow(chain);
+	}
+	if (!rc) { 
+	  rc = buffercache->ForceLog(lsn);
+	}
+	return rc;
+      }
+      UnlatchPath(path);
+      return rc;
+    }
+  }
+  UnlatchPath(path);
+  return rc ? rc : ERROR_NONEXISTENT;
+}
+
+
+ERROR_T BTreeIndex::PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt) const
+{
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt==BTREE_DEPTH_DOT) { 
+    os << nodenum << " [ label=\""<<nodenum<<": ";
+  } else if (dt==BTREE_DEPTH) {
+    os << nodenum << ": ";
+  } else {
+  }
+
+  switch (b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+    if (dt==BTREE_SORTED_KEYVAL) {
+    } else {
+      if (dt==BTREE_DEPTH_DOT) { 
+      } else { 
+       os << "Interior: ";
+     }
+     for (offset=0;offset<=b.info.numkeys;offset++) { 
+       rc=b.GetPtr(offset,ptr);
+       if (rc) { return rc; }
+       os << "*" << ptr << " ";
+	// Last pointer
+       if (offset==b.info.numkeys) break;
+       rc=b.GetKey(offset,key);
+       if (rc) {  return rc; }
+       for (i=0;i<key.length;i++) { 
+         os << key.data[i];
+       }
+       os << " ";
+     }
+     if (b.info.nummessages>0) { 
+       os << "+" << b.info.nummessages << " messages";
+     }
+   }
+   break;
+   case BTREE_LEAF_NODE:
+   if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) { 
+   } else {
+    os << "Leaf: ";
+  }
+  for (offset=0;offset<b.info.numkeys;offset++) { 
+    if (offset==0) { 
+	// special case for first pointer
+     rc=b.GetPtr(offset,ptr);
+     if (rc) { return rc; }
+     if (dt!=BTREE_SORTED_KEYVAL) { 
+       os << "*" << ptr << " ";
+     }
+   }
+   if (dt==BTREE_SORTED_KEYVAL) { 
+     os << "(";
+   }
+   rc=b.GetKey(offset,key);
+   if (rc) {  return rc; }
+   for (i=0;i<key.length;i++) { 
+     os << key.data[i];
+   }
+   if (dt==BTREE_SORTED_KEYVAL) { 
+     os << ",";
+   } else {
+     os << " ";
+   }
+   rc=GetValue(b,offset,value);
+   if (rc) {  return rc; }
+   for (i=0;i<value.length;i++) { 
+     os << value.data[i];
+   }
+   if (dt==BTREE_SORTED_KEYVAL) { 
+     os << ")\n";
+} else {
+	os << " ";
+}
+}
+break;
+default:
+if (dt==BTREE_DEPTH_DOT) { 
+  os << "Unknown("<<b.info.nodetype<<")";
+} else {
+  os << "Unsupported Node Type " << b.info.nodetype ;
+}
+}
+if (dt==BTREE_DEPTH_DOT) { 
+  os << "\" ]";
+}
+return ERROR_NOERROR;
+}
+
+// Lookups take no lock, but one that overlaps a Commit making its
+// changes in place could see some of them, or ones it then takes back,
+// so it looks again once the commit is done
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  BTreeTransaction *t=GetTransaction();
+  ERROR_T rc;
+
+  if (t) { 
+    map<KEY_T, BTreeChange>::const_iterator c=t->changes.find(key);
+    if (c!=t->changes.end()) { 
+      value=(*c).second.value;
+      return ERROR_NOERROR;
+    }
+  }
+  SIZE_T seq=__atomic_load_n(&applyseq,__ATOMIC_SEQ_CST);
+  if (!(seq&1)) { 
+    rc=LookupCommitted(key,value);
+    if (__atomic_load_n(&applyseq,__ATOMIC_SEQ_CST)==seq) { 
+      return rc;
+    }
+  }
+  // a commit was part way through: wait for it, and look again
+  pthread_rwlock_rdlock(&applylock);
+  rc=LookupCommitted(key,value);
+  pthread_rwlock_unlock(&applylock);
+  return rc;
+}
+
+
+// A value found is kept in the result cache, unless the key was
+// changed while we looked
+ERROR_T BTreeIndex::LookupCommitted(const KEY_T &key, VALUE_T &value)
+{
+  SIZE_T generation=0;
+  ERROR_T rc;
+
+  if (resultcache) { 
+    MutexGuard guard(&resultlock);
+    if (resultcache->Lookup(key,value,generation)) { 
+      return ERROR_NOERROR;
+    }
+  }
+  rc=LookupMemtable(key,value);
+  if (rc==ERROR_NONEXISTENT) { 
+    rc=LookupTree(key,value);
+  }
+  if (!rc && resultcache) { 
+    MutexGuard guard(&resultlock);
+    resultcache->Put(key,value,generation);
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::LookupTree(const KEY_T &key, VALUE_T &value)
+{
+  if (!MayContain(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (IsBuffered()) { 
+    return LookupBuffered(key,value,true);
+  }
+  if (superblock.info.shadow) { 
+    BTreeSnapshot snap;
+    ERROR_T rc=OpenSnapshot(snap);
+    return rc ? rc : Lookup(snap,key,value);
+  }
+  if (optimistic) { 
+    for (SIZE_T i=0;i<BTREE_MAX_RESTARTS;i++) { 
+      bool conflict;
+      ERROR_T rc=LookupOptimistic(key,value,conflict);
+      if (!conflict) { 
+	return rc;
+      }
+      __atomic_add_fetch(&numrestarts,1,__ATOMIC_RELAXED);
+      // let the writer in our way finish
+      sched_yield();
+    }
+  }
+  return LookupOrUpdateInternal(BTREE_OP_LOOKUP, key, value);
+}
+
+
+// A snapshot's blocks do not change while it is open, so there is
+// nothing to latch or to check
+ERROR_T BTreeIndex::Lookup(const BTreeSnapshot &snap, const KEY_T &key, VALUE_T &value) const
+{
+  BTreeNode b;
+  KEY_T testkey;
+  SIZE_T ptr=snap.root;
+  SIZE_T depth, offset;
+  ERROR_T rc;
+
+  if (snap.index!=this) { 
+    return ERROR_GENERAL;
+  }
+  for (depth=0; depth<BTREE_MAX_HEIGHT; depth++) { 
+    rc=b.Unserialize(buffercache,ptr,superblock.info);
+    if (rc) { return rc; }
+    TagLevel(ptr,depth);
+    switch (b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      rc=FindChild(b,key,testkey,ptr);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      for (offset=0; offset<b.info.numkeys; offset++) { 
+	rc=b.GetKey(offset,testkey);
+	if (rc) { return rc; }
+	if (testkey==key) { 
+	  return GetValue(b,offset,value);
+	}
+      }
+      return ERROR_NONEXISTENT;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_INSANE;
+}
+
+
+// Optimistic lock coupling.  A block is read between two reads of its
+// version, and the version of the block that pointed to it is checked
+// again once its own is known, so the pointer followed was still good
+// then.  A writer holding any of these blocks exclusive, or having
+// changed one since, makes us start over.  Nothing is written, so
+// readers do not contend with each other for latches.
+ERROR_T BTreeIndex::LookupOptimistic(const KEY_T &key, VALUE_T &value, bool &conflict)
+{
+  BTreeNode b;
+  KEY_T testkey;
+  SIZE_T parent, node, next;
+  SIZE_T pv, v;
+  SIZE_T depth=0;
+  SIZE_T offset;
+  ERROR_T rc;
+
+  conflict=true;
+
+  parent=superblock_index;
+  pv=buffercache->GetBlockVersion(parent);
+  if (pv & 1) { 
+    return ERROR_NOERROR;
+  }
+  node=__atomic_load_n(&superblock.info.rootnode,__ATOMIC_SEQ_CST);
+
+  // a bound on the blocks a sane tree can send us through
+  for (SIZE_T steps=0; steps<buffercache->GetNumBlocks(); steps++) { 
+    v=buffercache->GetBlockVersion(node);
+    if ((v & 1) || buffercache->GetBlockVersion(parent)!=pv) { 
+      return ERROR_NOERROR;
+    }
+    rc=b.Unserialize(buffercache,node,superblock.info);
+    if (buffercache->GetBlockVersion(node)!=v) { 
+      return ERROR_NOERROR;
+    }
+    if (rc) { 
+      conflict=false;
+      return rc;
+    }
+    TagLevel(node,depth);
+
+    // b is now as it was at version v.  In a B-link tree, a node that
+    // has been split since its parent was read sends us right.
+    next=0;
+    if (b.HasHighKey()) { 
+      rc=b.GetHighKey(testkey);
+      if (rc) { conflict=false; return rc; }
+      if (testkey<key) { 
+	next=b.GetRightLink();
+      }
+    }
+    if (next==0) { 
+      switch (b.info.nodetype) { 
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	rc=FindChild(b,key,testkey,next);
+	if (rc) { 
+	  conflict=false;
+	  return rc;
+	}
+	depth++;
+	break;
+      case BTREE_LEAF_NODE:
+	rc=ERROR_NONEXISTENT;
+	for (offset=0;offset<b.info.numkeys;offset++) { 
+	  rc=b.GetKey(offset,testkey);
+	  if (rc) { break; }
+	  if (testkey==key) { 
+	    rc=GetValue(b,offset,value);
+	    break;
+	  }
+	  rc=ERROR_NONEXISTENT;
+	}
+	// the value may have been in overflow blocks a writer has freed
+	conflict=(buffercache->GetBlockVersion(node)!=v);
+	return rc;
+      default:
+	conflict=false;
+	return ERROR_INSANE;
+      }
+    }
+    parent=node;
+    pv=v;
+    node=next;
+  }
+  conflict=false;
+  return ERROR_INSANE;
+}
+
+// Part of a MultiLookup batch, the sorted keys first..last-1, headed
+// for block, which parent (at version pv) pointed to
+struct BTreeBatchRange {
+  SIZE_T block;
+  SIZE_T parent;
+  SIZE_T pv;
+  SIZE_T first, last;
+  bool operator<(const BTreeBatchRange &rhs) const { return block<rhs.block; }
+};
+
+struct BTreeBatchOrder {
+  const vector<KEY_T> &keys;
+  BTreeBatchOrder(const vector<KEY_T> &k) : keys(k) {}
+  bool operator()(const SIZE_T a, const SIZE_T b) const { return keys[a]<keys[b]; }
+};
+
+// The batch goes down one level at a time.  Each node of a level is
+// read once, under a shared latch, and splits its keys among its
+// children, and the next level's nodes are read in block order.  A node
+// is only trusted if its parent has not changed since it was read: a
+// writer may have moved keys out of it in between.  Keys bound for one
+// that cannot be trusted are looked up one by one.  In a B-link tree,
+// keys above a node's high key go on to its right sibling instead.
+ERROR_T BTreeIndex::MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results)
+{
+  BTreeTransaction *t=GetTransaction();
+  SIZE_T seq=__atomic_load_n(&applyseq,__ATOMIC_SEQ_CST);
+  bool again=true;
+  ERROR_T rc;
+
+  // as in Lookup
+  if (!(seq&1)) { 
+    rc=MultiLookupCommitted(keys,values,results);
+    again=(__atomic_load_n(&applyseq,__ATOMIC_SEQ_CST)!=seq);
+  }
+  if (again) { 
+    pthread_rwlock_rdlock(&applylock);
+    rc=MultiLookupCommitted(keys,values,results);
+    pthread_rwlock_unlock(&applylock);
+  }
+  for (SIZE_T i=0; !rc && t && i<keys.size(); i++) { 
+    map<KEY_T, BTreeChange>::const_iterator c=t->changes.find(keys[i]);
+    if (c!=t->changes.end()) { 
+      values[i]=(*c).second.value;
+      results[i]=ERROR_NOERROR;
+    }
+  }
+  return rc;
+}
+
+
+// The memtable is looked at first: a change that leaves it for the
+// tree meanwhile is found in the tree
+ERROR_T BTreeIndex::MultiLookupCommitted(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results)
+{
+  vector<pair<SIZE_T, VALUE_T> > found;
+  VALUE_T value;
+  ERROR_T rc;
+
+  if (memtablesize) { 
+    for (SIZE_T i=0;i<keys.size();i++) { 
+      if (LookupMemtable(keys[i],value)==ERROR_NOERROR) { 
+	found.push_back(make_pair(i,value));
+      }
+    }
+  }
+  if (HasFilter()) { 
+    // only the keys the filter may have go down the tree
+    vector<SIZE_T> maybe;
+    vector<KEY_T> subkeys;
+    vector<VALUE_T> subvalues;
+    vector<ERROR_T> subresults;
+    for (SIZE_T i=0;i<keys.size();i++) { 
+      if (MayContain(keys[i])) { 
+	maybe.push_back(i);
+	subkeys.push_back(keys[i]);
+      }
+    }
+    values.assign(keys.size(),VALUE_T());
+    results.assign(keys.size(),ERROR_NONEXISTENT);
+    rc=subkeys.empty() ? ERROR_NOERROR : MultiLookupTree(subkeys,subvalues,subresults);
+    for (SIZE_T i=0; !rc && i<maybe.size(); i++) { 
+      values[maybe[i]]=subvalues[i];
+      results[maybe[i]]=subresults[i];
+    }
+  } else {
+    rc=MultiLookupTree(keys,values,results);
+  }
+  for (SIZE_T i=0; !rc && i<found.size(); i++) { 
+    values[found[i].first]=found[i].second;
+    results[found[i].first]=ERROR_NOERROR;
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::MultiLookupTree(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results)
+{
+  vector<SIZE_T> order(keys.size());
+  vector<BTreeBatchRange> level, next;
+  BTreeBatchRange r;
+  BTreeNode b;
+  KEY_T testkey;
+  SIZE_T i, j, depth, offset, ptr, v;
+  ERROR_T rc;
+
+  values.assign(keys.size(),VALUE_T());
+  results.assign(keys.size(),ERROR_NONEXISTENT);
+  if (keys.empty()) { 
+    return ERROR_NOERROR;
+  }
+  if (IsBuffered()) { 
+    // each key has its own path of buffers to look in
+    for (i=0;i<keys.size();i++) { 
+      results[i]=LookupBuffered(keys[i],values[i],true);
+    }
+    return ERROR_NOERROR;
+  }
+  // in a shadow paged index all of them come from one version
+  BTreeSnapshot snap;
+  if (superblock.info.shadow) { 
+    rc = OpenSnapshot(snap);
+    if (rc) { return rc; }
+  }
+  for (i=0;i<keys.size();i++) { 
+    order[i]=i;
+  }
+  sort(order.begin(),order.end(),BTreeBatchOrder(keys));
+
+  rc = buffercache->LatchBlock(superblock_index, false);
+  if (rc) { return rc; }
+  r.block=snap.index ? snap.root : superblock.info.rootnode;
+  r.parent=superblock_index;
+  r.pv=buffercache->GetBlockVersion(superblock_index);
+  buffercache->UnlatchBlock(superblock_index);
+  r.first=0;
+  r.last=keys.size();
+  level.push_back(r);
+
+  for (depth=0; !level.empty(); depth++) { 
+    if (depth>=BTREE_MAX_HEIGHT) { 
+      return ERROR_INSANE;
+    }
+    sort(level.begin(),level.end());
+    next.clear();
+    // ranges sent right by a high key join the level as it is read
+    for (SIZE_T l=0; l<level.size(); l++) { 
+      r=level[l];
+      rc = buffercache->LatchBlock(r.block, false);
+      if (rc) { return rc; }
+      rc = b.Unserialize(buffercache, r.block, superblock.info);
+      v = buffercache->GetBlockVersion(r.block);
+      if (!rc && buffercache->GetBlockVersion(r.parent)!=r.pv) { 
+	// the parent changed under us, so this may be the wrong node
+	buffercache->UnlatchBlock(r.block);
+	for (i=r.first;i<r.last;i++) { 
+	  results[order[i]]=snap.index ? Lookup(snap,keys[order[i]],values[order[i]])
+	    : LookupTree(keys[order[i]],values[order[i]]);
+	}
+	continue;
+      }
+      if (rc) { 
+	buffercache->UnlatchBlock(r.block);
+	for (i=r.first;i<r.last;i++) { 
+	  results[order[i]]=rc;
+	}
+	continue;
+      }
+      TagLevel(r.block, depth);
+
+      if (b.HasHighKey()) { 
+	rc = b.GetHighKey(testkey);
+	for (j=r.first; !rc && j<r.last && !(testkey<keys[order[j]]); j++) { 
+	}
+	if (!rc && j<r.last) { 
+	  BTreeBatchRange right;
+	  right.block=b.GetRightLink();
+	  right.parent=r.block;
+	  right.pv=v;
+	  right.first=j;
+	  right.last=r.last;
+	  level.push_back(right);
+	  r.last=j;
+	}
+      }
+
+      switch (b.info.nodetype) { 
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	// sorted keys go to children in order, so each child gets a run
+	for (i=r.first; i<r.last; i=j) { 
+	  rc = FindChild(b, keys[order[i]], testkey, ptr);
+	  if (rc) { 
+	    results[order[i]]=rc;
+	    j=i+1;
+	    continue;
+	  }
+	  for (j=i+1; j<r.last; j++) { 
+	    SIZE_T other;
+	    if (FindChild(b, keys[order[j]], testkey, other) || other!=ptr) { 
+	      break;
+	    }
+	  }
+	  BTreeBatchRange child;
+	  child.block=ptr;
+	  child.parent=r.block;
+	  child.pv=v;
+	  child.first=i;
+	  child.last=j;
+	  next.push_back(child);
+	}
+	break;
+      case BTREE_LEAF_NODE:
+	// both are sorted, so one pass matches them up
+	offset=0;
+	for (i=r.first; i<r.last; i++) { 
+	  rc=ERROR_NONEXISTENT;
+	  for (; offset<b.info.numkeys; offset++) { 
+	    rc=b.GetKey(offset,testkey);
+	    if (rc) { break; }
+	    if (testkey==keys[order[i]]) { 
+	      rc=GetValue(b,offset,values[order[i]]);
+	      break;
+	    }
+	    if (keys[order[i]]<testkey) { 
+	      rc=ERROR_NONEXISTENT;
+	      break;
+	    }
+	    rc=ERROR_NONEXISTENT;
+	  }
+	  results[order[i]]=rc;
+	}
+	break;
+      default:
+	for (i=r.first;i<r.last;i++) { 
+	  results[order[i]]=ERROR_INSANE;
+	}
+	break;
+      }
+      buffercache->UnlatchBlock(r.block);
+    }
+    level.swap(next);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  //This is really a B+ tree (with optional sequentially linked leaf nodes).
+  //This means that on every key you split, you need to include that key AGAIN in it's >= diskblock, so that is eventually included in a leaf node with it's key/value pair.
+  //This is also what makes deleting a key a nightmare, since you have to get rid of ALL instances of the ky (including the leaf version with the value), and then rebalance.
+  // page 636 in the book has good diagrams of this
+
+  //======ALGORITHM======
+  ERROR_T rc;
+
+  rc = CheckSizes(key, value);
+  if (rc) { return rc; }
+
+  BTreeTransaction *t = GetTransaction();
+  if (t) { 
+    return BufferChange(*t, BTREE_OP_INSERT, key, value);
+  }
+  if (memtablesize) { 
+    return WriteMemtable(BTREE_OP_INSERT, key, value);
+  }
+  if (IsBuffered()) { 
+    return WriteBuffered(BTREE_OP_INSERT, key, value);
+  }
+
+  BTreePath path;
+  pthread_rwlock_rdlock(&applylock);
+  bool shadowed = BeginShadow();
+  buffercache->BeginOperation();
+  rc = InsertInternal(key, value, path);
+  LSN_T lsn = 0;
+  if (rc) { 
+    AbortOperation();
+  } else {
+    lsn = buffercache->CommitOperation();
+  }
+  UnlatchPath(path);
+  rc = EndShadow(shadowed, rc);
+  pthread_rwlock_unlock(&applylock);
+  if (!rc) { 
+    rc = buffercache->ForceLog(lsn);
+  }
+  return rc;
+}
+
+//Insert into a latched path, which the caller releases
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value, BTreePath &path)
+{
+  ERROR_T rc;
+  BTreeNode leafNode;
+  BTreeNode rootNode;
+  SIZE_T leafPtr;
+  SIZE_T rightLeafPtr;
+  VALUE_T stored;
+  bool overflow;
+  KEY_T testkey;
+  SIZE_T offset;
+
+  rc = AddToFilter(key);
+  if (rc) { return rc; }
+
+  //traverse to find the leaf
+  //Use a stack of pointers to track the path down to the node where the key would go.
+  rc = LookupLeaf(key, path, leafNode, BTREE_OP_INSERT);
+
+  //If no keys existent yet, the root has no leaves under it
+  if (rc == ERROR_NONEXISTENT && path.depth == 1) {
+    rc = ReadNode(path.block[0], rootNode);
+    if(rc){ return rc;}
+
+    rc = StoreValue(key, value, stored, overflow);
+    if(rc){ return rc;}
+
+    //Allocate a new block, and set the values to the first key spot.
+    rc = AllocateNode(leafPtr);
+    if(rc){ return rc;}
+    rc = AllocateNode(rightLeafPtr);
+    if(rc){ return rc;}
+    leafNode = NewNode(BTREE_LEAF_NODE);
+    rc = leafNode.InsertKeyVal(0, key, stored, overflow);
+    if(rc){ return rc;}
+    if (superblock.info.linked) {
+      rc = leafNode.SetHighKey(key);
+      if(rc){ return rc;}
+      leafNode.SetRightLink(rightLeafPtr);
+    }
+    rc = WriteNode(leafPtr, leafNode);
+    if(rc){ return rc;}
+
+    //Built right node
+    rc = WriteNode(rightLeafPtr, NewNode(BTREE_LEAF_NODE));
+    if(rc){ return rc;}
+
+    //Connect both to root
+    rc = rootNode.SetPtr(0, leafPtr);
+    if(rc){ return rc;}
+    rc = rootNode.InsertKeyPtr(0, key, rightLeafPtr);
+    if(rc){ return rc;}
+    return WriteNode(path.block[0], rootNode);
+  }
+  if (rc) { return rc;}
+
+  //Walk the leaf node to the first key that is larger than ours
+  for (offset=0; offset<leafNode.info.numkeys; offset++) {
+    rc = leafNode.GetKey(offset, testkey);
+    if (rc) { return rc;}
+    if (key == testkey) {
+      return ERROR_INSERT;
+    }
+    if (key < testkey) {
+      break;
+    }
+  }
+
+  rc = StoreValue(key, value, stored, overflow);
+  if(rc){ return rc;}
+  rc = leafNode.InsertKeyVal(offset, key, stored, overflow);
+  if (rc) { return rc;}
+
+  //Re-serialize after the access and write. 
+  leafPtr = path.block[path.depth-1];
+  rc = WriteNode(leafPtr, leafNode); 
+  if (rc) { return rc;}
+
+  //check if the node is too full, and call rebalance if necessary
+  if (IsOverfull(leafNode)) {
+    rc = Rebalance(path);
+  }
+  return rc;
+}
+
+// Each round goes down to the leaf the smallest pair left belongs in
+// and merges into it, in one pass, the following pairs up to the leaf's
+// bound.  The descent kept what latches one insert needs, so after the
+// first pair the leaf only takes pairs that cannot make it overfull;
+// the rest go in on a later round.  The leaf is then written once, and
+// split at most once.
+ERROR_T BTreeIndex::InsertBatch(const vector<KEY_T> &keys, const vector<VALUE_T> &values, vector<ERROR_T> &results)
+{
+  vector<SIZE_T> order(keys.size());
+  BTreePath path;
+  BTreeNode leafNode;
+  KEY_T upper, testkey;
+  VALUE_T stored;
+  SIZE_T i, j, k, offset;
+  bool bounded, overflow, changed;
+  LSN_T lsn, last=0;
+  ERROR_T rc;
+
+  if (keys.size()!=values.size()) { 
+    return ERROR_SIZE;
+  }
+  results.assign(keys.size(),ERROR_NOERROR);
+  if (GetTransaction() || IsBuffered() || memtablesize) { 
+    // kept aside one by one, to be sorted at commit, in the memtable or
+    // on their way down
+    for (i=0;i<keys.size();i++) { 
+      results[i]=Insert(keys[i],values[i]);
+    }
+    return ERROR_NOERROR;
+  }
+  for (i=0;i<keys.size();i++) { 
+    order[i]=i;
+  }
+  // stable, so that of a repeated key the first one goes in
+  stable_sort(order.begin(),order.end(),BTreeBatchOrder(keys));
+  // and one commit
+  pthread_rwlock_rdlock(&applylock);
+  bool shadowed = BeginShadow();
+
+  for (i=0; i<keys.size(); i=j) { 
+    k=order[i];
+    rc = CheckSizes(keys[k], values[k]);
+    if (rc) { 
+      results[k]=rc;
+      j=i+1;
+      continue;
+    }
+    rc = LookupLeaf(keys[k], path, leafNode, BTREE_OP_INSERT, &upper, &bounded);
+    if (rc == ERROR_NONEXISTENT && path.depth == 1) { 
+      // an empty tree; the first insert builds its leaves
+      UnlatchPath(path);
+      results[k]=Insert(keys[k], values[k]);
+      j=i+1;
+      continue;
+    }
+    if (rc) { 
+      UnlatchPath(path);
+      results[k]=rc;
+      j=i+1;
+      continue;
+    }
+
+    // both are sorted, so one pass merges them
+    buffercache->BeginOperation();
+    changed=false;
+    offset=0;
+    for (j=i; j<keys.size(); j++) { 
+      k=order[j];
+      if (j>i && ((bounded && upper<keys[k]) || !IsSafe(leafNode, BTREE_OP_INSERT))) { 
+	break;
+      }
+      rc = CheckSizes(keys[k], values[k]);
+      if (rc) { 
+	results[k]=rc;
+	continue;
+      }
+      for (; offset<leafNode.info.numkeys; offset++) { 
+	rc = leafNode.GetKey(offset, testkey);
+	if (rc || keys[k]<testkey || keys[k]==testkey) { 
+	  break;
+	}
+      }
+      if (rc) { 
+	results[k]=rc;
+	continue;
+      }
+      if (offset<leafNode.info.numkeys && keys[k]==testkey) { 
+	results[k]=ERROR_INSERT;
+	continue;
+      }
+      rc = AddToFilter(keys[k]);
+      if (!rc) { 
+	rc = StoreValue(keys[k], values[k], stored, overflow);
+      }
+      if (!rc) { 
+	rc = leafNode.InsertKeyVal(offset, keys[k], stored, overflow);
+      }
+      if (rc) { 
+	results[k]=rc;
+	continue;
+      }
+      changed=true;
+    }
+
+    if (changed) { 
+      rc = WriteNode(path.block[path.depth-1], leafNode);
+      if (!rc && IsOverfull(leafNode)) { 
+	rc = Rebalance(path);
+      }
+      if (rc) { 
+	// none of the merged pairs can be trusted to be in
+	for (SIZE_T m=i; m<j; m++) { 
+	  if (results[order[m]]==ERROR_NOERROR) { 
+	    results[order[m]]=rc;
+	  }
+	}
+      }
+    }
+    if (changed && rc) { 
+      AbortOperation();
+    } else {
+      lsn = buffercache->CommitOperation();
+      last = (lsn>last) ? lsn : last;
+    }
+    UnlatchPath(path);
+  }
+  // one force for the whole batch
+  rc = EndShadow(shadowed, ERROR_NOERROR);
+  pthread_rwlock_unlock(&applylock);
+  if (!rc) { 
+    rc = buffercache->ForceLog(last);
+  }
+  if (rc) { 
+    for (i=0; i<keys.size(); i++) { 
+      if (results[i]==ERROR_NOERROR) { 
+	results[i]=rc;
+      }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+//This lookup function will find the path to the leaf where the passed in key would go, and return it as a stack of pointers.
+//The path runs from the root down to the leaf, both included, and the leaf is left in b.
+//Latches are coupled on the way down: a child is latched before its parent is let go.
+//Lookups take shared latches and keep only the leaf.  Writers take exclusive latches and
+//keep every ancestor that a split below could reach, i.e. all of them up to the deepest safe node.
+//The bound is the separator met lowest down that the key went left of.
+ERROR_T BTreeIndex::LookupLeaf(const KEY_T &key, BTreePath &pointerPath, BTreeNode &b, const BTreeOp op,
+			       KEY_T *upper, bool *bounded){
+  ERROR_T rc;
+  KEY_T testkey;
+  SIZE_T ptr;
+  bool exclusive = (op != BTREE_OP_LOOKUP);
+
+  if (superblock.info.linked) {
+    return LookupLeafLinked(key, pointerPath, b, op, upper, bounded);
+  }
+  if (bounded) {
+    *bounded = false;
+  }
+
+  pointerPath.depth = 0;
+  pointerPath.latched = 0;
+
+  //The superblock latch guards the root pointer
+  rc = buffercache->LatchBlock(superblock_index, exclusive);
+  if (rc) { return rc; }
+  pointerPath.superlatched = true;
+  ptr = GetRoot();
+  BTreeShadow *shadow = GetShadow();
+
+  while (true) {
+    if (pointerPath.depth >= BTREE_MAX_HEIGHT) {
+      return ERROR_INSANE;
+    }
+    rc = buffercache->LatchBlock(ptr, exclusive);
+    if (rc) { return rc; }
+    pointerPath.block[pointerPath.depth++] = ptr;
+    if (shadow) {
+      shadow->touched.insert(ptr);
+    }
+    rc = ReadNode(ptr, b);
+    if(rc!=ERROR_NOERROR){
+      return rc;
+    }
+    TagLevel(ptr, pointerPath.depth-1);
+    if (IsSafe(b, op)) {
+      UnlatchPath(pointerPath, 1);
+    }
+
+    switch(b.info.nodetype){
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+        rc = FindChild(b, key, testkey, ptr);
+        if (rc) { return rc; }
+        if (upper && bounded && !(testkey < key)) {
+          *upper = testkey;
+          *bounded = true;
+        }
+        break;
+      case BTREE_LEAF_NODE:
+        return ERROR_NOERROR;
+      default:
+        // We can't be looking at anything other than a root, internal, or leaf
+        return ERROR_INSANE;
+    }
+  }
+}
+
+//Rebalance takes a path of pointers with an overfull node at the bottom of that path.
+//B* style, it first tries to shift keys into a sibling with room, and otherwise
+//splits the node together with its full siblings into one more node.  It then
+//walks up the parent path guaranteeing the sanity of each parent.
+//Every node it changes is latched, either on the path or by Redistribute.
+ERROR_T BTreeIndex::Rebalance(BTreePath &ptrPath)
+{
+  BTreeNode parentNode;
+  SIZE_T level;
+  SIZE_T node;
+  SIZE_T parentPtr;
+  SIZE_T offset;
+  SIZE_T ptrSpot;
+  ERROR_T rc;
+
+  if (superblock.info.linked) {
+    return RebalanceLinked(ptrPath);
+  }
+
+  for (level = ptrPath.depth; level > 0; level--) {
+    node = ptrPath.block[level-1];
+
+    //If we're all the way up at the root, we need to make a new root
+    //and split the old one under it.
+    if (level == 1) {
+      if (!ptrPath.superlatched) {
+        return ERROR_INSANE;
+      }
+      rc = AllocateNode(parentPtr);
+      if (rc) { return rc;}
+      parentNode = NewNode(BTREE_ROOT_NODE);
+      rc = parentNode.SetPtr(0, node);
+      if (rc) { return rc;}
+      rc = Redistribute(parentNode, 0, 1, 2, node);
+      if (rc) { return rc;}
+      rc = WriteNode(parentPtr, parentNode);
+      if (rc) { return rc;}
+      BTreeShadow *shadow = GetShadow();
+      if (shadow) {
+        //The commit switches to it
+        shadow->root = parentPtr;
+        return ERROR_NOERROR;
+      }
+      MutexGuard guard(&alloclock);
+      __atomic_store_n(&superblock.info.rootnode, parentPtr, __ATOMIC_SEQ_CST);
+      return superblock.Serialize(buffercache, superblock_index);
+    }
+
+    //Find the parent node and our place in it.  A safe ancestor
+    //stops the rebalancing before we get above the latched part.
+    if (level-2 < ptrPath.latched) {
+      return ERROR_INSANE;
+    }
+    parentPtr = ptrPath.block[level-2];
+    rc = ReadNode(parentPtr, parentNode);
+    if (rc) { return rc;}
+
+    for (offset = 0; offset <= parentNode.info.numkeys; offset++) {
+      rc = parentNode.GetPtr(offset, ptrSpot);
+      if (rc) { return rc;}
+      if (ptrSpot == node) {
+        break;
+      }
+    }
+    if (offset > parentNode.info.numkeys) {
+      return ERROR_INSANE;
+    }
+
+    SIZE_T fanin = SplitFanIn();
+    SIZE_T numchildren = parentNode.info.numkeys+1;
+
+    rc = ERROR_NOSPACE;
+    if (fanin > 1) {
+      //Shift keys into the right or left sibling if it has room
+      if (offset+1 < numchildren) {
+        rc = Redistribute(parentNode, offset, 2, 2, node);
+      }
+      if (rc == ERROR_NOSPACE && offset > 0) {
+        rc = Redistribute(parentNode, offset-1, 2, 2, node);
+      }
+    }
+    //Otherwise split fanin neighboring siblings, ours included, into fanin+1
+    //Falls back to fewer siblings if the parent can't take the new keys.
+    for (SIZE_T n = (fanin < numchildren ? fanin : numchildren); rc == ERROR_NOSPACE && n >= 1; n--) {
+      SIZE_T first = (offset < numchildren-n) ? offset : numchildren-n;
+      rc = Redistribute(parentNode, first, n, n+1, node);
+    }
+    if (rc) { return rc;}
+
+    rc = WriteNode(parentPtr, parentNode);
+    if (rc) { return rc;}
+
+    //Check the length of the parent and go on rebalancing if necessary
+    if (!IsOverfull(parentNode)) {
+      return ERROR_NOERROR;
+    }
+  }
+  return ERROR_INSANE;
+}
+
+//B-link descent.  Each node is latched only while it is read, and a node
+//that has been split since its parent was read is left through its right
+//link (Lehman and Yao).  The path holds the node visited on each level,
+//root first; only its last block, the leaf, is still latched on return.
+//Writers latch the leaf exclusive, and the empty root too, since that is
+//where the first insert goes.
+ERROR_T BTreeIndex::LookupLeafLinked(const KEY_T &key, BTreePath &path, BTreeNode &b, const BTreeOp op,
+				     KEY_T *upper, bool *bounded)
+{
+  ERROR_T rc;
+  KEY_T testkey;
+  SIZE_T ptr;
+  bool exclusive;
+
+  if (bounded) {
+    *bounded = false;
+  }
+  path.depth = 0;
+  path.latched = 0;
+  path.superlatched = false;
+
+  rc = buffercache->LatchBlock(superblock_index, false);
+  if (rc) { return rc; }
+  ptr = superblock.info.rootnode;
+  buffercache->UnlatchBlock(superblock_index);
+
+  while (true) {
+    if (path.depth >= BTREE_MAX_HEIGHT) {
+      return ERROR_INSANE;
+    }
+    exclusive = false;
+    rc = buffercache->LatchBlock(ptr, false);
+    if (rc) { return rc; }
+    path.latched = path.depth;
+    path.block[path.depth++] = ptr;
+    rc = b.Unserialize(buffercache, ptr, superblock.info);
+    if (rc) { return rc; }
+
+    //We only know this is the node a writer changes once we have read it
+    if (op != BTREE_OP_LOOKUP && (b.info.nodetype == BTREE_LEAF_NODE || b.info.numkeys == 0)) {
+      buffercache->UnlatchBlock(ptr);
+      path.latched = path.depth;
+      rc = buffercache->LatchBlock(ptr, true);
+      if (rc) { return rc; }
+      path.latched = path.depth-1;
+      exclusive = true;
+      rc = b.Unserialize(buffercache, ptr, superblock.info);
+      if (rc) { return rc; }
+    }
+
+    rc = MoveRight(key, path, b, exclusive);
+    if (rc) { return rc; }
+    TagLevel(path.block[path.depth-1], path.depth-1);
+
+    switch(b.info.nodetype){
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+        rc = FindChild(b, key, testkey, ptr);
+        if (rc) { return rc; }
+        UnlatchPath(path);
+        break;
+      case BTREE_LEAF_NODE:
+        //The high key bounds the leaf exactly
+        if (upper && bounded && b.HasHighKey()) {
+          rc = b.GetHighKey(*upper);
+          if (rc) { return rc; }
+          *bounded = true;
+        }
+        return ERROR_NOERROR;
+      default:
+        return ERROR_INSANE;
+    }
+  }
+}
+
+ERROR_T BTreeIndex::MoveRight(const KEY_T &key, BTreePath &path, BTreeNode &b, const bool exclusive)
+{
+  ERROR_T rc;
+  KEY_T highKey;
+  SIZE_T right;
+
+  while (b.HasHighKey()) {
+    rc = b.GetHighKey(highKey);
+    if (rc) { return rc; }
+    if (!(highKey < key)) {
+      return ERROR_NOERROR;
+    }
+    right = b.GetRightLink();
+    if (right == 0) {
+      return ERROR_INSANE;
+    }
+    //Latch the sibling before letting go, so nothing slips between the two
+    rc = buffercache->LatchBlock(right, exclusive);
+    if (rc) { return rc; }
+    buffercache->UnlatchBlock(path.block[path.depth-1]);
+    path.block[path.depth-1] = right;
+    rc = b.Unserialize(buffercache, right, superblock.info);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+//B-link split.  The overfull node at the bottom of the path is split in
+//two, the new right half linked in after it, and the node released before
+//the separator is posted to the level above.  Until then readers reach the
+//right half through the link.  Posting finds its place by key, so
+//separators of nodes split in the meantime may go up in any order.  The
+//path's ancestors are only hints: they may have split, or if the root has,
+//there is no entry for the level above and we go down again to find it.
+ERROR_T BTreeIndex::RebalanceLinked(BTreePath &path)
+{
+  BTreeNode parentNode;
+  BTreeNode leaf;
+  KEY_T sep;
+  KEY_T testkey;
+  SIZE_T node;
+  SIZE_T right;
+  SIZE_T offset;
+  SIZE_T height;   //of the node being split, leaves being 0
+  ERROR_T rc;
+
+  for (height = 0; ; height++) {
+    node = path.block[path.depth-1];
+
+    //Split in memory under a parent of our own
+    parentNode = NewNode(BTREE_ROOT_NODE);
+    rc = parentNode.SetPtr(0, node);
+    if (rc) { return rc;}
+    rc = Redistribute(parentNode, 0, 1, 2, node);
+    if (rc) { return rc;}
+    rc = parentNode.GetKey(0, sep);
+    if (rc) { return rc;}
+    rc = parentNode.GetPtr(1, right);
+    if (rc) { return rc;}
+
+    if (path.depth == 1) {
+      //Still the root, so its parent becomes the new root.  We keep the
+      //node latched until then so that no one else can split it first.
+      rc = buffercache->LatchBlock(superblock_index, true);
+      if (rc) { return rc;}
+      path.superlatched = true;
+      if (superblock.info.rootnode == node) {
+        rc = AllocateNode(offset);
+        if (rc) { return rc;}
+        rc = parentNode.Serialize(buffercache, offset);
+        if (rc) { return rc;}
+        MutexGuard guard(&alloclock);
+        __atomic_store_n(&superblock.info.rootnode, offset, __ATOMIC_SEQ_CST);
+        return superblock.Serialize(buffercache, superblock_index);
+      }
+      //A half split is a tree in its own right, so it can commit
+      //before the split node is let go
+      if (!path.whole) {
+        buffercache->CommitOperation();
+        buffercache->BeginOperation();
+      }
+      UnlatchPath(path);
+      rc = LookupLeafLinked(sep, path, leaf, BTREE_OP_LOOKUP);
+      UnlatchPath(path);
+      if (rc) { return rc;}
+      if (path.depth < height+2) {
+        return ERROR_INSANE;
+      }
+      path.depth -= height+1;
+    } else {
+      if (!path.whole) {
+        buffercache->CommitOperation();
+        buffercache->BeginOperation();
+      }
+      UnlatchPath(path);
+      path.depth--;
+    }
+
+    //Latch the level above and find the node the separator goes in
+    rc = buffercache->LatchBlock(path.block[path.depth-1], true);
+    if (rc) { return rc;}
+    path.latched = path.depth-1;
+    rc = parentNode.Unserialize(buffercache, path.block[path.depth-1], superblock.info);
+    if (rc) { return rc;}
+    rc = MoveRight(sep, path, parentNode, true);
+    if (rc) { return rc;}
+
+    for (offset = 0; offset < parentNode.info.numkeys; offset++) {
+      rc = parentNode.GetKey(offset, testkey);
+      if (rc) { return rc;}
+      if (sep == testkey) {
+        return ERROR_INSANE;
+      }
+      if (sep < testkey) {
+        break;
+      }
+    }
+    rc = parentNode.InsertKeyPtr(offset, sep, right);
+    if (rc) { return rc;}
+    rc = parentNode.Serialize(buffercache, path.block[path.depth-1]);
+    if (rc) { return rc;}
+
+    if (!IsOverfull(parentNode)) {
+      return ERROR_NOERROR;
+    }
+  }
+}
+
+//Exclusive latches on the siblings a redistribution reads and rewrites,
+//released when it returns
+class SiblingLatches {
+ private:
+  BufferCache *cache;
+  SIZE_T block[BTREE_MAX_SPLIT_FANIN];
+  SIZE_T num;
+ public:
+  SiblingLatches(BufferCache *c) : cache(c), num(0) {}
+  ~SiblingLatches() {
+    while (num > 0) {
+      cache->UnlatchBlock(block[--num]);
+    }
+  }
+  ERROR_T Latch(const SIZE_T b) {
+    ERROR_T rc = cache->LatchBlock(b, true);
+    if (rc == ERROR_NOERROR) {
+      block[num++] = b;
+    }
+    return rc;
+  }
+};
+
+//Redistribute spreads the entries of numin children of parent, starting at
+//child first, evenly over numout nodes.  The first numin nodes reuse the old
+//blocks and the rest are allocated.  The separators in parent are replaced
+//(but parent is not written).  Returns ERROR_NOSPACE, having changed nothing,
+//if the entries don't fit.  The caller holds parent and the child held
+//latched; the other children are latched here.
+ERROR_T BTreeIndex::Redistribute(BTreeNode &parent, const SIZE_T first, const SIZE_T numin, const SIZE_T numout,
+                                 const SIZE_T held)
+{
+  SiblingLatches latches(buffercache);
+  std::vector<SIZE_T> blocks;
+  std::vector<KEY_T> keys;
+  std::vector<VALUE_T> vals;
+  std::vector<bool> overflows;
+  std::vector<SIZE_T> ptrs;
+  std::vector<SIZE_T> weights;
+  std::vector<KEY_T> msgkeys;   //buffered format, in key order
+  std::vector<VALUE_T> msgvals;
+  BTreeNode b;
+  KEY_T keySpot;
+  VALUE_T valSpot;
+  SIZE_T ptrSpot;
+  SIZE_T i, j;
+  ERROR_T rc;
+  bool leaf = false;
+  KEY_T highKey;        //of the last child, B-link only
+  bool hasHighKey = false;
+  SIZE_T rightLink = 0;
+
+  //Gather all the entries, with the separators between the children
+  for (i = 0; i < numin; i++) {
+    rc = parent.GetPtr(first+i, ptrSpot);
+    if (rc) { return rc;}
+    blocks.push_back(ptrSpot);
+    if (ptrSpot != held) {
+      rc = latches.Latch(ptrSpot);
+      if (rc) { return rc;}
+    }
+    rc = ReadNode(ptrSpot, b);
+    if (rc) { return rc;}
+    leaf = (b.info.nodetype == BTREE_LEAF_NODE);
+    if (superblock.info.linked && i+1 == numin) {
+      hasHighKey = b.HasHighKey();
+      if (hasHighKey) {
+        rc = b.GetHighKey(highKey);
+        if (rc) { return rc;}
+      }
+      rightLink = b.GetRightLink();
+    }
+    if (leaf) {
+      for (j = 0; j < b.info.numkeys; j++) {
+        rc = b.GetKey(j, keySpot);
+        if (rc) { return rc;}
+        rc = b.GetVal(j, valSpot);
+        if (rc) { return rc;}
+        keys.push_back(keySpot);
+        vals.push_back(valSpot);
+        overflows.push_back(b.IsValOverflow(j));
+        weights.push_back(b.IsSlotted() ? b.GetRecordBytes(j) : 1);
+      }
+    } else {
+      if (i > 0) {
+        rc = parent.GetKey(first+i-1, keySpot);
+        if (rc) { return rc;}
+        keys.push_back(keySpot);
+        weights.push_back(InteriorWeight(b, keySpot));
+      }
+      for (j = 0; j <= b.info.numkeys; j++) {
+        rc = b.GetPtr(j, ptrSpot);
+        if (rc) { return rc;}
+        ptrs.push_back(ptrSpot);
+        if (j == b.info.numkeys) {
+          break;
+        }
+        rc = b.GetKey(j, keySpot);
+        if (rc) { return rc;}
+        keys.push_back(keySpot);
+        weights.push_back(InteriorWeight(b, keySpot));
+      }
+      for (j = 0; j < b.info.nummessages; j++) {
+        rc = b.GetMessage(j, keySpot, valSpot);
+        if (rc) { return rc;}
+        msgkeys.push_back(keySpot);
+        msgvals.push_back(valSpot);
+      }
+    }
+  }
+
+  //Choose where to cut.  Leaf node j gets keys [cut[j], cut[j+1]), and its
+  //last key is copied up.  Interior node j gets the keys strictly between
+  //cut[j]-1 and cut[j+1]-1, and key cut[j+1]-1 moves up.
+  SIZE_T n = keys.size();
+  SIZE_T total = 0, sofar = 0;
+  SIZE_T gap = leaf ? 0 : 1;   // keys moving up between nodes
+  std::vector<SIZE_T> cut(numout+1);
+
+  if (n+gap < numout*(1+gap)) {
+    return ERROR_NOSPACE;
+  }
+  for (i = 0; i < n; i++) {
+    total += weights[i];
+  }
+  cut[0] = 0;
+  cut[numout] = n+gap;
+  for (i = 0, j = 1; j < numout; j++) {
+    while (i < n && 
+           (sofar+weights[i])*numout <= total*j) {
+      sofar += weights[i++];
+    }
+    SIZE_T lo = cut[j-1]+1+gap;
+    SIZE_T hi = n+gap-(numout-j)*(1+gap);
+    cut[j] = (i+gap < lo) ? lo : (i+gap > hi) ? hi : i+gap;
+  }
+
+  //Build the new nodes in memory
+  std::vector<BTreeNode> nodes(numout);
+  std::vector<KEY_T> seps(numout-1);
+  int newType = leaf ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE;
+  SIZE_T m = 0;
+
+  for (j = 0; j < numout; j++) {
+    nodes[j] = NewNode(newType);
+    if (leaf) {
+      for (i = cut[j]; i < cut[j+1]; i++) {
+        rc = nodes[j].InsertKeyVal(i-cut[j], keys[i], vals[i], overflows[i]);
+        if (rc) { return rc;}
+      }
+      if (j+1 < numout) {
+        seps[j] = keys[cut[j+1]-1];
+      }
+    } else {
+      rc = nodes[j].SetPtr(0, ptrs[cut[j]]);
+      if (rc) { return rc;}
+      for (i = cut[j]; i+1 < cut[j+1]; i++) {
+        rc = nodes[j].InsertKeyPtr(i-cut[j], keys[i], ptrs[i+1]);
+        if (rc) { return rc;}
+      }
+      if (j+1 < numout) {
+        seps[j] = keys[cut[j+1]-1];
+      }
+      //Each node keeps the messages for the keys it now covers
+      for (; m < msgkeys.size() && (j+1 == numout || !(seps[j] < msgkeys[m])); m++) {
+        rc = nodes[j].InsertMessage(nodes[j].info.nummessages, msgkeys[m], msgvals[m]);
+        if (rc) { return rc;}
+      }
+    }
+    //In a B-link tree each node's high key is the separator to its right
+    if (superblock.info.linked && (j+1 < numout || hasHighKey)) {
+      rc = nodes[j].SetHighKey(j+1 < numout ? seps[j] : highKey);
+      if (rc) { return rc;}
+    }
+    if (IsOverfull(nodes[j])) {
+      return ERROR_NOSPACE;
+    }
+  }
+
+  //Fix up a copy of the parent, so that we can still back out
+  BTreeNode newParent = parent;
+  for (j = 0; j+1 < numout; j++) {
+    if (j+1 < numin) {
+      rc = newParent.SetKey(first+j, seps[j]);
+    } else {
+      rc = newParent.InsertKeyPtr(first+j, seps[j], 0);
+    }
+    if (rc) { return rc;}
+  }
+
+  //Commit: allocate the extra nodes and write everything
+  for (j = numin; j < numout; j++) {
+    rc = AllocateNode(ptrSpot);
+    if (rc) { return rc;}
+    blocks.push_back(ptrSpot);
+    rc = newParent.SetPtr(first+j, ptrSpot);
+    if (rc) { return rc;}
+  }
+  //Right to left, so that a right link never leads to an unwritten node
+  for (j = numout; j > 0; j--) {
+    if (superblock.info.linked) {
+      nodes[j-1].SetRightLink(j < numout ? blocks[j] : rightLink);
+    }
+    rc = WriteNode(blocks[j-1], nodes[j-1]);
+    if (rc) { return rc;}
+  }
+  parent = newParent;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+
+  rc = CheckSizes(key, value);
+  if (rc) { return rc; }
+
+  BTreeTransaction *t = GetTransaction();
+  if (t) { 
+    return BufferChange(*t, BTREE_OP_UPDATE, key, value);
+  }
+  if (memtablesize) { 
+    rc = WriteMemtable(BTREE_OP_UPDATE, key, value);
+  } else if (IsBuffered()) { 
+    rc = WriteBuffered(BTREE_OP_UPDATE, key, value);
+  } else {
+    VALUE_T val = value;
+    pthread_rwlock_rdlock(&applylock);
+    bool shadowed = BeginShadow();
+    rc = LookupOrUpdateInternal(BTREE_OP_UPDATE, key, val);
+    rc = EndShadow(shadowed, rc);
+    pthread_rwlock_unlock(&applylock);
+  }
+  ForgetResult(key);
+  return rc;
+}
+
+
+BTreeTransaction *BTreeIndex::GetTransaction() const
+{
+  return (BTreeTransaction *)pthread_getspecific(txnkey);
+}
+
+
+ERROR_T BTreeIndex::Begin()
+{
+  if (GetTransaction()) { 
+    return ERROR_CONFLICT;
+  }
+  pthread_setspecific(txnkey,new BTreeTransaction);
+  return ERROR_NOERROR;
+}
+
+
+// The checks Insert and Update would make, against the transaction's
+// own changes first
+ERROR_T BTreeIndex::BufferChange(BTreeTransaction &t, const BTreeOp op, const KEY_T &key, const VALUE_T &value)
+{
+  map<KEY_T, BTreeChange>::iterator c=t.changes.find(key);
+  VALUE_T old;
+  ERROR_T rc;
+
+  if (c!=t.changes.end()) { 
+    if (op==BTREE_OP_INSERT) { 
+      return ERROR_INSERT;
+    }
+    // still an insert, if it was one
+    (*c).second.value=value;
+    return ERROR_NOERROR;
+  }
+  rc=LookupCommitted(key,old);
+  if (op==BTREE_OP_INSERT) { 
+    if (rc==ERROR_NOERROR) { 
+      return ERROR_INSERT;
+    }
+    if (rc!=ERROR_NONEXISTENT) { 
+      return rc;
+    }
+  } else if (rc) { 
+    return rc;
+  }
+  BTreeChange &n=t.changes[key];
+  n.value=value;
+  n.insert=(op==BTREE_OP_INSERT);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::CheckChanges(const BTreeTransaction &t)
+{
+  map<KEY_T, BTreeChange>::const_iterator c;
+  VALUE_T old;
+  ERROR_T rc;
+
+  for (c=t.changes.begin(); c!=t.changes.end(); c++) { 
+    rc=LookupTree((*c).first,old);
+    if ((*c).second.insert) { 
+      if (rc==ERROR_NOERROR) { 
+	return ERROR_INSERT;
+      }
+      if (rc!=ERROR_NONEXISTENT) { 
+	return rc;
+      }
+    } else if (rc) { 
+      return rc;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+// The cache has the blocks back as they were, but the superblock we
+// keep may still name a root the operation made
+void BTreeIndex::AbortOperation()
+{
+  BTreeNode b;
+
+  buffercache->AbortOperation();
+  MutexGuard guard(&alloclock);
+  if (b.Unserialize(buffercache,superblock_index)==ERROR_NOERROR) { 
+    __atomic_store_n(&superblock.info.rootnode,b.info.rootnode,__ATOMIC_SEQ_CST);
+  }
+}
+
+
+// Other writers are kept out for the whole of it, so no one builds on
+// half of it before it commits, and lookups that overlap it look again
+// once it is done (see Lookup).  Every change is checked
+// before any is made, as others may have written its key since it was
+// buffered; one that still fails part way through (e.g. for want of
+// space) is aborted, and none of it is logged as committed.  Changes
+// to neighbouring keys mostly go to the same leaves, which are then
+// still in the cache.
+ERROR_T BTreeIndex::Commit()
+{
+  BTreeTransaction *t=GetTransaction();
+  vector<SIZE_T> chains;
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (!t) { 
+    return ERROR_GENERAL;
+  }
+  // from here on the changes go to the tree
+  pthread_setspecific(txnkey,0);
+  if (memtablesize) { 
+    rc = CommitToMemtable(*t);
+    for (map<KEY_T, BTreeChange>::iterator c=t->changes.begin(); c!=t->changes.end(); c++) { 
+      ForgetResult((*c).first);
+    }
+    delete t;
+    return rc;
+  }
+
+  pthread_rwlock_wrlock(&applylock);
+  rc = CheckChanges(*t);
+  if (rc) { 
+    pthread_rwlock_unlock(&applylock);
+    delete t;
+    return rc;
+  }
+  // lookups from here on wait for us
+  __atomic_add_fetch(&applyseq,1,__ATOMIC_SEQ_CST);
+  bool shadowed = BeginShadow();
+  if (IsBuffered()) { 
+    pthread_mutex_lock(&writerlock);
+  }
+  SIZE_T freelist = superblock.info.freelist;
+  buffercache->BeginOperation();
+  for (map<KEY_T, BTreeChange>::iterator c=t->changes.begin(); !rc && c!=t->changes.end(); c++) { 
+    if (IsBuffered()) { 
+      rc = PutBuffered((*c).second.insert ? BTREE_OP_INSERT : BTREE_OP_UPDATE,
+		       (*c).first, (*c).second.value, chains);
+    } else if ((*c).second.insert) { 
+      BTreePath path;
+      path.whole = true;
+      rc = InsertInternal((*c).first, (*c).second.value, path);
+      UnlatchPath(path);
+    } else {
+      SIZE_T chain;
+      rc = LookupOrUpdateInternal(BTREE_OP_UPDATE, (*c).first, (*c).second.value, &chain);
+      if (!rc && chain) { 
+	chains.push_back(chain);
+      }
+    }
+  }
+  LSN_T lsn = 0;
+  if (rc) { 
+    AbortOperation();
+    if (buffercache->GetWriteAheadLog() && !superblock.info.shadow) { 
+      // No one else allocated meanwhile, and the nodes we took are
+      // back as they were on the free list, so they can go back on it
+      MutexGuard guard(&alloclock);
+      superblock.info.freelist = freelist;
+      buffercache->BeginOperation();
+      superblock.Serialize(buffercache, superblock_index);
+      buffercache->CommitOperation();
+    }
+  } else {
+    lsn = buffercache->CommitOperation();
+  }
+  // the old values' chains, now that nothing points at them
+  for (SIZE_T i=0; !rc && i<chains.size(); i++) { 
+    rc = FreeOverflow(chains[i]);
+  }
+  if (IsBuffered()) { 
+    pthread_mutex_unlock(&writerlock);
+  }
+  rc = EndShadow(shadowed, rc);
+  __atomic_add_fetch(&applyseq,1,__ATOMIC_SEQ_CST);
+  pthread_rwlock_unlock(&applylock);
+  for (map<KEY_T, BTreeChange>::iterator c=t->changes.begin(); c!=t->changes.end(); c++) { 
+    ForgetResult((*c).first);
+  }
+  delete t;
+  if (!rc) { 
+    rc = buffercache->ForceLog(lsn);
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Abort()
+{
+  BTreeTransaction *t=GetTransaction();
+
+  if (!t) { 
+    return ERROR_GENERAL;
+  }
+  pthread_setspecific(txnkey,0);
+  delete t;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  // This is optional extra credit 
+  //
+  // 
+  return ERROR_UNIMPL;
+}
+
+
+//
+// Result cache
+//
+
+void BTreeIndex::SetResultCacheSize(const SIZE_T size)
+{
+  MutexGuard guard(&resultlock);
+
+  delete resultcache;
+  resultcache = size ? new ResultCache(size) : 0;
+}
+
+
+void BTreeIndex::ForgetResult(const KEY_T &key)
+{
+  if (resultcache) { 
+    MutexGuard guard(&resultlock);
+    resultcache->Forget(key);
+  }
+}
+
+
+//
+// Memtable
+//
+
+ERROR_T BTreeIndex::SetMemtableSize(const SIZE_T size)
+{
+  bool full;
+
+  // the memtable is not logged, so a crash would lose changes the log
+  // has been trusted to keep
+  if (size && buffercache->GetWriteAheadLog()) { 
+    return ERROR_BADCONFIG;
+  }
+  {
+    MutexGuard guard(&memtablelock);
+    memtablesize=size;
+    full=(memtable.size()>=size);
+  }
+  return full ? MergeMemtable() : ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::MergeMemtable()
+{
+  MutexGuard guard(&mergelock);
+
+  return MergeMemtableLocked();
+}
+
+
+// A writer that fills the memtable while another thread merges leaves
+// it to the next writer after that merge, rather than waiting
+ERROR_T BTreeIndex::StartMerge()
+{
+  ERROR_T rc;
+
+  if (pthread_mutex_trylock(&mergelock)) { 
+    return ERROR_NOERROR;
+  }
+  rc=MergeMemtableLocked();
+  pthread_mutex_unlock(&mergelock);
+  return rc;
+}
+
+
+// The memtable's change to key, or else that of the one being merged,
+// or 0.  memtablelock is held.
+const BTreeChange *BTreeIndex::FindMemtable(const KEY_T &key) const
+{
+  map<KEY_T, BTreeChange>::const_iterator c=memtable.find(key);
+
+  if (c!=memtable.end()) { 
+    return &(*c).second;
+  }
+  c=merging.find(key);
+  return (c!=merging.end()) ? &(*c).second : 0;
+}
+
+
+ERROR_T BTreeIndex::LookupMemtable(const KEY_T &key, VALUE_T &value) const
+{
+  if (!memtablesize) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  MutexGuard guard(&memtablelock);
+  const BTreeChange *c=FindMemtable(key);
+
+  if (!c) { 
+    return ERROR_NONEXISTENT;
+  }
+  value=c->value;
+  return ERROR_NOERROR;
+}
+
+
+// Whether each key is in the memtable, the one being merged or the
+// tree.  memtablelock is held, but let go of while we look in the
+// tree, so that writers and lookups of the memtable do not wait on its
+// reads.  The tree only changes by merges, so what it said of a key
+// still holds if no merge has finished meanwhile and the key has not
+// come into the memtable.
+void BTreeIndex::FindKeysLocked(const vector<KEY_T> &keys, vector<ERROR_T> &results)
+{
+  vector<SIZE_T> intree;
+  VALUE_T old;
+  SIZE_T merges, i;
+
+  results.assign(keys.size(),ERROR_NOERROR);
+  for (i=0;i<keys.size();i++) { 
+    if (!FindMemtable(keys[i])) { 
+      intree.push_back(i);
+    }
+  }
+  if (intree.empty()) { 
+    return;
+  }
+  do {
+    merges=nummerges;
+    pthread_mutex_unlock(&memtablelock);
+    for (i=0;i<intree.size();i++) { 
+      results[intree[i]]=LookupTree(keys[intree[i]],old);
+    }
+    pthread_mutex_lock(&memtablelock);
+  } while (merges!=nummerges);
+  for (i=0;i<intree.size();i++) { 
+    if (FindMemtable(keys[intree[i]])) { 
+      results[intree[i]]=ERROR_NOERROR;
+    }
+  }
+}
+
+
+// The checks Insert and Update would make, against the memtable first.
+// A key being merged is in the tree as far as we are concerned.
+ERROR_T BTreeIndex::WriteMemtable(const BTreeOp op, const KEY_T &key, const VALUE_T &value)
+{
+  vector<KEY_T> keys(1,key);
+  vector<ERROR_T> found;
+  ERROR_T rc;
+  bool full;
+
+  pthread_mutex_lock(&memtablelock);
+  FindKeysLocked(keys,found);
+  rc=found[0];
+  if (op==BTREE_OP_INSERT) { 
+    rc = (rc==ERROR_NOERROR) ? ERROR_INSERT : (rc==ERROR_NONEXISTENT) ? ERROR_NOERROR : rc;
+  }
+  if (!rc) { 
+    map<KEY_T, BTreeChange>::iterator c=memtable.find(key);
+    if (c!=memtable.end()) { 
+      (*c).second.value=value;
+    } else {
+      BTreeChange &n=memtable[key];
+      n.value=value;
+      n.insert=(op==BTREE_OP_INSERT);
+    }
+  }
+  full=(!rc && memtable.size()>=memtablesize);
+  pthread_mutex_unlock(&memtablelock);
+  return full ? StartMerge() : rc;
+}
+
+
+// Checked again, as things stand now, and then all put in the memtable
+// or, if one fails, none of them
+ERROR_T BTreeIndex::CommitToMemtable(BTreeTransaction &t)
+{
+  map<KEY_T, BTreeChange>::iterator c;
+  vector<KEY_T> keys;
+  vector<ERROR_T> found;
+  ERROR_T rc=ERROR_NOERROR;
+  SIZE_T i;
+  bool full;
+
+  for (c=t.changes.begin(); c!=t.changes.end(); c++) { 
+    keys.push_back((*c).first);
+  }
+  pthread_mutex_lock(&memtablelock);
+  FindKeysLocked(keys,found);
+  for (c=t.changes.begin(), i=0; !rc && c!=t.changes.end(); c++, i++) { 
+    if ((*c).second.insert) { 
+      rc = (found[i]==ERROR_NOERROR) ? ERROR_INSERT : (found[i]==ERROR_NONEXISTENT) ? ERROR_NOERROR : found[i];
+    } else {
+      rc = found[i];
+    }
+  }
+  for (c=t.changes.begin(); !rc && c!=t.changes.end(); c++) { 
+    map<KEY_T, BTreeChange>::iterator m=memtable.find((*c).first);
+    if (m==memtable.end()) { 
+      memtable.insert(*c);
+    } else {
+      (*m).second.value=(*c).second.value;
+    }
+  }
+  full=(!rc && memtable.size()>=memtablesize);
+  pthread_mutex_unlock(&memtablelock);
+  return full ? StartMerge() : rc;
+}
+
+
+// The memtable is swapped for an empty one under memtablelock, and the
+// old one merged without it, so that writers and lookups go on
+// meanwhile; lookups look in both until the merge is done.  If a merge
+// fails, its changes go back in the memtable under any made since, and
+// merging them again does no harm.
+ERROR_T BTreeIndex::MergeMemtableLocked()
+{
+  map<KEY_T, BTreeChange>::const_iterator c;
+  ERROR_T rc;
+
+  {
+    MutexGuard guard(&memtablelock);
+    merging.swap(memtable);
+  }
+  if (merging.empty()) { 
+    return ERROR_NOERROR;
+  }
+  rc=MergeChanges();
+
+  MutexGuard guard(&memtablelock);
+  if (rc) { 
+    for (c=merging.begin(); c!=merging.end(); c++) { 
+      map<KEY_T, BTreeChange>::iterator m=memtable.find((*c).first);
+      if (m==memtable.end()) { 
+	memtable.insert(*c);
+      } else {
+	(*m).second.insert=(*c).second.insert;
+      }
+    }
+  } else {
+    nummerges++;
+    nummerged+=merging.size();
+  }
+  merging.clear();
+  return rc;
+}
+
+
+// Every change was checked on its way in, so each goes in as it is: a
+// key the leaf has gets its new value, and one it lacks goes in
+ERROR_T BTreeIndex::MergeChanges()
+{
+  map<KEY_T, BTreeChange>::const_iterator c, d;
+  vector<SIZE_T> chains;
+  BTreePath path;
+  BTreeNode leafNode;
+  KEY_T upper, testkey;
+  VALUE_T stored;
+  SIZE_T offset, chain, i;
+  bool bounded, overflow;
+  LSN_T lsn, last=0;
+  ERROR_T rc=ERROR_NOERROR;
+
+  pthread_rwlock_rdlock(&applylock);
+  if (IsBuffered()) { 
+    // the buffers batch them as they go down
+    pthread_mutex_lock(&writerlock);
+    buffercache->BeginOperation();
+    for (c=merging.begin(); !rc && c!=merging.end(); c++) { 
+      rc = PutBuffered((*c).second.insert ? BTREE_OP_INSERT : BTREE_OP_UPDATE,
+		       (*c).first, (*c).second.value, chains);
+    }
+    if (rc) { 
+      AbortOperation();
+    } else {
+      last = buffercache->CommitOperation();
+    }
+    for (i=0; !rc && i<chains.size(); i++) { 
+      rc = FreeOverflow(chains[i]);
+    }
+    pthread_mutex_unlock(&writerlock);
+    pthread_rwlock_unlock(&applylock);
+    if (!rc) { 
+      rc = buffercache->ForceLog(last);
+    }
+    return rc;
+  }
+
+  bool shadowed = BeginShadow();
+  for (c=merging.begin(); !rc && c!=merging.end(); c=d) { 
+    rc = LookupLeaf((*c).first, path, leafNode, BTREE_OP_INSERT, &upper, &bounded);
+    if (rc == ERROR_NONEXISTENT && path.depth == 1) { 
+      // an empty tree; the first insert builds its leaves
+      UnlatchPath(path);
+      buffercache->BeginOperation();
+      rc = InsertInternal((*c).first, (*c).second.value, path);
+      if (rc) { 
+	AbortOperation();
+      } else {
+	lsn = buffercache->CommitOperation();
+	last = (lsn>last) ? lsn : last;
+      }
+      UnlatchPath(path);
+      d = c;
+      d++;
+      continue;
+    }
+    if (rc) { 
+      UnlatchPath(path);
+      break;
+    }
+
+    // both are sorted, so one pass merges them
+    buffercache->BeginOperation();
+    chains.clear();
+    offset=0;
+    for (d=c; !rc && d!=merging.end(); d++) { 
+      if (d!=c && ((bounded && upper<(*d).first) || !IsSafe(leafNode, BTREE_OP_INSERT))) { 
+	break;
+      }
+      for (; offset<leafNode.info.numkeys; offset++) { 
+	rc = leafNode.GetKey(offset, testkey);
+	if (rc || (*d).first<testkey || (*d).first==testkey) { 
+	  break;
+	}
+      }
+      if (!rc) { 
+	rc = StoreValue((*d).first, (*d).second.value, stored, overflow);
+      }
+      if (rc) { 
+	break;
+      }
+      if (offset<leafNode.info.numkeys && (*d).first==testkey) { 
+	chain = ValueChain(leafNode, offset);
+	rc = leafNode.SetVal(offset, stored, overflow);
+	if (!rc && chain) { 
+	  chains.push_back(chain);
+	}
+      } else {
+	rc = AddToFilter((*d).first);
+	if (!rc) { 
+	  rc = leafNode.InsertKeyVal(offset, (*d).first, stored, overflow);
+	}
+      }
+    }
+    if (!rc) { 
+      rc = WriteNode(path.block[path.depth-1], leafNode);
+    }
+    if (!rc && IsOverfull(leafNode)) { 
+      rc = Rebalance(path);
+    }
+    if (rc) { 
+      AbortOperation();
+    } else {
+      lsn = buffercache->CommitOperation();
+      last = (lsn>last) ? lsn : last;
+    }
+    UnlatchPath(path);
+    // the old values' chains, now that nothing points at them
+    for (i=0; !rc && i<chains.size(); i++) { 
+      rc = FreeOverflow(chains[i]);
+    }
+    nummergeleaves++;
+  }
+  // one force for the whole merge
+  rc = EndShadow(shadowed, rc);
+  pthread_rwlock_unlock(&applylock);
+  if (!rc) { 
+    rc = buffercache->ForceLog(last);
+  }
+  return rc;
+}
+
+
+//
+// Bloom filter
+//
+
+// FNV-1a over the key, then mixed (splitmix64) so that the block and
+// the bits within it come from different parts of the hash
+SIZE_T BTreeIndex::FilterBits(const KEY_T &key, SIZE_T bits[BTREE_FILTER_HASHES]) const
+{
+  unsigned long long h=14695981039346656037ULL;
+  SIZE_T numbits=superblock.info.GetNumDataBytes()*8;
+
+  for (SIZE_T i=0;i<key.length;i++) { 
+    h=(h^(unsigned char)key.data[i])*1099511628211ULL;
+  }
+  SIZE_T block=h%superblock.info.filterblocks;
+  h+=0x9e3779b97f4a7c15ULL;
+  h=(h^(h>>30))*0xbf58476d1ce4e5b9ULL;
+  h=(h^(h>>27))*0x94d049bb133111ebULL;
+  h^=h>>31;
+  // double hashing; the step is odd, so the bits differ
+  unsigned long long a=h&0xffffffffULL, b=(h>>32)|1;
+  for (SIZE_T i=0;i<BTREE_FILTER_HASHES;i++) { 
+    bits[i]=(a+i*b)%numbits;
+  }
+  return block;
+}
+
+
+bool BTreeIndex::MayContain(const KEY_T &key)
+{
+  SIZE_T bits[BTREE_FILTER_HASHES];
+
+  if (!HasFilter()) { 
+    return true;
+  }
+  __atomic_add_fetch(&numfilterprobes,1,__ATOMIC_RELAXED);
+  const unsigned char *f=&filter[FilterBits(key,bits)*superblock.info.GetNumDataBytes()];
+  for (SIZE_T i=0;i<BTREE_FILTER_HASHES;i++) { 
+    if (!(__atomic_load_n(&f[bits[i]/8],__ATOMIC_ACQUIRE) & (1<<(bits[i]%8)))) { 
+      __atomic_add_fetch(&numfilterskips,1,__ATOMIC_RELAXED);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// Nothing is written if the bits are all set already, as for a key
+// that is there or was tried before
+ERROR_T BTreeIndex::AddToFilter(const KEY_T &key)
+{
+  SIZE_T bits[BTREE_FILTER_HASHES];
+  SIZE_T i;
+
+  if (!HasFilter()) { 
+    return ERROR_NOERROR;
+  }
+  SIZE_T block=FilterBits(key,bits);
+  SIZE_T bytes=superblock.info.GetNumDataBytes();
+  unsigned char *f=&filter[block*bytes];
+  for (i=0;i<BTREE_FILTER_HASHES;i++) { 
+    if (!(__atomic_load_n(&f[bits[i]/8],__ATOMIC_ACQUIRE) & (1<<(bits[i]%8)))) { 
+      break;
+    }
+  }
+  if (i==BTREE_FILTER_HASHES) { 
+    return ERROR_NOERROR;
+  }
+
+  MutexGuard guard(&filterlock);
+  BTreeNode b=NewNode(BTREE_FILTER_NODE);
+  for (i=0;i<BTREE_FILTER_HASHES;i++) { 
+    __atomic_fetch_or(&f[bits[i]/8],(unsigned char)(1<<(bits[i]%8)),__ATOMIC_RELEASE);
+  }
+  memcpy(b.data,f,bytes);
+  return b.Serialize(buffercache,superblock_index+2+block);
+}
+
+
+ERROR_T BTreeIndex::LoadFilter()
+{
+  SIZE_T bytes=superblock.info.GetNumDataBytes();
+  BTreeNode b;
+  ERROR_T rc;
+
+  filter.assign(superblock.info.filterblocks*bytes,0);
+  for (SIZE_T i=0;i<superblock.info.filterblocks;i++) { 
+    rc=b.Unserialize(buffercache,superblock_index+2+i,superblock.info);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_FILTER_NODE) { 
+      return ERROR_INSANE;
+    }
+    memcpy(&filter[i*bytes],b.data,bytes);
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Buffered index
+//
+
+ERROR_T BTreeIndex::GetMessageValue(const BTreeNode &b, const SIZE_T offset, VALUE_T &value) const
+{
+  KEY_T key;
+  ERROR_T rc=b.GetMessage(offset,key,value);
+
+  if (rc || !b.info.HasOverflowValues()) { 
+    return rc;
+  }
+
+  OverflowRef ref;
+  memcpy(&ref,value.data,sizeof(ref));
+  return ReadOverflow(ref.block,ref.length,value);
+}
+
+
+SIZE_T BTreeIndex::MessageChain(const BTreeNode &b, const SIZE_T offset) const
+{
+  KEY_T key;
+  VALUE_T stored;
+
+  if (!b.info.HasOverflowValues() || b.GetMessage(offset,key,stored)) { 
+    return 0;
+  }
+
+  OverflowRef ref;
+  memcpy(&ref,stored.data,sizeof(ref));
+  return ref.block;
+}
+
+
+ERROR_T BTreeIndex::LookupBuffered(const KEY_T &key, VALUE_T &value, const bool latched)
+{
+  BTreePath path;
+  BTreeNode b;
+  KEY_T testkey;
+  SIZE_T ptr, offset;
+  bool found;
+  ERROR_T rc;
+
+  if (latched) { 
+    rc = buffercache->LatchBlock(superblock_index, false);
+    if (rc) { return rc; }
+    path.superlatched = true;
+  }
+  ptr = superblock.info.rootnode;
+
+  while (true) { 
+    if (path.depth >= BTREE_MAX_HEIGHT) { 
+      rc = ERROR_INSANE;
+      break;
+    }
+    if (latched) { 
+      rc = buffercache->LatchBlock(ptr, false);
+      if (rc) { break; }
+    }
+    path.block[path.depth++] = ptr;
+    if (latched) { 
+      UnlatchPath(path, 1);
+    }
+    rc = ReadNode(ptr, b);
+    if (rc) { break; }
+    TagLevel(ptr, path.depth-1);
+
+    if (b.info.nodetype == BTREE_LEAF_NODE) { 
+      for (offset=0; offset<b.info.numkeys; offset++) { 
+	rc = b.GetKey(offset, testkey);
+	if (rc || testkey==key) { break; }
+      }
+      if (!rc) { 
+	rc = (offset<b.info.numkeys) ? GetValue(b, offset, value) : ERROR_NONEXISTENT;
+      }
+      break;
+    }
+    if (b.info.nodetype != BTREE_ROOT_NODE && b.info.nodetype != BTREE_INTERIOR_NODE) { 
+      rc = ERROR_INSANE;
+      break;
+    }
+    // the first message met is the newest
+    offset = b.FindMessage(key, found);
+    if (found) { 
+      rc = GetMessageValue(b, offset, value);
+      break;
+    }
+    rc = FindChild(b, key, testkey, ptr);
+    if (rc) { break; }
+  }
+  if (latched) { 
+    UnlatchPath(path);
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::WriteBuffered(const BTreeOp op, const KEY_T &key, const VALUE_T &value)
+{
+  vector<SIZE_T> chains;
+  ERROR_T rc;
+
+  pthread_rwlock_rdlock(&applylock);
+  pthread_mutex_lock(&writerlock);
+  buffercache->BeginOperation();
+  rc = PutBuffered(op, key, value, chains);
+  LSN_T lsn = 0;
+  if (rc) { 
+    AbortOperation();
+  } else {
+    lsn = buffercache->CommitOperation();
+  }
+  for (SIZE_T i=0; !rc && i<chains.size(); i++) { 
+    rc = FreeOverflow(chains[i]);
+  }
+  pthread_mutex_unlock(&writerlock);
+  pthread_rwlock_unlock(&applylock);
+  if (!rc) { 
+    rc = buffercache->ForceLog(lsn);
+  }
+  return rc;
+}
+
+
+// The check needs no latches, as no one else writes, but the root is
+// latched for the change so that lookups do not see it half made
+ERROR_T BTreeIndex::PutBuffered(const BTreeOp op, const KEY_T &key, const VALUE_T &value, vector<SIZE_T> &chains)
+{
+  BTreePath path;
+  BTreeNode root;
+  VALUE_T old, stored;
+  SIZE_T offset, chain;
+  bool found, overflow;
+  ERROR_T rc;
+
+  rc = MayContain(key) ? LookupBuffered(key, old, false) : ERROR_NONEXISTENT;
+  if (op == BTREE_OP_INSERT) { 
+    if (rc == ERROR_NOERROR) { 
+      return ERROR_INSERT;
+    }
+    if (rc != ERROR_NONEXISTENT) { 
+      return rc;
+    }
+    rc = AddToFilter(key);
+    if (rc) { 
+      return rc;
+    }
+  } else if (rc) { 
+    return rc;
+  }
+
+  while (true) { 
+    rc = buffercache->LatchBlock(superblock_index, true);
+    if (rc) { return rc; }
+    path.depth = 0;
+    path.latched = 0;
+    path.superlatched = true;
+    rc = buffercache->LatchBlock(superblock.info.rootnode, true);
+    if (rc) { 
+      UnlatchPath(path);
+      return rc;
+    }
+    path.block[path.depth++] = superblock.info.rootnode;
+    rc = ReadNode(path.block[0], root);
+    if (!rc && root.info.numkeys == 0) { 
+      // an empty tree; the first insert builds its leaves
+      UnlatchPath(path);
+      rc = InsertInternal(key, value, path);
+      UnlatchPath(path);
+      return rc;
+    }
+    if (!rc) { 
+      offset = root.FindMessage(key, found);
+      if (found || root.info.nummessages < root.info.GetNumMessageSlots()) { 
+	rc = StoreValue(key, value, stored, overflow);
+	if (!rc && found) { 
+	  chain = MessageChain(root, offset);
+	  rc = root.SetMessageVal(offset, stored);
+	  if (!rc && chain) { 
+	    chains.push_back(chain);
+	  }
+	} else if (!rc) { 
+	  rc = root.InsertMessage(offset, key, stored);
+	}
+	if (!rc) { 
+	  rc = WriteNode(path.block[0], root);
+	}
+	UnlatchPath(path);
+	return rc;
+      }
+      rc = FlushBuffer(path, root, chains);
+    }
+    UnlatchPath(path);
+    if (rc) { return rc; }
+  }
+}
+
+
+// Each flush moves at least one message down a level, so the flushes
+// to make room at the root end.  A flush into a leaf takes what the
+// leaf holds before it must split, and splits it once; a flush into a
+// full buffer flushes that first and leaves it at that, since a split
+// below may have moved the boundaries of the node's children.
+ERROR_T BTreeIndex::FlushBuffer(BTreePath &path, BTreeNode &node, vector<SIZE_T> &chains)
+{
+  BTreeNode child;
+  KEY_T sep, key, testkey;
+  VALUE_T value;
+  SIZE_T i, m, start, best=0, first=0, num=0, n, offset, ptr, chain;
+  bool found, overflow=node.info.HasOverflowValues();
+  ERROR_T rc;
+
+  // the messages for child i lie between separators i-1 and i
+  for (i=0, m=0; i<=node.info.numkeys; i++) { 
+    start = m;
+    if (i < node.info.numkeys) { 
+      rc = node.GetKey(i, sep);
+      if (rc) { return rc; }
+      for (; m < node.info.nummessages; m++) { 
+	rc = node.GetMessage(m, key, value);
+	if (rc) { return rc; }
+	if (sep < key) { 
+	  break;
+	}
+      }
+    } else {
+      m = node.info.nummessages;
+    }
+    if (m-start > num) { 
+      best = i;
+      first = start;
+      num = m-start;
+    }
+  }
+  if (num == 0 || path.depth >= BTREE_MAX_HEIGHT) { 
+    return ERROR_INSANE;
+  }
+
+  rc = node.GetPtr(best, ptr);
+  if (rc) { return rc; }
+  rc = buffercache->LatchBlock(ptr, true);
+  if (rc) { return rc; }
+  path.block[path.depth++] = ptr;
+  rc = ReadNode(ptr, child);
+  if (rc) { return rc; }
+
+  if (child.info.nodetype == BTREE_LEAF_NODE) { 
+    // both are sorted, so one pass merges them
+    for (n=0, offset=0; n<num; n++) { 
+      rc = node.GetMessage(first+n, key, value);
+      if (rc) { return rc; }
+      for (; offset<child.info.numkeys; offset++) { 
+	rc = child.GetKey(offset, testkey);
+	if (rc) { return rc; }
+	if (!(testkey < key)) { 
+	  break;
+	}
+      }
+      if (offset<child.info.numkeys && testkey==key) { 
+	chain = ValueChain(child, offset);
+	rc = child.SetVal(offset, value, overflow);
+	if (!rc && chain) { 
+	  chains.push_back(chain);
+	}
+      } else if (IsOverfull(child)) { 
+	break;
+      } else {
+	rc = child.InsertKeyVal(offset, key, value, overflow);
+      }
+      if (rc) { return rc; }
+    }
+  } else {
+    if (child.info.nummessages >= child.info.GetNumMessageSlots()) { 
+      return FlushBuffer(path, child, chains);
+    }
+    for (n=0; n<num; n++) { 
+      rc = node.GetMessage(first+n, key, value);
+      if (rc) { return rc; }
+      offset = child.FindMessage(key, found);
+      if (found) { 
+	chain = MessageChain(child, offset);
+	rc = child.SetMessageVal(offset, value);
+	if (!rc && chain) { 
+	  chains.push_back(chain);
+	}
+      } else if (child.info.nummessages >= child.info.GetNumMessageSlots()) { 
+	break;
+      } else {
+	rc = child.InsertMessage(offset, key, value);
+      }
+      if (rc) { return rc; }
+    }
+  }
+
+  rc = WriteNode(ptr, child);
+  if (rc) { return rc; }
+  node.RemoveMessages(first, n);
+  rc = WriteNode(path.block[path.depth-2], node);
+  if (rc) { return rc; }
+  if (IsOverfull(child)) { 
+    rc = Rebalance(path);
+  }
+  return rc;
+}
+
+
+//
+//
+// DEPTH first traversal
+// DOT is Depth + DOT format
+//
+
+ERROR_T BTreeIndex::WalkFirst(const SIZE_T &node, BTreeWalk &w) const
+{
+  w.depth=0;
+  w.block[0]=node;
+  w.next[0]=0;
+  return w.node[0].Unserialize(buffercache,node,superblock.info);
+}
 
-    //If no keys  existent yet...
-    if(!initBlock){
-      initBlock=true;
-      
-        //Allocate a new block, and set the values to the first key spot.
-      AllocateNode(leafPtr);
-      leafNode = BTreeNode(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-      leafNode.Serialize(buffercache, leafPtr);
-      rc = leafNode.Unserialize(buffercache, leafPtr);
-      if(rc){ return rc;}
 
-      leafNode.info.numkeys++;
-      leafNode.SetKey(0, key);
-      leafNode.SetVal(0, value);
-      //Re-serialize after the access and write. 
-      leafNode.Serialize(buffercache, leafPtr);
+ERROR_T BTreeIndex::WalkNext(BTreeWalk &w, bool &done) const
+{
+  ERROR_T rc;
+  SIZE_T ptr;
 
-      //Connect it to root
-      rc = rootNode.Unserialize(buffercache, superblock.info.rootnode);
-      if(rc){ return rc;}
-      rootNode.info.numkeys++;
-      rootNode.SetPtr(0, leafPtr);
-      rootNode.SetKey(0, key);
-
-      //Built right node and connect
-      AllocateNode(rightLeafPtr);
-      rightLeafNode = BTreeNode(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-      rc = rightLeafNode.Serialize(buffercache, rightLeafPtr);
-      if(rc){ return rc;}
-      rootNode.SetPtr(1, rightLeafPtr);
-      rc = rootNode.Serialize(buffercache, superblock.info.rootnode);
-      if(rc){ return rc;}
-    } else{
-      std::vector<SIZE_T> pointerPath;
-      pointerPath.push_back(superblock.info.rootnode);
-      //cout << "Got to LookupLeaf" << endl;
-      LookupLeaf(superblock.info.rootnode, key, pointerPath);
-      //cout << "Finished LookupLeaf" << endl;
-    //Get the node from the last pointer (which points to the leaf node that the key belongs on)
-      leafPtr = pointerPath.back();
-      // std::cout<<"WE BUILT THIS CITY ON ROCK AND ROLL SHOEFLY Dont bother me ::: "<<leafPtr<<std::endl;
-      // std::cout<<"ALSO THIS ::: "<<pointerPath.size()<<std::endl;
-      // for(int i =pointerPath.size()-1; i>=0; i--) {
-      //   std::cout<<"Little sumpin"<<pointerPath.at(i)<<std::endl;
-      // }
-      pointerPath.pop_back();
-      //cout << "LeafPtr:" << leafPtr << endl;
-      KEY_T testkey;
-      KEY_T keySpot;
-      VALUE_T valSpot;
-      rc = leafNode.Unserialize(buffercache, leafPtr);
-      //cout << "Unserialized LeafPtr" << endl;
-      //Walk the leaf node
-      //Increment the key count for the given node.
-      leafNode.info.numkeys++;
-        //cout << leafNode.info.numkeys << endl;
-      if (leafNode.info.numkeys == 1) {
-        rc = leafNode.SetKey(0, key);
-        if (rc) { return rc;}
-        rc = leafNode.SetVal(0, value);
-        if (rc) { return rc;}
-      } else {
-        bool inserted = false;
-        for(SIZE_T offset =0; offset<(int)leafNode.info.numkeys-1; offset++){
-          rc = leafNode.GetKey(offset, testkey);
-          if (rc) { return rc;}
-          if(key < testkey) {
-        //Once you've found the spot the key needs to go, move all other keys over by 1
-            for(int offset2 = (int)leafNode.info.numkeys-2; offset2 >= (int)offset; offset2--){
-          //Grab the old key and value
-              rc = leafNode.GetKey((SIZE_T)offset2, keySpot);
-              if (rc) { return rc;}
-              rc = leafNode.GetVal((SIZE_T)offset2, valSpot);
-              if (rc) { return rc;}
-         //move it up by 1
-              rc = leafNode.SetKey((SIZE_T)offset2+1, keySpot);
-              if (rc) { return rc;}
-              rc = leafNode.SetVal((SIZE_T)offset2+1, valSpot);
-              if (rc) { return rc;}
-            }
-
-        //assign the new key to offset
-            inserted = true;
-            rc = leafNode.SetKey(offset, key);
-            if (rc) { return rc;}
-            rc = leafNode.SetVal(offset, value);
-            if (rc) { return rc;}
-
-            break;
-          }
-        }
-        if (!inserted) {
-          rc = leafNode.SetKey(leafNode.info.numkeys - 1, key);
-          if (rc) { return rc;}
-          rc = leafNode.SetVal(leafNode.info.numkeys - 1, value);
-          if (rc) { return rc;}
-        }
-      }
-     //Re-serialize after the access and write. 
-      leafNode.Serialize(buffercache, leafPtr); 
-    //check if the node length is over 2/3, and call rebalance if necessary
-      if((int)leafNode.info.numkeys > (int)(2*maxNumKeys/3)) {
-          SIZE_T parentPtr = pointerPath.back();
-          pointerPath.pop_back();
-        rc = Rebalance(parentPtr, pointerPath);
+  done=false;
+  while (true) { 
+    BTreeNode &b = w.node[w.depth];
+    // go down to the next child of the current node, if it has one left
+    if ((b.info.nodetype==BTREE_ROOT_NODE || b.info.nodetype==BTREE_INTERIOR_NODE) &&
+	b.info.numkeys>0 && w.next[w.depth]<=b.info.numkeys) { 
+      if (w.depth+1>=BTREE_MAX_HEIGHT) { 
+	return ERROR_INSANE;
       }
+      rc=b.GetPtr(w.next[w.depth]++,ptr);
+      if (rc) { return rc; }
+      w.depth++;
+      w.block[w.depth]=ptr;
+      w.next[w.depth]=0;
+      return w.node[w.depth].Unserialize(buffercache,ptr,superblock.info);
+    }
+    // otherwise back up to the parent
+    if (w.depth==0) { 
+      done=true;
+      return ERROR_NOERROR;
     }
+    w.depth--;
+  }
+}
 
-    /*
-    default:
-    std::cout << "Unexpected Error on look up. Please perform sanityCheck and diagnose issue."<<std::endl;
-    return ERROR_INSANE;
-    */ 
+
+ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
+  ostream &o,
+  BTreeDisplayType display_type) const
+{
+  BTreeWalk w;
+  ERROR_T rc;
+  bool done=false;
+
+  if (display_type==BTREE_SORTED_KEYVAL && (IsBuffered() || memtablesize)) { 
+    return DisplayPairs(node,o);
   }
 
-  //If it exists, call update on it with the new value
+  rc=WalkFirst(node,w);
 
+  while (rc==ERROR_NOERROR && !done) { 
+    BTreeNode &b = w.node[w.depth];
 
-  return ERROR_NOERROR;
-}
+    if (display_type==BTREE_DEPTH_DOT && w.depth>0) { 
+      o << w.block[w.depth-1] << " -> "<<w.block[w.depth]<<";\n";
+    }
 
-//This lookup function will find the path to the node where the passed in key would go, and return it as a stack of pointers.
-ERROR_T BTreeIndex::LookupLeaf(const SIZE_T &node, const KEY_T &key, std::vector<SIZE_T> &pointerPath){
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+    rc = PrintNode(o,w.block[w.depth],b,display_type);
+  
+    if (rc) { return rc; }
 
-  rc = b.Unserialize(buffercache, node);
+    if (display_type==BTREE_DEPTH_DOT) { 
+      o << ";";
+    }
 
-  if(rc!=ERROR_NOERROR){
-    return rc;
-  }
+    if (display_type!=BTREE_SORTED_KEYVAL) {
+      o << endl;
+    }
 
-  switch(b.info.nodetype){
+    switch (b.info.nodetype) { 
     case BTREE_ROOT_NODE:
     case BTREE_INTERIOR_NODE:
-      // Scan through key/ptr pairs
-      //and recurse if possible
-    for(offset=0;offset<b.info.numkeys; offset++){
-      rc=b.GetKey(offset,testkey);
-      if(rc) { return rc; }
-      if(key < testkey){
-            // OK, so we now have the first key that's larger
-            // so we ned to recurse on the ptr immediately previous to 
-            // this one, if it exists
-        rc=b.GetPtr(offset,ptr);
-        if (rc) { return rc; }
-          //If there is no error on finding the appropriate pointer, push it onto our stack. 
-        pointerPath.push_back(ptr);
-        //cout << "PointerPath has: " << pointerPath[0] << endl;
-        return LookupLeaf(ptr, key, pointerPath);
+    case BTREE_LEAF_NODE:
+      break;
+    default:
+      if (display_type==BTREE_DEPTH_DOT) { 
+      } else {
+	o << "Unsupported Node Type " << b.info.nodetype ;
       }
+      return ERROR_INSANE;
     }
 
-      //if we get here, we need to go to the next pointer, if it exists.
-    if(b.info.numkeys>0){
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-        //If there is no error on finding the appropriate pointer, push it onto our stack. 
-      pointerPath.push_back(ptr);
-      return LookupLeaf(ptr, key, pointerPath);
-    } else {
-        // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
-    }
-    break;
-    case BTREE_LEAF_NODE:
-    pointerPath.push_back(node);
-    return ERROR_NOERROR;
-    break;
-    default:
-        // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
+    rc=WalkNext(w,done);
   }
 
-  return ERROR_INSANE;
-
+  return rc;
 }
 
-//Rebalance takes a path of pointers and a node at the bottom of that path. It will split the node and recursively walk up the parent path
-// guaranteeing the sanity of each parent.
-ERROR_T BTreeIndex::Rebalance(const SIZE_T &node, std::vector<SIZE_T> ptrPath)
+
+// A key's messages all lie on the way down to its leaf, and the one
+// nearest the root is the newest, so whatever is nearest the root wins,
+// and the memtable is newer still
+ERROR_T BTreeIndex::DisplayPairs(const SIZE_T &node, ostream &o) const
 {
-  BTreeNode b;
-  BTreeNode leftNode;
-  BTreeNode rightNode;
+  map<KEY_T, pair<SIZE_T, VALUE_T> > pairs;
+  BTreeWalk w;
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T offset, i;
   ERROR_T rc;
-  SIZE_T offset;
-    
-  int newType;
-  //SIZE_T ptr;
-  rc = b.Unserialize(buffercache, node);
-  if (rc) { return rc;}
-  //std::cout<<":::: Allocating new Nodes :::::"<<std::endl;
-  //Allocate 2 new nodes, fill them from the place you're splitting
-  SIZE_T leftPtr;
-  SIZE_T rightPtr;
-  AllocateNode(leftPtr);
-  if(b.info.nodetype == BTREE_LEAF_NODE){
-    newType = BTREE_LEAF_NODE;
-  }else{
-    newType = BTREE_INTERIOR_NODE;
-  }
-  leftNode = BTreeNode(newType, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-  rc = leftNode.Serialize(buffercache, leftPtr);
-  AllocateNode(rightPtr);
-  rightNode = BTreeNode(newType, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-  rc = rightNode.Serialize(buffercache, rightPtr);
-  //Unserialize to write to new nodes
-  rc = leftNode.Unserialize(buffercache, leftPtr);
-  if (rc) { return rc;}
-  rc = rightNode.Unserialize(buffercache, rightPtr);
-  if (rc) { return rc;}
-
-  //Variables to hold spot/key vals  
-  KEY_T keySpot;
-  KEY_T testKey;
-  VALUE_T valSpot;
-  SIZE_T ptrSpot;
+  bool done=false;
 
-  //Find splitting point
-  int midpoint = (b.info.numkeys+0.5)/2;
+  rc=WalkFirst(node,w);
 
-  //If A leafNode
-  if(b.info.nodetype==BTREE_LEAF_NODE){
-  //Build left leaf node, include the splitting key (this is a <= B+ tree)
-    for(offset = 0; (int)offset < midpoint; offset++){
-      //std::cout<<":::: OFFSET for building new left leaf node = "<<offset<<std::endl;
-      leftNode.info.numkeys++;
+  while (rc==ERROR_NOERROR && !done) { 
+    BTreeNode &b = w.node[w.depth];
+    bool leaf=(b.info.nodetype==BTREE_LEAF_NODE);
+    SIZE_T num=leaf ? b.info.numkeys : b.info.nummessages;
 
-    //Get old node values
-      rc = b.GetKey(offset, keySpot);
-      if (rc) { return rc;}
-      rc = b.GetVal(offset, valSpot);
-      if (rc) { return rc;}
-    //set values in new left node.
-      rc = leftNode.SetKey(offset, keySpot);
-      if (rc) { return rc;}
-      rc = leftNode.SetVal(offset, valSpot);
-      if (rc) { return rc;}
+    for (offset=0;offset<num;offset++) { 
+      rc=leaf ? b.GetKey(offset,key) : b.GetMessage(offset,key,value);
+      if (!rc) { 
+	rc=leaf ? GetValue(b,offset,value) : GetMessageValue(b,offset,value);
+      }
+      if (rc) { return rc; }
+      map<KEY_T, pair<SIZE_T, VALUE_T> >::iterator p=pairs.find(key);
+      if (p==pairs.end()) { 
+	pairs.insert(make_pair(key,make_pair(w.depth,value)));
+      } else if (w.depth<(*p).second.first) { 
+	(*p).second=make_pair(w.depth,value);
+      }
     }
-  //Build right leaf node
-    int spot=0;
-    for(offset = midpoint; offset<b.info.numkeys; offset++){
-      //std::cout<<":::: OFFSET (spot) for building new right leaf node = "<<spot<<std::endl;
-      //std::cout<<":::: Total Block OFFSET (offset), while rebuilding right leaf node"<<offset<<std::endl;
-    //Get values from old node.
-      rightNode.info.numkeys++;
-      rc = b.GetKey(offset, keySpot);
-      if (rc) { return rc;}
-      rc = b.GetVal(offset, valSpot);
-      if (rc) { return rc;}
-    //set values in new right node.
-      rc = rightNode.SetKey(spot, keySpot);
-      if (rc) { return rc;}
-      rc = rightNode.SetVal(spot, valSpot);
-      if (rc) { return rc;}
-      spot++;
-    }
-  } else {//if it's an interior node.
-      //Build left interior node
-  for(offset = 0; (int)offset < midpoint; offset++){
-    //std::cout<<":::: OFFSET for building new left interior node = "<<offset<<std::endl;
-    leftNode.info.numkeys++;
-        //Get old key and pointers
-    rc = b.GetKey(offset, keySpot);
-    if (rc) { return rc;}
-    rc = b.GetPtr(offset, ptrSpot);
-    if (rc) { return rc;}
-        //Set new key and Pointer vals
-    rc = leftNode.SetKey(offset, keySpot);
-    if (rc) { return rc;}
-    rc = leftNode.SetPtr(offset, ptrSpot);
-  }
-      //Build Right interior node
-  int spot=0;
-  for(offset = midpoint; offset<b.info.numkeys; offset++){
-    //std::cout<<":::: OFFSET (spot) for building new right interior node = "<<spot<<std::endl;
-    //std::cout<<":::: Total Block OFFSET (offset), while rebuilding right interior node"<<offset<<std::endl;
-    rightNode.info.numkeys++;
-    //Get values from old node.
-    rc = b.GetKey(offset, keySpot);
-    if (rc) { return rc;}
-    rc = b.GetPtr(offset, ptrSpot);
-    if (rc) { return rc;}
-    //set values in new right node.
-    rc = rightNode.SetKey(spot, keySpot);
-    if (rc) { return rc;}
-    rc = rightNode.SetPtr(spot, ptrSpot);
-    if (rc) { return rc;}
-    spot++;
+    rc=WalkNext(w,done);
   }
-  rc = b.GetPtr(offset, ptrSpot);
-  if (rc) { return rc;}
-  rc = rightNode.SetPtr(spot, ptrSpot);
-  if (rc) { return rc;}
-}
-  //Serialize the new nodes
-rc = leftNode.Serialize(buffercache, leftPtr);
-if (rc) { return rc;}
-rc = rightNode.Serialize(buffercache, rightPtr);
-if (rc) { return rc;}
-rc = b.Serialize(buffercache, node);
-
-  //Find split key
-KEY_T splitKey;
-rc = b.GetKey(midpoint-1, splitKey);
-if (rc) { return rc;}
-
+  if (rc) { return rc; }
 
-  //If we're all the way up at the root, we need to make a new root.
-  //  std::cout << ":::: NODE TYPE = " << b.info.nodetype << std::endl;
-    
-  //  std::cout<<"current node nodetype :::: "<<b.info.nodetype<<std::endl;
-if (b.info.nodetype == BTREE_ROOT_NODE) {
-  //std::cout<<":::: AT THE TOP, BUILDING A NEW ROOT ::::"<<std::endl;
-  SIZE_T newRootPtr;
-  BTreeNode newRootNode;
-  AllocateNode(newRootPtr);
-  newRootNode = BTreeNode(BTREE_ROOT_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-  superblock.info.rootnode = newRootPtr;
-    newRootNode.info.rootnode = newRootPtr;
-    newRootNode.info.numkeys = 1;
-    newRootNode.SetKey(0, splitKey);
-    newRootNode.SetPtr(0, leftPtr);
-    newRootNode.SetPtr(1, rightPtr);
-  rc = newRootNode.Serialize(buffercache, newRootPtr);
-  if(rc) {return rc;}
-//std::cout<<"::: We made it here! Root node"<<std::endl;
-}
-else{
-//Find the parent node
-  SIZE_T parentPtr = ptrPath.back();
-//  std::cout<<"WE BUILT THIS CITY ON ROCK AND ROLL COW ::: "<<parentPtr<<std::endl;
-      //std::cout<<"ALSO THIS  IN OUR REBALANCE::: "<<ptrPath.size()<<std::endl;
-//    for(int i =ptrPath.size()-1; i>=0; i--) {
-//        std::cout<<"Little sumpin"<<ptrPath.at(i)<<std::endl;
-//      }
-  ptrPath.pop_back();
-  BTreeNode parentNode;
-  rc = parentNode.Unserialize(buffercache, parentPtr);
-  if(rc) {return rc;}
+  pthread_mutex_lock(&memtablelock);
+  for (map<KEY_T, BTreeChange>::const_iterator c=merging.begin(); c!=merging.end(); c++) { 
+    pairs[(*c).first]=make_pair(0,(*c).second.value);
+  }
+  for (map<KEY_T, BTreeChange>::const_iterator c=memtable.begin(); c!=memtable.end(); c++) { 
+    pairs[(*c).first]=make_pair(0,(*c).second.value);
+  }
+  pthread_mutex_unlock(&memtablelock);
 
-    if (parentNode.info.nodetype == BTREE_SUPERBLOCK) {
-        AllocateNode(parentPtr);
-        
-    }
-//Increment the key count for the given node.
-  //parentNode.info.numkeys++;
-    
-    BTreeNode newParentNode = BTreeNode(parentNode.info.nodetype, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-    newParentNode.info.numkeys = parentNode.info.numkeys + 1;
-    newParentNode.info.freelist = parentNode.info.freelist;
-    
-    bool newKeyInserted = false;
-    for (offset = 0; offset < newParentNode.info.numkeys - 1; offset++) {
-        rc = parentNode.GetKey(offset, testKey);
-        //    if(rc){ return rc;}
-        if (newKeyInserted) {
-            rc = parentNode.GetKey(offset, keySpot);
-            newParentNode.SetKey(offset + 1, keySpot);
-            
-            rc = parentNode.GetPtr(offset + 1, ptrSpot);
-            newParentNode.SetPtr(offset + 2, ptrSpot);
-        } else {
-            if (splitKey < testKey) {
-                newKeyInserted = true;
-                newParentNode.SetPtr(offset, leftPtr);
-                newParentNode.SetKey(offset, splitKey);
-                newParentNode.SetPtr(offset+1, rightPtr);
-                offset = offset - 1;
-                
-            } else {
-                rc = parentNode.GetKey(offset, keySpot);
-                if (rc) {return rc;}
-                rc = newParentNode.SetKey(offset, keySpot);
-                if (rc) {return rc;}
-                
-                rc = parentNode.GetPtr(offset, ptrSpot);
-                if (rc) {return rc;}
-                rc = newParentNode.SetPtr(offset, ptrSpot);
-                if (rc) {return rc;}
-            }
-        }
+  for (map<KEY_T, pair<SIZE_T, VALUE_T> >::const_iterator p=pairs.begin(); p!=pairs.end(); p++) { 
+    o << "(";
+    for (i=0;i<(*p).first.length;i++) { 
+      o << (*p).first.data[i];
     }
-    if (newKeyInserted == false) {
-        newKeyInserted = true;
-        newParentNode.SetPtr(offset, leftPtr);
-        newParentNode.SetKey(offset, splitKey);
-        newParentNode.SetPtr(offset+1, rightPtr);
+    o << ",";
+    for (i=0;i<(*p).second.second.length;i++) { 
+      o << (*p).second.second.data[i];
     }
-    
-    newParentNode.Serialize(buffercache, parentPtr);
-    
-    
-//find split keys spot in parent (interior) node, insert it and update keys and pointers.
-//  for(offset = 0; offset<parentNode.info.numkeys-1; offset++){
-//    //std::cout<<":::: Searching Interior Nodes for splitKey Insertion ::::: offset = "<<offset<<std::endl;
-//    rc = parentNode.GetKey(offset, testKey);
-//    if(rc){ return rc;}
-//    if(splitKey < testKey || splitKey == testKey){ // if testkey > splitkey
-//      //std::cout<<":::: Moving through the parent node for rebalance insertion ::: Number of keys in parent = "<<parentNode.info.numkeys<<std::endl;
-//      //std::cout<<":::: Moving through the parent node for rebalance insertion ::: parent nodetype = "<<parentNode.info.nodetype<<std::endl;
-//          //Once you've found the insertion point for the new key, move all other keys & pointers over by 1
-//      for(offset2= parentNode.info.numkeys-2 ; offset2 >= offset; offset2-- ){
-//        //std::cout<<":::: Found INSERTION POINT, moving spots over :::: = offset"<<offset<<std::endl;
-//            //Grab the old key and pointer
-//        rc = parentNode.GetKey(offset2, keySpot);
-//        if(rc){ return rc;}
-//        rc = parentNode.GetPtr(offset2, ptrSpot);
-//        if(rc){ return rc;}
-//            //Move it up by 1
-//        rc = parentNode.SetKey(offset2+1, keySpot);
-//        if(rc){ return rc;}
-//        rc = parentNode.SetPtr(offset2+2, ptrSpot);
-//      }
-//          //We now have moved every pointer over except for the  1 to the immediate right of where we will be inserting our splitKey
-//          //Set our pointers and our new key
-//      rc = parentNode.SetPtr(offset2+1, rightPtr);
-//      if(rc){ return rc;}
-//      rc = parentNode.SetPtr(offset,leftPtr);
-//      if(rc){ return rc;}
-//      rc = parentNode.SetKey(offset, splitKey);
-//      if(rc){ return rc;}
-//
-//      break;
-//    }
-//  }
-
-
-  //Check the length of the node and call rebalance if necessary
-  //parentNode.Serialize(buffercache, parentPtr);
-
-  if((int)newParentNode.info.numkeys > (int)(2*maxNumKeys/3)){
-    rc = Rebalance(parentPtr, ptrPath);
-    if(rc){ return rc;}
+    o << ")\n";
   }
-}
-  //Deallocate the old (too large) node
-DeallocateNode(node);
-return ERROR_NOERROR;
+  return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
-{
 
-  VALUE_T val = value;
-  // WRITE ME
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, val);
+ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+{
+  if (superblock.info.shadow) { 
+    BTreeSnapshot snap;
+    ERROR_T rc=OpenSnapshot(snap);
+    return rc ? rc : Display(snap,o,display_type);
+  }
+  ERROR_T rc;
+  if (display_type==BTREE_DEPTH_DOT) { 
+    o << "digraph tree { \n";
+  }
+  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  if (display_type==BTREE_DEPTH_DOT) { 
+    o << "}\n";
+  }
   return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+ERROR_T BTreeIndex::Display(const BTreeSnapshot &snap, ostream &o, BTreeDisplayType display_type) const
 {
-  // This is optional extra credit 
-  //
-  // 
-  return ERROR_UNIMPL;
+  ERROR_T rc;
+  if (snap.index!=this) { 
+    return ERROR_GENERAL;
+  }
+  if (display_type==BTREE_DEPTH_DOT) { 
+    o << "digraph tree { \n";
+  }
+  rc=DisplayInternal(snap.root,o,display_type);
+  if (display_type==BTREE_DEPTH_DOT) { 
+    o << "}\n";
+  }
+  return rc;
 }
 
 
-//
-//
-// DEPTH first traversal
-// DOT is Depth + DOT format
-//
+BTreeStats::BTreeStats() :
+  height(0), numinterior(0), numleaves(0), numkeys(0), nummessages(0), memtablekeys(0),
+  interiorused(0), interiorspace(0), leafused(0), leafspace(0)
+{}
 
-ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
-  ostream &o,
-  BTreeDisplayType display_type) const
+double BTreeStats::GetInteriorUtilization() const
 {
-  KEY_T testkey;
-  SIZE_T ptr;
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
+  return interiorspace>0 ? interiorused/interiorspace : 0;
+}
 
-  rc= b.Unserialize(buffercache,node);
+double BTreeStats::GetLeafUtilization() const
+{
+  return leafspace>0 ? leafused/leafspace : 0;
+}
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
+ostream & BTreeStats::Print(ostream &os) const
+{
+  os << "height          = "<<height<<endl;
+  os << "numinterior     = "<<numinterior<<endl;
+  os << "numleaves       = "<<numleaves<<endl;
+  os << "numkeys         = "<<numkeys<<endl;
+  if (nummessages>0) { 
+    os << "nummessages     = "<<nummessages<<endl;
+  }
+  if (memtablekeys>0) { 
+    os << "memtablekeys    = "<<memtablekeys<<endl;
   }
+  os << "interior util   = "<<GetInteriorUtilization()<<endl;
+  os << "leaf util       = "<<GetLeafUtilization()<<endl;
+  return os;
+}
 
-  rc = PrintNode(o,node,b,display_type);
-  
-  if (rc) { return rc; }
 
-  if (display_type==BTREE_DEPTH_DOT) { 
-    o << ";";
-  }
+ERROR_T BTreeIndex::StatsInternal(const SIZE_T &node, BTreeStats &stats) const
+{
+  BTreeWalk w;
+  ERROR_T rc;
+  bool done=false;
+  double used, space;
 
-  if (display_type!=BTREE_SORTED_KEYVAL) {
-    o << endl;
-  }
+  rc=WalkFirst(node,w);
 
-  switch (b.info.nodetype) { 
+  while (rc==ERROR_NOERROR && !done) { 
+    BTreeNode &b = w.node[w.depth];
+
+    if (b.IsSlotted()) { 
+      space = b.info.GetNumDataBytes()-BTREE_SLOTTED_HEADER;
+      used = space-b.GetReclaimableBytes();
+    } else {
+      space = (b.info.nodetype==BTREE_LEAF_NODE) ? b.info.GetNumSlotsAsLeaf() : b.info.GetNumSlotsAsInterior();
+      used = b.info.numkeys;
+    }
+
+    switch (b.info.nodetype) { 
     case BTREE_ROOT_NODE:
     case BTREE_INTERIOR_NODE:
-    if (b.info.numkeys>0) { 
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-       rc=b.GetPtr(offset,ptr);
-       if (rc) { return rc; }
-       if (display_type==BTREE_DEPTH_DOT) { 
-         o << node << " -> "<<ptr<<";\n";
-       }
-       rc=DisplayInternal(ptr,o,display_type);
-       if (rc) { return rc; }
-     }
-   }
-   return ERROR_NOERROR;
-   break;
-   case BTREE_LEAF_NODE:
-   return ERROR_NOERROR;
-   break;
-   default:
-   if (display_type==BTREE_DEPTH_DOT) { 
-   } else {
-    o << "Unsupported Node Type " << b.info.nodetype ;
-  }
-  return ERROR_INSANE;
-}
+      stats.numinterior++;
+      stats.nummessages+=b.info.nummessages;
+      stats.interiorused+=used;
+      stats.interiorspace+=space;
+      break;
+    case BTREE_LEAF_NODE:
+      stats.numleaves++;
+      stats.numkeys+=b.info.numkeys;
+      stats.leafused+=used;
+      stats.leafspace+=space;
+      if (w.depth+1>stats.height) { 
+	stats.height=w.depth+1;
+      }
+      break;
+    default:
+      return ERROR_INSANE;
+    }
 
-return ERROR_NOERROR;
+    rc=WalkNext(w,done);
+  }
+  return rc;
 }
 
 
-ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+ERROR_T BTreeIndex::GetStats(BTreeStats &stats) const
 {
+  BTreeSnapshot snap;
   ERROR_T rc;
-  if (display_type==BTREE_DEPTH_DOT) { 
-    o << "digraph tree { \n";
-  }
-  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
-  if (display_type==BTREE_DEPTH_DOT) { 
-    o << "}\n";
+
+  stats=BTreeStats();
+  pthread_mutex_lock(&memtablelock);
+  stats.memtablekeys=memtable.size()+merging.size();
+  pthread_mutex_unlock(&memtablelock);
+  if (superblock.info.shadow) { 
+    rc=OpenSnapshot(snap);
+    if (rc) { return rc; }
   }
-  return ERROR_NOERROR;
+  return StatsInternal(snap.index ? snap.root : superblock.info.rootnode,stats);
 }
 
 
@@ -957,7 +3805,11 @@ ERROR_T BTreeIndex::SanityCheck() const
   //std::set<BTreeNode> allTreeNodes;
 
   //Call Sanity Walk on top of tree using superblock.info.rootnode, etc...
-  ERROR_T retCode = SanityWalk(superblock.info.rootnode/*, allTreeNodes*/);
+  BTreeSnapshot snap;
+  if (superblock.info.shadow && OpenSnapshot(snap)) {
+    return ERROR_GENERAL;
+  }
+  ERROR_T retCode = SanityWalk(snap.index ? snap.root : superblock.info.rootnode/*, allTreeNodes*/);
 
   //TODO :: Check all of freelist to see if there are any duplicate components
 
@@ -969,111 +3821,88 @@ return retCode;
 
 //We'll use this for walking the tree for our sanity check.
 ERROR_T BTreeIndex::SanityWalk(const SIZE_T &node/*, std::set<BTreeNode> &allTreeNodes*/) const{
-BTreeNode b;
+BTreeWalk w;
 ERROR_T rc;
 SIZE_T offset;
 KEY_T testkey;
 KEY_T tempkey;
-SIZE_T ptr;
 VALUE_T value;
+bool done=false;
 
-rc = b.Unserialize(buffercache, node);
+rc = WalkFirst(node, w);
 
-  //Check if node is already in our BTree
-  // bool is_in = allTreeNodes.find(b) != allTreeNodes.end();
-  // if(is_in) {
-  //   std::cout<<"node "<<b<<" has already been visited by this BTree"<<std::endl;
-  // }
-  // allTreeNodes.insert(b);
+  //TODO :: Push node onto set, where we can check against other visited nodes.  4, 5.
 
-if(rc!=ERROR_NOERROR){
-  return rc;
-}
+while(rc==ERROR_NOERROR && !done){
+  BTreeNode &b = w.node[w.depth];
 
       //Check to see if the nodes have proper lengths
-if(b.info.numkeys>(int)(2*maxNumKeys/3)){
-  std::cout << "Current Node of type "<<b.info.nodetype<<" has "<<b.info.numkeys<<" keys. Which is over the 2/3 threshold of the maximum of "<<maxNumKeys<<" keys."<<std::endl;
-}
-
-switch(b.info.nodetype){
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-      //Scan through key/ptr pairs
-      //and recurse if possible
-
-    //TODO :: Push node onto set, where we can check against other visited nodes.  4, 5.
-
-  for(offset=0; offset<b.info.numkeys; offset++){
-    rc = b.GetKey(offset,testkey);
-    if(rc) {return rc; }
-
-      //If keys are not in proper size order
-    if(offset+1<b.info.numkeys-1){
-      rc = b.GetKey(offset+1, tempkey);
-      if(tempkey < testkey){
-        std::cout<<"The keys are not properly sorted!"<<std::endl;
-      }
-
-    }
-
-    rc=b.GetPtr(offset,ptr);
-    if(rc){return rc;}
-
-        return SanityWalk(ptr/*, allTreeNodes*/);
-
-//      if(key<testkey){
-            // OK, so we now have the first key that's larger
-            // so we ned to recurse on the ptr immediately previous to 
-            // this one, if it exists
-        // rc=b.GetPtr(offset,ptr);
-        // if(rc){return rc;}
-
-        // return SanityWalk(ptr, key);
-   //   }
+  if(IsOverfull(b)){
+    std::cout << "Current Node of type "<<b.info.nodetype<<" has "<<b.info.numkeys<<" keys. Which is over the split threshold."<<std::endl;
   }
 
-    //If we get here, we need to go to the next pointer, if it exists.
-  if(b.info.numkeys>0){
-    rc = b.GetPtr(b.info.numkeys, ptr);
-    if(rc) { return rc; }
-
-      return SanityWalk(ptr/*, allTreeNodes*/);
-  }else{
+  switch(b.info.nodetype){
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+    if(b.info.numkeys==0){
       //There are no keys at all on this node, so nowhere to go
-    std::cout << "The keys on this interior node are nonexistent."<<std::endl;
-    return ERROR_NONEXISTENT;
-  }
-  break;
-  case BTREE_LEAF_NODE:
-
-  for(offset=0; offset<b.info.numkeys;offset++){
-    rc = b.GetKey(offset, testkey);
-    if(rc) { 
-      std::cout << "Leaf Node is missing key"<<std::endl;
-      return rc;
+      std::cout << "The keys on this interior node are nonexistent."<<std::endl;
+      return ERROR_NONEXISTENT;
     }
-    rc =b.GetVal(offset, value);
-    if(rc){
-      std::cout << "leaf node key is missing associated value"<<std::endl;
-      return rc;
+    //A buffer must fit and be in order, with each key once
+    if(b.info.nummessages>b.info.GetNumMessageSlots()){
+      std::cout << "The node has more messages than its buffer holds!"<<std::endl;
+    }
+    for(offset=0; offset+1<b.info.nummessages; offset++){
+      rc = b.GetMessage(offset, testkey, value);
+      if(!rc) { rc = b.GetMessage(offset+1, tempkey, value); }
+      if(rc) { return rc; }
+      if(!(testkey < tempkey)){
+        std::cout<<"The messages are not properly sorted!"<<std::endl;
+      }
     }
+    //Fall through to the key order check, interior and leaf keys alike
+    case BTREE_LEAF_NODE:
+    for(offset=0; offset<b.info.numkeys;offset++){
+      rc = b.GetKey(offset, testkey);
+      if(rc) { 
+        std::cout << "Node is missing key"<<std::endl;
+        return rc;
+      }
+      if(b.info.nodetype==BTREE_LEAF_NODE){
+        rc =b.GetVal(offset, value);
+        if(rc){
+          std::cout << "leaf node key is missing associated value"<<std::endl;
+          return rc;
+        }
+      }
 
       //If keys are not in proper size order
-    if(offset+1<b.info.numkeys){
-      rc = b.GetKey(offset+1, tempkey);
+      if(offset+1<b.info.numkeys){
+        rc = b.GetKey(offset+1, tempkey);
+        if(rc) { return rc; }
+        if(tempkey < testkey){
+          std::cout<<"The keys are not properly sorted!"<<std::endl;
+        }
+      }
+    }
+    //In a B-link tree no key may be above the node's high key
+    if(b.HasHighKey() && b.info.numkeys>0){
+      rc = b.GetHighKey(tempkey);
+      if(rc) { return rc; }
       if(tempkey < testkey){
-        std::cout<<"The keys are not properly sorted!"<<std::endl;
+        std::cout<<"A key is above the node's high key!"<<std::endl;
       }
     }
+    break;
+    default:
+    return ERROR_INSANE;
   }
-  break;
-  default:
 
-  return ERROR_INSANE;
-  break;
+  rc = WalkNext(w, done);
 }
 
-return ERROR_NOERROR;
+return rc;
 }
 
 
@@ -1087,5 +3916,16 @@ ostream & BTreeIndex::Print(ostream &os) const
 }
 
 
+string MakeKey(const SIZE_T keysize, const SIZE_T i)
+{
+  string digits;
+  SIZE_T n;
 
-
+  for (n=i; n>0; n/=10) { 
+    digits.insert(digits.begin(),(char)('0'+n%10));
+  }
+  if (digits.length()>keysize || keysize==0) { 
+    return string();
+  }
+  return string(keysize-digits.length(),'0')+digits;
+}
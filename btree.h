@@ -5,6 +5,8 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <map>
+#include <deque>
 
 #include "global.h"
 #include "block.h"
@@ -12,6 +14,7 @@
 #include "buffercache.h"
 
 #include "btree_ds.h"
+#include "resultcache.h"
 
 using namespace std;
 
@@ -43,29 +46,339 @@ enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP}
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+// Default target occupancy of nodes after a split, in percent.  Full
+// nodes are split k into k+1 (B* style), with k up to
+// BTREE_MAX_SPLIT_FANIN, so occupancies between 50 and 80 are possible.
+#define BTREE_DEFAULT_MINFILL 66
+#define BTREE_MAX_SPLIT_FANIN 4
+
+// Default percentage of a fixed-format node's real capacity that is
+// used before it is split.  Lower values leave room in every node.
+#define BTREE_DEFAULT_FILL 100
+// Fewest entries a node may be split at, whatever its fill target
+#define BTREE_MIN_SPLIT_KEYS 3
+
+// Deepest tree we can descend.  With at least BTREE_MIN_SPLIT_KEYS
+// entries per node, no disk we can simulate comes close.
+#define BTREE_MAX_HEIGHT 32
+
+// Optimistic lookups that see a block change under them this many
+// times in a row take latches instead
+#define BTREE_MAX_RESTARTS 8
+
+// Bits of the Bloom filter each key sets, all in the same block
+#define BTREE_FILTER_HASHES 4
+
+// Blocks on the way from the root down to a node, root first.  It has
+// a fixed capacity, so a descent needs no allocation.  A descent also
+// records which of the blocks it still holds latched: block[latched]
+// to block[depth-1], and the superblock if superlatched.
+struct BTreePath {
+  SIZE_T block[BTREE_MAX_HEIGHT];
+  SIZE_T depth;
+  SIZE_T latched;
+  bool   superlatched;
+  bool   whole;         // part of a bigger operation, so a B-link half
+                        // split does not commit on its own
+
+  BTreePath() : depth(0), latched(0), superlatched(false), whole(false) {}
+};
+
+// What a writer in a shadow paged index has changed and not yet
+// committed.  copies maps each committed node it wrote to the block
+// holding its copy, fresh holds the other blocks it allocated, and
+// superseded the committed blocks it let go of.  touched holds the
+// nodes its descents went through, and root is the root it sees.
+struct BTreeShadow {
+  map<SIZE_T, SIZE_T> copies;
+  set<SIZE_T>         fresh;
+  vector<SIZE_T>      superseded;
+  set<SIZE_T>         touched;
+  SIZE_T              root;
+};
+
+// What a transaction has done to a key and not yet committed: put
+// value in it, having found it missing from the tree (insert) or there.
+// The memtable holds the same for changes not yet merged.
+struct BTreeChange {
+  VALUE_T value;
+  bool    insert;
+};
+
+// A transaction's changes, by key
+struct BTreeTransaction {
+  map<KEY_T, BTreeChange> changes;
+};
+
+class BTreeIndex;
+
+// A version of a shadow paged index, as of the commit it was opened
+// at.  Its blocks stay as they are until it is closed, which its
+// destructor does if need be.
+struct BTreeSnapshot {
+  const BTreeIndex *index;     // 0 unless open
+  SIZE_T root;
+  SIZE_T version;
+
+  BTreeSnapshot() : index(0), root(0), version(0) {}
+  ~BTreeSnapshot();
+  void Close();
+private:
+  BTreeSnapshot(const BTreeSnapshot &rhs);
+  BTreeSnapshot & operator=(const BTreeSnapshot &rhs);
+};
+
+// Cursor for a depth first, preorder walk over every node of the tree.
+// node[depth] is the current node and block[depth] its block number;
+// next[i] is the next child of node[i] to visit.
+struct BTreeWalk {
+  BTreeNode node[BTREE_MAX_HEIGHT];
+  SIZE_T    block[BTREE_MAX_HEIGHT];
+  SIZE_T    next[BTREE_MAX_HEIGHT];
+  SIZE_T    depth;
+
+  BTreeWalk() : depth(0) {}
+};
+
+struct BTreeStats {
+  SIZE_T height;
+  SIZE_T numinterior;
+  SIZE_T numleaves;
+  SIZE_T numkeys;
+  SIZE_T nummessages;    // waiting in buffers, buffered format
+  SIZE_T memtablekeys;   // waiting in the memtable
+  double interiorused;   // entries (fixed) or bytes (slotted) in use
+  double interiorspace;  // and available, over all interior nodes
+  double leafused;
+  double leafspace;
+
+  BTreeStats();
+  double GetInteriorUtilization() const;
+  double GetLeafUtilization() const;
+  ostream &Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const BTreeStats &s) { return s.Print(os); }
+
 class BTreeIndex {
 private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
-  unsigned int maxNumKeys;
-    bool initBlock;
-    
+  SIZE_T       maxLeafKeys;      // fixed format split thresholds,
+  SIZE_T       maxInteriorKeys;  // derived from the superblock at Attach
+  pthread_mutex_t alloclock;     // the superblock: free list and root
+  bool         optimistic;       // lookups take no latches
+  SIZE_T       numrestarts;      // optimistic lookups started over
+  // Shadow paging
+  pthread_key_t    shadowkey;     // each writer's BTreeShadow
+  pthread_mutex_t  writerlock;    // one writer at a time
+  set<SIZE_T>  freeblocks;       // the free list, under alloclock,
+  SIZE_T       nextfree;         // handed out in order from here
+  bool         shadowsync;       // commits sync the disk
+  // Snapshots.  Each commit makes a new version.  The blocks it let go
+  // of are retired with that version's number, and are freed once no
+  // snapshot of an older version is left open.
+  mutable pthread_mutex_t snapshotlock;   // all below, and the root
+  SIZE_T       version;          // of the last commit
+  mutable map<SIZE_T, SIZE_T> snapshots;  // open ones by version
+  deque<pair<SIZE_T, vector<SIZE_T> > > retired;
+  SIZE_T       numretired;       // blocks waiting in retired
+  // Transactions
+  pthread_key_t    txnkey;        // each thread's BTreeTransaction
+  pthread_rwlock_t applylock;     // writers shared, a commit exclusive
+  SIZE_T           applyseq;      // odd while a commit makes its changes
+  // Memtable: changes kept in memory, in key order, until there are
+  // memtablesize of them and they are merged into the tree together
+  pthread_mutex_t mergelock;     // one merge at a time
+  mutable pthread_mutex_t memtablelock;   // all below
+  map<KEY_T, BTreeChange> memtable;
+  map<KEY_T, BTreeChange> merging;   // the one being merged, older;
+                                     // changed only under mergelock too
+  SIZE_T       memtablesize;     // 0 if there is no memtable
+  SIZE_T       nummerges, nummerged, nummergeleaves;
+  // Bloom filter of every key ever inserted, as on the disk.  Bits are
+  // only ever set, so a key it lacks is not in the tree, and one it has
+  // may or may not be.
+  pthread_mutex_t filterlock;   // writers of the filter
+  vector<unsigned char> filter;
+  SIZE_T       numfilterprobes, numfilterskips;
+  // Values of hot keys, in front of the memtable and the tree
+  pthread_mutex_t resultlock;
+  ResultCache *resultcache;      // 0 if there is none
+
+  // Not copyable: locks, thread keys, the memtable and the result cache
+  // belong to one index
+  BTreeIndex(const BTreeIndex &rhs);
+  BTreeIndex & operator=(const BTreeIndex &rhs);
+
 protected:
 
+  // What every constructor sets up alike: locks and shadow paging state
+  void         Init();
+
   ERROR_T      AllocateNode(SIZE_T &node);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
-    const BTreeOp op, 
+  // If oldchain is given, an update is made in the caller's operation,
+  // and the overflow chain the old value no longer needs is handed
+  // back, to be freed once that has committed
+  ERROR_T      LookupOrUpdateInternal(const BTreeOp op, 
     const KEY_T &key,
-    VALUE_T &val);
+    VALUE_T &val,
+    SIZE_T *oldchain=0);
+
+  // Lookups of the memtable and the tree, whatever the calling
+  // thread's transaction holds
+  ERROR_T      LookupCommitted(const KEY_T &key, VALUE_T &value);
+  ERROR_T      MultiLookupCommitted(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results);
+  BTreeTransaction *GetTransaction() const;
+  // Check a change as it would be made now, and keep it in t
+  ERROR_T      BufferChange(BTreeTransaction &t, const BTreeOp op, const KEY_T &key, const VALUE_T &value);
+  // Check every change in t against the tree as it is now
+  ERROR_T      CheckChanges(const BTreeTransaction &t);
+  // End the calling thread's operation, which failed part way through,
+  // without committing it, and put back the root if it moved
+  void         AbortOperation();
+
+  ERROR_T      InsertInternal(const KEY_T &key,
+    const VALUE_T &value,
+    BTreePath &path);
   
 
   ERROR_T      DisplayInternal(const SIZE_T &node,
     ostream &o, 
     const BTreeDisplayType display_type=BTREE_DEPTH) const;
+  // The sorted pairs of the tree, those in the buffers of a buffered
+  // index and in the memtable included
+  ERROR_T      DisplayPairs(const SIZE_T &node, ostream &o) const;
+
+  // Start a walk at node, or move it on to the next node in preorder.
+  // done is set once every node has been visited.
+  ERROR_T      WalkFirst(const SIZE_T &node, BTreeWalk &w) const;
+  ERROR_T      WalkNext(BTreeWalk &w, bool &done) const;
+
+  ERROR_T      PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt) const;
+
+  // Out of line values: a chain of BTREE_OVERFLOW_NODE blocks
+  ERROR_T      WriteOverflow(const VALUE_T &value, SIZE_T &first);
+  ERROR_T      ReadOverflow(const SIZE_T &first, const SIZE_T length, VALUE_T &value) const;
+  ERROR_T      FreeOverflow(const SIZE_T &first);
+
+  // Value as stored in a leaf, spilling it to an overflow chain if needed
+  ERROR_T      StoreValue(const KEY_T &key, const VALUE_T &value, VALUE_T &stored, bool &overflow);
+  // Value of the ith entry of a leaf, following its overflow chain if any
+  ERROR_T      GetValue(const BTreeNode &b, const SIZE_T offset, VALUE_T &value) const;
+  // First block of the overflow chain of the ith entry of a leaf, or 0
+  SIZE_T       ValueChain(const BTreeNode &b, const SIZE_T offset) const;
+
+  ERROR_T      CheckSizes(const KEY_T &key, const VALUE_T &value) const;
+  BTreeNode    NewNode(const int nodetype) const;
+  void         ComputeFanout();
+  bool         IsOverfull(const BTreeNode &b) const;
+  // True if op cannot make b split, so its ancestors may be released
+  bool         IsSafe(const BTreeNode &b, const BTreeOp op) const;
+  // Release the latches a descent holds, except those on the last keep blocks
+  void         UnlatchPath(BTreePath &path, const SIZE_T keep=0);
+  SIZE_T       SplitFanIn() const;
+  // Tell the cache a node just read sits depth levels below the root,
+  // so that it can keep the top of the tree
+  void         TagLevel(const SIZE_T node, const SIZE_T depth) const;
+  ERROR_T      Redistribute(BTreeNode &parent, const SIZE_T first, const SIZE_T numin, const SIZE_T numout,
+			    const SIZE_T held);
+
+  // B-link descents and splits, which latch one node at a time
+  ERROR_T      LookupLeafLinked(const KEY_T &key, BTreePath &path, BTreeNode &b, const BTreeOp op,
+				KEY_T *upper=0, bool *bounded=0);
+  // Follow right links from the latched node at the bottom of path,
+  // b, until reaching the node key belongs in
+  ERROR_T      MoveRight(const KEY_T &key, BTreePath &path, BTreeNode &b, const bool exclusive);
+  ERROR_T      RebalanceLinked(BTreePath &path);
+
+  // Lookup without latches, validating every block read against its
+  // version.  conflict is set if it has to be started over.
+  ERROR_T      LookupOptimistic(const KEY_T &key, VALUE_T &value, bool &conflict);
+
+  ERROR_T      StatsInternal(const SIZE_T &node, BTreeStats &stats) const;
+
+  // Shadow paging.  BeginShadow starts the calling thread's changes,
+  // unless the index is not shadow paged or the thread has begun
+  // already, and says whether it did.  EndShadow commits them, or
+  // throws them away if rc is an error, and hands back the error.
+  bool         BeginShadow();
+  ERROR_T      EndShadow(const bool began, const ERROR_T rc);
+  BTreeShadow *GetShadow() const;
+  ERROR_T      CommitShadow(BTreeShadow &s);
+  // Free the retired blocks no open snapshot can reach
+  void         ReclaimRetired();
+  void         AbortShadow(BTreeShadow &s);
+  // Point the copies and new nodes under node at the copies of their
+  // children.  changed is set if node itself has a new version.
+  ERROR_T      RelinkShadow(BTreeShadow &s, const SIZE_T node, bool &changed);
+  // Rebuild the free list from the blocks the tree does not reach
+  ERROR_T      BuildFreeBlocks();
+  // Nodes as the calling thread sees them.  A shadow paged writer's
+  // first write of a committed node goes to a new block instead.
+  ERROR_T      ReadNode(const SIZE_T node, BTreeNode &b) const;
+  ERROR_T      WriteNode(const SIZE_T node, const BTreeNode &b);
+  SIZE_T       GetRoot() const;
+
+  // Buffered index.  Writers go one at a time and put each change in
+  // the root's buffer as a message.  A full buffer is flushed: the
+  // messages for the child that has the most of them go down into its
+  // buffer, flushing that first if it is full, or into the child
+  // itself if it is a leaf, which may then split.
+  bool         IsBuffered() const { return superblock.info.format==BTREE_FORMAT_BUFFERED; }
+  // Look for key in the buffers on the way down, and then in its leaf.
+  // Latched, this crabs down like any lookup; otherwise the caller is
+  // the one writer, and nothing else changes the tree.
+  ERROR_T      LookupBuffered(const KEY_T &key, VALUE_T &value, const bool latched);
+  ERROR_T      WriteBuffered(const BTreeOp op, const KEY_T &key, const VALUE_T &value);
+  // Check and make an insert or update, as op, in the caller's
+  // operation.  The overflow chains of the values it replaces are
+  // added to chains, to be freed once that has committed.
+  ERROR_T      PutBuffered(const BTreeOp op, const KEY_T &key, const VALUE_T &value, vector<SIZE_T> &chains);
+  // Flush the full buffer of node, the bottom of path, which is
+  // latched all the way up.  node is stale once this returns.
+  ERROR_T      FlushBuffer(BTreePath &path, BTreeNode &node, vector<SIZE_T> &chains);
+  // Value of the ith message of b, and the first block of its
+  // overflow chain, or 0
+  ERROR_T      GetMessageValue(const BTreeNode &b, const SIZE_T offset, VALUE_T &value) const;
+  SIZE_T       MessageChain(const BTreeNode &b, const SIZE_T offset) const;
+
+  // Memtable.  The tree as lookups see it is the memtable over the
+  // tree, so a change that is checked and then put in the memtable
+  // under memtablelock is as good as made.
+  ERROR_T      LookupMemtable(const KEY_T &key, VALUE_T &value) const;
+  // The tree alone
+  ERROR_T      LookupTree(const KEY_T &key, VALUE_T &value);
+  ERROR_T      MultiLookupTree(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results);
+  ERROR_T      WriteMemtable(const BTreeOp op, const KEY_T &key, const VALUE_T &value);
+  const BTreeChange *FindMemtable(const KEY_T &key) const;
+  void         FindKeysLocked(const vector<KEY_T> &keys, vector<ERROR_T> &results);
+  // Merge the memtable into the tree and empty it, with mergelock
+  // held, or unless another merge is going on
+  ERROR_T      MergeMemtableLocked();
+  ERROR_T      StartMerge();
+  // Merge merging into the tree.  Each leaf takes all its changes in
+  // one write, as in InsertBatch.
+  ERROR_T      MergeChanges();
+  ERROR_T      CommitToMemtable(BTreeTransaction &t);
+
+  // Bloom filter.  The bits of a key are set, and their block written,
+  // in the operation that inserts it, before the key can be seen.
+  bool         HasFilter() const { return !filter.empty(); }
+  // The block of the filter key maps to, and its bits within it
+  SIZE_T       FilterBits(const KEY_T &key, SIZE_T bits[BTREE_FILTER_HASHES]) const;
+  bool         MayContain(const KEY_T &key);
+  ERROR_T      AddToFilter(const KEY_T &key);
+  ERROR_T      LoadFilter();
+
+  // Drop key from the result cache, once its new value can be seen.
+  // Only values that were found are kept, and an insert is only of a
+  // key that was not, so inserts need not.
+  void         ForgetResult(const KEY_T &key);
 public:
   //
   // keysize and valueszie should be stored in the 
@@ -75,18 +388,52 @@ public:
   // and then doing an Attach(initialblock,true) to create it
   // and actually write the data in the superblock.
   // otherwise, the expectation is that keysize and valuesize
-  // will be zero and will be read when Attach(initialblock,false) is 
+  // will be zero and will be read when Attach(initialblock,false) is
   // invoked
+  //
+  // format selects the node layout of a new index.  With
+  // BTREE_FORMAT_SLOTTED, keys and values may have any length up to
+  // keysize and valuesize (zero meaning no limit), and values too
+  // large for a node go to overflow blocks.
+  //
+  // minfill is the target occupancy, in percent, of nodes after a split
+  // of a new index.  leaffill and interiorfill are the percentages of
+  // a fixed-format leaf or interior node that are used before it is
+  // split.
+  //
+  // linked makes a new index a B-link tree: each node has a high key
+  // and a link to its right sibling, descents never hold more than one
+  // node, and full nodes are split one into two.
+  //
+  // shadow makes a new index shadow paged instead: a writer never
+  // changes a node in place, but writes a copy to a new block, and
+  // so on up to a new root.  Its commit writes the new blocks, in
+  // block order, and then the superblock, which points at the new
+  // root from then on.  The index on the disk is thus always the one
+  // of the last commit.  Writers go one at a time, readers see the
+  // last commit, and the old blocks are free once no reader is left
+  // on them.  The free list is kept in memory and rebuilt by Attach.
+  // A shadow paged index is not also linked.
+  //
+  // BTREE_FORMAT_BUFFERED makes a new index write optimized (a B-epsilon
+  // tree): its interior nodes give part of their block to a buffer of
+  // changes on their way down, which reach the leaves in batches.
+  // Writers go one at a time, and lookups check the buffers on their
+  // way down.  A buffered index is neither linked nor shadow paged.
   BTreeIndex(SIZE_T keysize, 
     SIZE_T valuesize,
     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,   // true if a  key maps to a single value
+	     SIZE_T format=BTREE_FORMAT_FIXED,
+	     SIZE_T minfill=BTREE_DEFAULT_MINFILL,
+	     SIZE_T leaffill=BTREE_DEFAULT_FILL,
+	     SIZE_T interiorfill=BTREE_DEFAULT_FILL,
+	     bool linked=false,
+	     bool shadow=false);
 
 
   BTreeIndex();
-  BTreeIndex(const BTreeIndex &rhs);
   virtual ~BTreeIndex();
-  BTreeIndex & operator=(const BTreeIndex &rhs);
   
 
   // This is called before any inserts, updates, or deletes happen
@@ -96,7 +443,9 @@ public:
   // This should be your superblock, which contains the information 
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
-  // giving you an incorrect block to start with
+  // giving you an incorrect block to start with.  Creating an index
+  // gives ERROR_SIZE if nodes of this block size are too small for
+  // keys and values of its sizes.
   ERROR_T Attach(const SIZE_T initblock, const bool create=false );
   
   // This is called after all inserts, updates, or deletes are done.
@@ -109,6 +458,14 @@ public:
   // return ERROR_SIZE if the key or value are the wrong size for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+
+  // Insert many pairs at once.  results[i] is what Insert would give
+  // for keys[i], values[i], had the pairs been inserted one by one in
+  // order, so a key repeated in the batch goes in the first time only.
+  // The pairs are sorted, and all those that go in the same leaf are
+  // written into it together, with one split at most once they are in.
+  // Returns ERROR_SIZE if keys and values differ in number.
+  ERROR_T InsertBatch(const vector<KEY_T> &keys, const vector<VALUE_T> &values, vector<ERROR_T> &results);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
@@ -124,6 +481,103 @@ public:
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Look up many keys at once.  values[i] and results[i] are what
+  // Lookup would give for keys[i].  The batch goes down the tree
+  // together, so nodes it shares are read once, and the leaves are read
+  // in block order.  Returns nonzero only if the tree could not be
+  // read at all.
+  ERROR_T MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results);
+
+  // Transactions.  Between Begin and Commit, the calling thread's
+  // Insert, InsertBatch and Update are checked against the tree and
+  // its earlier changes and give what they would give, but the changes
+  // are only kept aside, and its lookups see them.  Commit then makes
+  // them all, in key order, as one operation: one log force, and in a
+  // shadow paged index one commit and one superblock write.  Other
+  // writers wait while it does, and so do lookups that would see it
+  // part way through.  If a change fails then, because another thread
+  // got to its key first or there is no room, Commit says so.  Every
+  // change is checked before any is made, and a shadow paged index or
+  // one with a write-ahead log then keeps none of them, even if one
+  // fails part way through; only an index updated in place without a
+  // log keeps those made before the one that failed.  Abort drops them
+  // all.  Begin in a transaction gives ERROR_CONFLICT, and Commit or
+  // Abort outside one ERROR_GENERAL.  Delete is not supported.
+  ERROR_T Begin();
+  ERROR_T Commit();
+  ERROR_T Abort();
+  bool    InTransaction() const { return GetTransaction()!=0; }
+
+  // An optional memtable in front of the tree.  With a size, Insert,
+  // InsertBatch, Update and Commit are checked as usual and then only
+  // kept in memory, where lookups look first, until there are size of
+  // them.  They are then merged into the tree in key order, leaf by
+  // leaf, each leaf written once for all of its changes and with one
+  // log force for the lot.  A change is thus not on the disk, nor in
+  // a snapshot, until it is merged: a crash loses the memtable, so
+  // with a write-ahead log a size gives ERROR_BADCONFIG.  A merge
+  // takes the memtable as it is and starts a new one, which takes
+  // writes meanwhile; lookups look in both until it is done.
+  // MergeMemtable merges it at once, as Detach does and as setting a
+  // smaller size does.  Set the size before the index is shared
+  // between threads.  Deletes are not supported.
+  ERROR_T SetMemtableSize(const SIZE_T size);
+  SIZE_T  GetMemtableSize() const { return memtablesize; }
+  ERROR_T MergeMemtable();
+  // Merges made, and the changes and leaves they took in
+  SIZE_T  GetNumMerges() const { return nummerges; }
+  SIZE_T  GetNumMergedChanges() const { return nummerged; }
+  SIZE_T  GetNumMergedLeaves() const { return nummergeleaves; }
+
+  // A new index may have a Bloom filter of every key inserted into it,
+  // kept in numblocks blocks after the root and in memory.  A lookup of
+  // a key it lacks, and the check for one that an insert makes in a
+  // buffered index, a memtable or a transaction, need not go down the
+  // tree at all.  Set before Attach creates the index.
+  void    SetFilterBlocks(const SIZE_T numblocks) { superblock.info.filterblocks=numblocks; }
+  SIZE_T  GetFilterBlocks() const { return superblock.info.filterblocks; }
+  // Lookups of the tree the filter was asked about, and those it spared
+  SIZE_T  GetNumFilterProbes() const { return numfilterprobes; }
+  SIZE_T  GetNumFilterSkips() const { return numfilterskips; }
+
+  // A result cache of up to size keys in front of the index, or none
+  // for 0.  Lookups of the keys it has take one probe of a hash table
+  // in memory instead of a descent; see ResultCache for which keys it
+  // keeps.  Updates and commits take the keys they change out of it.
+  // Set the size before the index is shared between threads.
+  void    SetResultCacheSize(const SIZE_T size);
+  const ResultCache *GetResultCache() const { return resultcache; }
+
+  // Lookups are optimistic unless this is turned off: they take no
+  // latches and start over when a writer changes a block they read
+  void    SetOptimistic(const bool on) { optimistic=on; }
+  SIZE_T  GetNumRestarts() const { return numrestarts; }
+
+  // Whether shadow paged commits sync the disk, as they do unless
+  // this is turned off, and how many there have been
+  void    SetShadowSync(const bool on) { shadowsync=on; }
+  SIZE_T  GetNumCommits() const { return version; }
+
+  // Open a snapshot of a shadow paged index at its last commit.
+  // Reading from it takes no latches and sees neither the commits
+  // made after it nor any half made change, however long it is kept
+  // open.  Writers are not held up, but what they let go of is not
+  // reused until the snapshot closes.  Lookups, MultiLookup and the
+  // whole-tree walks below each read from one of their own.  Returns
+  // ERROR_UNIMPL unless the index is shadow paged.
+  ERROR_T OpenSnapshot(BTreeSnapshot &snap) const;
+  void    CloseSnapshot(BTreeSnapshot &snap) const;
+  ERROR_T Lookup(const BTreeSnapshot &snap, const KEY_T &key, VALUE_T &value) const;
+  ERROR_T Display(const BTreeSnapshot &snap, ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
+  // Snapshots open, and blocks waiting for them to close
+  SIZE_T  GetNumSnapshots() const;
+  SIZE_T  GetNumRetiredBlocks() const { return numretired; }
+
+  // Lookup, Insert and Update may be called from many threads at once.
+  // The whole-tree walks below (SanityCheck, Display, GetStats) take no
+  // latches and expect the index to be quiescent, unless it is shadow
+  // paged.
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
@@ -140,15 +594,23 @@ public:
   // per line.  This will be the keys and values in the tree
   // sorted in order of keys.
   ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
+
+  // Walk the tree and report its shape and how full its nodes are
+  ERROR_T GetStats(BTreeStats &stats) const;
   
   ostream & Print(ostream &os) const;
 
-  //This lookup function will find the path to the node where the passed in key would go, and return it as a stack of pointers.
-  ERROR_T LookupLeaf(const SIZE_T &node, const KEY_T &key, std::vector<SIZE_T> &pointerPath);
+  //This lookup function will find the path to the leaf where the passed in key would go, and return it as a stack of pointers.
+  //The leaf itself is left in leaf.  The path is latched for op (shared for lookups) by crabbing down
+  //it, or in a B-link index only the leaf is, and whatever is returned the caller releases it with UnlatchPath.
+  //If upper is given, bounded says whether the leaf has a largest key it may hold, and upper is that key;
+  //it holds for as long as the leaf stays latched.
+  ERROR_T LookupLeaf(const KEY_T &key, BTreePath &pointerPath, BTreeNode &leaf, const BTreeOp op=BTREE_OP_LOOKUP,
+		     KEY_T *upper=0, bool *bounded=0);
 
-//Rebalance takes a path of pointers and a node at the bottom of that path. It will split the node and recursively walk up the parent path
+//Rebalance takes a latched path of pointers with an overfull node at the bottom of that path. It will split the node and walk up the parent path
 // guaranteeing the sanity of each parent.
-  ERROR_T Rebalance(const SIZE_T &node, std::vector<SIZE_T> ptrPath);
+  ERROR_T Rebalance(BTreePath &ptrPath);
 
 //Walks the tree starting at root node. For our sanity check.
   ERROR_T SanityWalk(const SIZE_T &node/*, std::set<BTreeNode> &allTreeNodes*/) const;
@@ -158,4 +620,9 @@ public:
 
 inline ostream & operator<<(ostream &os, const BTreeIndex &b) { return b.Print(os);}
 
+
+// Key number i as keysize decimal digits, as the benchmarks make them;
+// empty if i has more digits than that
+string MakeKey(const SIZE_T keysize, const SIZE_T i);
+
 #endif
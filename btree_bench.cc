@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+//
+// Lookup latency versus tree height
+//
+// Builds a fresh index on the disk, inserting numkeys distinct keys in
+// random order.  Each time the number of keys doubles, it times
+// numlookups random lookups of keys already in the tree and prints a
+// line with the tree height and the cost of a lookup.
+//
+
+void usage()
+{
+  cerr << "usage: btree_bench [-f fixed|slotted|buffered] [-s seed] filestem cachesize keysize valuesize numkeys numlookups\n";
+}
+
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+int main(int argc, char *argv[])
+{
+  SIZE_T format=BTREE_FORMAT_FIXED;
+  unsigned int seed=1;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"f:s:"))!=-1) {
+    switch (opt) {
+    case 'f':
+      if (string(optarg)=="slotted") {
+	format=BTREE_FORMAT_SLOTTED;
+      } else if (string(optarg)=="buffered") {
+	format=BTREE_FORMAT_BUFFERED;
+      } else if (string(optarg)=="fixed") {
+	format=BTREE_FORMAT_FIXED;
+      } else {
+	usage();
+	return -1;
+      }
+      break;
+    case 's':
+      seed=atoi(optarg);
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (argc-optind != 6) {
+    usage();
+    return -1;
+  }
+
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
+  SIZE_T keysize=atoi(argv[optind+2]);
+  SIZE_T valuesize=atoi(argv[optind+3]);
+  SIZE_T numkeys=atoi(argv[optind+4]);
+  SIZE_T numlookups=atoi(argv[optind+5]);
+  SIZE_T superblocknum;
+  ERROR_T rc;
+  SIZE_T i;
+
+  if (MakeKey(keysize,numkeys).empty()) {
+    cerr << "keysize "<<keysize<<" has too few digits for "<<numkeys<<" keys\n";
+    return -1;
+  }
+
+  // Insert the keys in a random order
+  srand(seed);
+  vector<SIZE_T> order(numkeys);
+  for (i=0;i<numkeys;i++) {
+    order[i]=i;
+  }
+  for (i=numkeys;i>1;i--) {
+    SIZE_T j=rand()%i;
+    SIZE_T t=order[i-1];
+    order[i-1]=order[j];
+    order[j]=t;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format);
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't create index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  string value(valuesize,'v');
+  VALUE_T val;
+  BTreeStats stats;
+  SIZE_T next=1024;
+
+  cout << "numkeys\theight\tus/lookup\treads/lookup\tdiskreads/lookup\tsimtime/lookup\n";
+
+  for (i=0;i<numkeys;i++) {
+    if ((rc=btree.Insert(KEY_T(MakeKey(keysize,order[i]).c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) {
+      cerr << "Can't insert key "<<i<<" due to error "<<rc<<endl;
+      break;
+    }
+    if (i+1!=next && i+1!=numkeys) {
+      continue;
+    }
+    next*=2;
+
+    if ((rc=btree.GetStats(stats))!=ERROR_NOERROR) {
+      cerr << "Can't get statistics due to error "<<rc<<endl;
+      return -1;
+    }
+
+    SIZE_T reads=cache.GetNumReads();
+    SIZE_T diskreads=cache.GetNumDiskReads();
+    double simtime=cache.GetCurrentTime();
+    double start=Now();
+
+    for (SIZE_T j=0;j<numlookups;j++) {
+      if ((rc=btree.Lookup(KEY_T(MakeKey(keysize,order[rand()%(i+1)]).c_str()),val))!=ERROR_NOERROR) {
+	cerr << "Lookup failed due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+
+    double n = numlookups>0 ? numlookups : 1;
+    cout << i+1 << "\t" << stats.height
+	 << "\t" << (Now()-start)*1e6/n
+	 << "\t" << (cache.GetNumReads()-reads)/n
+	 << "\t" << (cache.GetNumDiskReads()-diskreads)/n
+	 << "\t" << (cache.GetCurrentTime()-simtime)/n << endl;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  return 0;
+}
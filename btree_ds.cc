@@ -12,19 +12,58 @@ using namespace std;
 
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
-  SIZE_T n=blocksize-sizeof(*this);
+  SIZE_T n=blocksize-BTREE_NODE_HEADER_BYTES;
   return n;
 }
 
 
 SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  return (GetNumDataBytes()-sizeof(SIZE_T)-GetHighKeyBytes()-GetBufferBytes())/(keysize+sizeof(SIZE_T));  // floor intended
 }
 
 SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  return (GetNumDataBytes()-sizeof(SIZE_T)-GetHighKeyBytes())/(keysize+GetLeafValueBytes());  // floor intended
+}
+
+SIZE_T NodeMetadata::GetLeafValueBytes() const
+{
+  return HasOverflowValues() ? sizeof(OverflowRef) : valuesize;
+}
+
+bool NodeMetadata::HasOverflowValues() const
+{
+  return format!=BTREE_FORMAT_SLOTTED && overflowsize>0 && valuesize>overflowsize;
+}
+
+SIZE_T NodeMetadata::GetMaxRecordBytes() const
+{
+  // at least four records per node, so a split always leaves room
+  return (GetNumDataBytes()-BTREE_SLOTTED_HEADER)/4-sizeof(SlotEntry);
+}
+
+SIZE_T NodeMetadata::GetNumOverflowBytes() const
+{
+  return GetNumDataBytes()-sizeof(SIZE_T);
+}
+
+SIZE_T NodeMetadata::GetHighKeyBytes() const
+{
+  return (linked && format!=BTREE_FORMAT_SLOTTED) ? keysize : 0;
+}
+
+SIZE_T NodeMetadata::GetBufferBytes() const
+{
+  if (format!=BTREE_FORMAT_BUFFERED) { 
+    return 0;
+  }
+  return (GetNumDataBytes()-sizeof(SIZE_T))*BTREE_BUFFER_PERCENT/100;
+}
+
+SIZE_T NodeMetadata::GetNumMessageSlots() const
+{
+  return GetBufferBytes()/(keysize+GetLeafValueBytes());  // floor intended
 }
 
 
@@ -34,9 +73,17 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" :
+				   nodetype==BTREE_OVERFLOW_NODE ? "OVERFLOW_NODE" :
+				   nodetype==BTREE_FILTER_NODE ? "FILTER_NODE" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys
+     << ", rightlink="<<rightlink<<", nummessages="<<nummessages
+     << ", overflowsize="<<overflowsize<<", minfill="<<minfill
+     << ", leaffill="<<leaffill<<", interiorfill="<<interiorfill
+     << ", linked="<<linked<<", shadow="<<shadow<<", filterblocks="<<filterblocks
+     << ", format="<<(format==BTREE_FORMAT_SLOTTED ? "SLOTTED" :
+		      format==BTREE_FORMAT_BUFFERED ? "BUFFERED" : "FIXED")<<")";
   return os;
 }
 
@@ -56,7 +103,8 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+		     SIZE_T node_format)
 {
   info.nodetype=node_type;
   info.keysize=key_size;
@@ -65,22 +113,32 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.rootnode=0;
   info.freelist=0;
   info.numkeys=0;				       
+  info.format=node_format;
+  info.overflowsize=0;
+  info.minfill=0;
+  info.leaffill=0;
+  info.interiorfill=0;
+  info.linked=0;
+  info.shadow=0;
+  info.rightlink=0;
+  info.highkey=0;
+  info.highkeylen=0;
+  info.nummessages=0;
+  info.filterblocks=0;
   data=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
     data = new char [info.GetNumDataBytes()];
     memset(data,0,info.GetNumDataBytes());
+    if (IsSlotted()) { 
+      HeapTop()=info.GetNumDataBytes();
+      Frag()=0;
+    }
   }
 }
 
 BTreeNode::BTreeNode(const BTreeNode &rhs) 
 {
-  info.nodetype=rhs.info.nodetype;
-  info.keysize=rhs.info.keysize;
-  info.valuesize=rhs.info.valuesize;
-  info.blocksize=rhs.info.blocksize;
-  info.rootnode=rhs.info.rootnode;
-  info.freelist=rhs.info.freelist;
-  info.numkeys=rhs.info.numkeys;				       
+  info=rhs.info;
   data=0;
   if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
@@ -91,7 +149,20 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
 
 BTreeNode & BTreeNode::operator=(const BTreeNode &rhs) 
 {
-  return *(new (this) BTreeNode(rhs));
+  if (this!=&rhs) { 
+    if (data && (rhs.data==0 || info.GetNumDataBytes()!=rhs.info.GetNumDataBytes())) { 
+      delete [] data;
+      data=0;
+    }
+    info=rhs.info;
+    if (rhs.data) { 
+      if (data==0) { 
+	data=new char [info.GetNumDataBytes()];
+      }
+      memcpy(data,rhs.data,info.GetNumDataBytes());
+    }
+  }
+  return *this;
 }
 
 
@@ -99,11 +170,13 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
-  Block block(sizeof(info)+info.GetNumDataBytes());
+  Block block(BTREE_NODE_HEADER_BYTES+info.GetNumDataBytes());
 
-  memcpy(block.data,&info,sizeof(info));
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
-    memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
+  memcpy(block.data,&info,BTREE_NODE_HEADER_BYTES);
+  if (info.nodetype==BTREE_SUPERBLOCK) { 
+    memcpy(block.data+BTREE_NODE_HEADER_BYTES,&info.format,BTREE_SETTINGS_BYTES);
+  } else if (info.nodetype!=BTREE_UNALLOCATED_BLOCK) { 
+    memcpy(block.data+BTREE_NODE_HEADER_BYTES,data,info.GetNumDataBytes());
   }
 
   return b->WriteBlock(blocknum,block);
@@ -122,26 +195,76 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
-  
-  if (data) { 
-    delete [] data;
-    data=0;
-  }
+  // a node read over and over during descents keeps its data buffer
+  SIZE_T oldbytes = data ? info.GetNumDataBytes() : 0;
+
+  memcpy(&info,block.data,BTREE_NODE_HEADER_BYTES);
 
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
+  if (info.nodetype==BTREE_SUPERBLOCK) { 
+    memcpy(&info.format,block.data+BTREE_NODE_HEADER_BYTES,BTREE_SETTINGS_BYTES);
+  }
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+    if (data && oldbytes!=info.GetNumDataBytes()) { 
+      delete [] data;
+      data=0;
+    }
+    if (data==0) { 
+      data = new char [info.GetNumDataBytes()];
+    }
+    memcpy(data,block.data+BTREE_NODE_HEADER_BYTES,info.GetNumDataBytes());
+  } else if (data) { 
+    delete [] data;
+    data=0;
   }
   
   return ERROR_NOERROR;
 }
 
 
+ERROR_T BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum, const NodeMetadata &settings)
+{
+  memcpy(&info.format,&settings.format,BTREE_SETTINGS_BYTES);
+  return Unserialize(b,blocknum);
+}
+
+
+SlotEntry * BTreeNode::ResolveSlot(const SIZE_T offset) const
+{
+  return (SlotEntry *)(data+BTREE_SLOTTED_HEADER+offset*sizeof(SlotEntry));
+}
+
+char * BTreeNode::ResolveMessage(const SIZE_T offset) const
+{
+  assert(offset<info.GetNumMessageSlots());
+  return data+info.GetNumDataBytes()-info.GetBufferBytes()+offset*(info.keysize+info.GetLeafValueBytes());
+}
+
+SIZE_T & BTreeNode::HeapTop() const
+{
+  return *(SIZE_T *)(data+sizeof(SIZE_T));
+}
+
+SIZE_T & BTreeNode::Frag() const
+{
+  return *(SIZE_T *)(data+2*sizeof(SIZE_T));
+}
+
+
 char * BTreeNode::ResolveKey(const SIZE_T offset) const
 {
+  if (IsSlotted()) { 
+    switch (info.nodetype) { 
+    case BTREE_INTERIOR_NODE:
+    case BTREE_ROOT_NODE:
+    case BTREE_LEAF_NODE:
+      assert(offset<info.numkeys);
+      return data+ResolveSlot(offset)->offset;
+    default:
+      return 0;
+    }
+  }
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
@@ -150,7 +273,7 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
     break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    return data+sizeof(SIZE_T)+offset*(info.keysize+info.GetLeafValueBytes());
     break;
   default:
     return 0;
@@ -160,6 +283,24 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
 
 char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 {
+  if (IsSlotted()) { 
+    switch (info.nodetype) { 
+    case BTREE_INTERIOR_NODE:
+    case BTREE_ROOT_NODE:
+      assert(offset<=info.numkeys);
+      if (offset==0) { 
+	return data;
+      } else {
+	SlotEntry *s=ResolveSlot(offset-1);
+	return data+s->offset+s->keylen;
+      }
+    case BTREE_LEAF_NODE:
+      assert(offset==0);
+      return data;
+    default:
+      return 0;
+    }
+  }
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
@@ -182,7 +323,11 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    if (IsSlotted()) { 
+      SlotEntry *s=ResolveSlot(offset);
+      return data+s->offset+s->keylen;
+    }
+    return data+sizeof(SIZE_T)+offset*(info.keysize+info.GetLeafValueBytes())+info.keysize;
     break;
   default:
     return 0;
@@ -204,8 +349,10 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
-  k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  SIZE_T len = IsSlotted() ? ResolveSlot(offset)->keylen : info.keysize;
+
+  k.Resize(len,false);
+  memcpy(k.data,p,len);
   return ERROR_NOERROR;
 }
 
@@ -229,8 +376,10 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T len = IsSlotted() ? (ResolveSlot(offset)->vallen & ~BTREE_SLOT_OVERFLOW) : info.GetLeafValueBytes();
+
+  v.Resize(len,false);
+  memcpy(v.data,p,len);
   return ERROR_NOERROR;
 }
 
@@ -255,6 +404,16 @@ ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
     return ERROR_NOMEM;
   }
 
+  if (IsSlotted()) { 
+    SlotEntry *s=ResolveSlot(offset);
+    if (s->keylen!=k.length) { 
+      return ReplaceRecord(offset,k,p+s->keylen,s->vallen & ~BTREE_SLOT_OVERFLOW,
+			   s->vallen & BTREE_SLOT_OVERFLOW);
+    }
+    memcpy(p,k.data,k.length);
+    return ERROR_NOERROR;
+  }
+
   memcpy(p,k.data,info.keysize);
 
   return ERROR_NOERROR;
@@ -276,15 +435,26 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 
 
 
-ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
+ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v, const bool overflow)
 {
   char *p=ResolveVal(offset);
   
   if (p==0) { 
     return ERROR_NOMEM;
   }
+
+  if (IsSlotted()) { 
+    SlotEntry *s=ResolveSlot(offset);
+    if (s->vallen!=(v.length | (overflow ? BTREE_SLOT_OVERFLOW : 0))) { 
+      KEY_T k;
+      GetKey(offset,k);
+      return ReplaceRecord(offset,k,(const char*)v.data,v.length,overflow);
+    }
+    memcpy(p,v.data,v.length);
+    return ERROR_NOERROR;
+  }
   
-  memcpy(p,v.data,info.valuesize);
+  memcpy(p,v.data,info.GetLeafValueBytes());
   
   return ERROR_NOERROR;
 }
@@ -304,6 +474,344 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+bool BTreeNode::IsValOverflow(const SIZE_T offset) const
+{
+  if (IsSlotted()) { 
+    return (ResolveSlot(offset)->vallen & BTREE_SLOT_OVERFLOW)!=0;
+  } else {
+    return info.HasOverflowValues();
+  }
+}
+
+
+SIZE_T BTreeNode::GetRecordBytes(const SIZE_T offset) const
+{
+  if (IsSlotted()) { 
+    SlotEntry *s=ResolveSlot(offset);
+    return s->keylen+(s->vallen & ~BTREE_SLOT_OVERFLOW)+sizeof(SlotEntry);
+  } else if (info.nodetype==BTREE_LEAF_NODE) {
+    return info.keysize+info.GetLeafValueBytes();
+  } else {
+    return info.keysize+sizeof(SIZE_T);
+  }
+}
+
+
+SIZE_T BTreeNode::GetFreeBytes() const
+{
+  return HeapTop()-(BTREE_SLOTTED_HEADER+info.numkeys*sizeof(SlotEntry));
+}
+
+
+SIZE_T BTreeNode::GetReclaimableBytes() const
+{
+  return GetFreeBytes()+Frag();
+}
+
+
+void BTreeNode::Compact()
+{
+  SIZE_T n=info.GetNumDataBytes();
+  char *old=new char [n];
+
+  memcpy(old,data,n);
+
+  HeapTop()=n;
+  for (SIZE_T i=0;i<info.numkeys;i++) { 
+    SlotEntry *s=ResolveSlot(i);
+    SIZE_T len=s->keylen+(s->vallen & ~BTREE_SLOT_OVERFLOW);
+    HeapTop()-=len;
+    memcpy(data+HeapTop(),old+s->offset,len);
+    s->offset=HeapTop();
+  }
+  if (info.highkey) { 
+    HeapTop()-=info.highkeylen;
+    memcpy(data+HeapTop(),old+info.highkey,info.highkeylen);
+    info.highkey=HeapTop();
+  }
+  Frag()=0;
+
+  delete [] old;
+}
+
+
+void BTreeNode::Truncate(const SIZE_T n)
+{
+  assert(n<=info.numkeys);
+  info.numkeys=n;
+  if (IsSlotted()) { 
+    Compact();
+  }
+}
+
+
+ERROR_T BTreeNode::GetMessage(const SIZE_T offset, KEY_T &k, VALUE_T &v) const
+{
+  if (offset>=info.nummessages) { 
+    return ERROR_NOMEM;
+  }
+  char *p=ResolveMessage(offset);
+  k.Resize(info.keysize,false);
+  memcpy(k.data,p,info.keysize);
+  v.Resize(info.GetLeafValueBytes(),false);
+  memcpy(v.data,p+info.keysize,info.GetLeafValueBytes());
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetMessageVal(const SIZE_T offset, const VALUE_T &v)
+{
+  if (offset>=info.nummessages) { 
+    return ERROR_NOMEM;
+  }
+  memcpy(ResolveMessage(offset)+info.keysize,v.data,info.GetLeafValueBytes());
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertMessage(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  SIZE_T len=info.keysize+info.GetLeafValueBytes();
+
+  assert(offset<=info.nummessages);
+
+  if (info.nummessages>=info.GetNumMessageSlots()) { 
+    return ERROR_NOSPACE;
+  }
+  char *p=ResolveMessage(offset);
+  memmove(p+len,p,(info.nummessages-offset)*len);
+  memcpy(p,k.data,info.keysize);
+  memcpy(p+info.keysize,v.data,info.GetLeafValueBytes());
+  info.nummessages++;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeNode::RemoveMessages(const SIZE_T first, const SIZE_T num)
+{
+  SIZE_T len=info.keysize+info.GetLeafValueBytes();
+
+  assert(first+num<=info.nummessages);
+
+  if (num==0) { 
+    return;
+  }
+  memmove(ResolveMessage(first),ResolveMessage(first)+num*len,(info.nummessages-first-num)*len);
+  info.nummessages-=num;
+}
+
+
+// Binary search, the buffer being sorted
+SIZE_T BTreeNode::FindMessage(const KEY_T &k, bool &found) const
+{
+  SIZE_T lo=0, hi=info.nummessages;
+  KEY_T testkey;
+
+  testkey.Resize(info.keysize,false);
+  found=false;
+  while (lo<hi) { 
+    SIZE_T mid=(lo+hi)/2;
+    memcpy(testkey.data,ResolveMessage(mid),info.keysize);
+    if (testkey<k) { 
+      lo=mid+1;
+    } else {
+      found=(testkey==k);
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+ERROR_T BTreeNode::GetHighKey(KEY_T &k) const
+{
+  if (!HasHighKey()) { 
+    return ERROR_NONEXISTENT;
+  }
+  k.Resize(info.highkeylen,false);
+  memcpy(k.data,data+info.highkey,info.highkeylen);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetHighKey(const KEY_T &k)
+{
+  if (IsSlotted()) { 
+    if (!HasHighKey() || info.highkeylen!=k.length) { 
+      if (HasHighKey()) { 
+	Frag()+=info.highkeylen;
+	info.highkey=0;
+      }
+      SIZE_T off;
+      ERROR_T rc=AllocRecord(k.length,off);
+      if (rc) { return rc; }
+      info.highkey=off;
+      info.highkeylen=k.length;
+    }
+  } else {
+    info.highkeylen=info.GetHighKeyBytes();
+    if (info.highkeylen==0 || k.length!=info.highkeylen) { 
+      return ERROR_SIZE;
+    }
+    info.highkey=info.GetNumDataBytes()-info.highkeylen;
+  }
+  memcpy(data+info.highkey,k.data,info.highkeylen);
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetRightLink() const
+{
+  SIZE_T p=info.rightlink;
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    GetPtr(0,p);
+  }
+  return p;
+}
+
+
+void BTreeNode::SetRightLink(const SIZE_T &p)
+{
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    SetPtr(0,p);
+  } else {
+    info.rightlink=p;
+  }
+}
+
+
+ERROR_T BTreeNode::AllocRecord(const SIZE_T len, SIZE_T &off)
+{
+  if (GetFreeBytes()<len) { 
+    if (GetReclaimableBytes()<len) { 
+      return ERROR_NOSPACE;
+    }
+    Compact();
+  }
+  HeapTop()-=len;
+  off=HeapTop();
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertSlot(const SIZE_T offset, const SIZE_T keylen, const SIZE_T vallen, SlotEntry *&slot)
+{
+  SIZE_T len=keylen+(vallen & ~BTREE_SLOT_OVERFLOW);
+  SIZE_T off;
+  ERROR_T rc;
+
+  assert(offset<=info.numkeys);
+
+  if (GetReclaimableBytes()<len+sizeof(SlotEntry)) { 
+    return ERROR_NOSPACE;
+  }
+  if (GetFreeBytes()<len+sizeof(SlotEntry)) { 
+    Compact();
+  }
+  rc=AllocRecord(len,off);
+  if (rc) { return rc; }
+
+  memmove(ResolveSlot(offset+1),ResolveSlot(offset),(info.numkeys-offset)*sizeof(SlotEntry));
+  info.numkeys++;
+
+  slot=ResolveSlot(offset);
+  slot->offset=off;
+  slot->keylen=keylen;
+  slot->vallen=vallen;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::ReplaceRecord(const SIZE_T offset, const KEY_T &k, const char *v, const SIZE_T vallen, const bool overflow)
+{
+  SlotEntry *s=ResolveSlot(offset);
+  SIZE_T oldlen=s->keylen+(s->vallen & ~BTREE_SLOT_OVERFLOW);
+  SIZE_T off;
+  ERROR_T rc;
+
+  if (GetReclaimableBytes()+oldlen<k.length+vallen) { 
+    return ERROR_NOSPACE;
+  }
+
+  // v may point into the heap, so keep a copy across a compaction
+  char *val=new char [vallen];
+  memcpy(val,v,vallen);
+
+  s->keylen=0;
+  s->vallen=0;
+  Frag()+=oldlen;
+
+  rc=AllocRecord(k.length+vallen,off);
+  if (rc) { delete [] val; return rc; }
+
+  s->offset=off;
+  s->keylen=k.length;
+  s->vallen=vallen | (overflow ? BTREE_SLOT_OVERFLOW : 0);
+  memcpy(data+off,k.data,k.length);
+  memcpy(data+off+k.length,val,vallen);
+  delete [] val;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v, const bool overflow)
+{
+  ERROR_T rc;
+
+  assert(info.nodetype==BTREE_LEAF_NODE);
+  assert(offset<=info.numkeys);
+
+  if (IsSlotted()) { 
+    SlotEntry *s;
+    rc=InsertSlot(offset,k.length,v.length | (overflow ? BTREE_SLOT_OVERFLOW : 0),s);
+    if (rc) { return rc; }
+    memcpy(data+s->offset,k.data,k.length);
+    memcpy(data+s->offset+k.length,v.data,v.length);
+    return ERROR_NOERROR;
+  }
+
+  if (info.numkeys>=info.GetNumSlotsAsLeaf()) { 
+    return ERROR_NOSPACE;
+  }
+  info.numkeys++;
+  memmove(ResolveKey(offset)+info.keysize+info.GetLeafValueBytes(),
+	  ResolveKey(offset),
+	  (info.numkeys-1-offset)*(info.keysize+info.GetLeafValueBytes()));
+  rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &ptr)
+{
+  ERROR_T rc;
+
+  assert(info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE);
+  assert(offset<=info.numkeys);
+
+  if (IsSlotted()) { 
+    SlotEntry *s;
+    rc=InsertSlot(offset,k.length,sizeof(SIZE_T),s);
+    if (rc) { return rc; }
+    memcpy(data+s->offset,k.data,k.length);
+    memcpy(data+s->offset+k.length,&ptr,sizeof(SIZE_T));
+    return ERROR_NOERROR;
+  }
+
+  if (info.numkeys>=info.GetNumSlotsAsInterior()) { 
+    return ERROR_NOSPACE;
+  }
+  info.numkeys++;
+  memmove(ResolveKey(offset)+info.keysize+sizeof(SIZE_T),
+	  ResolveKey(offset),
+	  (info.numkeys-1-offset)*(info.keysize+sizeof(SIZE_T)));
+  rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetPtr(offset+1,ptr);
+}
+
+
 ostream & BTreeNode::Print(ostream &os) const 
 {
   os << "BTreeNode(info="<<info;
@@ -324,7 +832,19 @@ ostream & BTreeNode::Print(ostream &os) const
 	os <<ptr;
       } 
       os << ")";
-	
+      if (info.nummessages>0) { 
+	KEY_T key;
+	VALUE_T val;
+	os << ", messages=(";
+	for (SIZE_T i=0;i<info.nummessages;i++) {
+	  if (i>0) { 
+	    os<<", ";
+	  }
+	  GetMessage(i,key,val);
+	  os<<key<<", "<<val;
+	}
+	os <<")";
+      }
     }
     if (info.nodetype==BTREE_LEAF_NODE) { 
       KEY_T key;
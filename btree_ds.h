@@ -2,6 +2,7 @@
 #define _btree_ds
 
 #include <iostream>
+#include <stddef.h>
 #include "global.h"
 #include "block.h"
 
@@ -13,6 +14,16 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_OVERFLOW_NODE 5
+#define BTREE_FILTER_NODE 6
+
+// Node formats, chosen per index at creation and kept in the superblock
+#define BTREE_FORMAT_FIXED 0    // fixed keysize/valuesize arrays
+#define BTREE_FORMAT_SLOTTED 1  // slot array plus heap, variable lengths
+#define BTREE_FORMAT_BUFFERED 2 // fixed, and interior nodes buffer changes
+
+// Percent of a buffered interior node's data area kept for its buffer
+#define BTREE_BUFFER_PERCENT 50
 
 
 typedef Block Buffer;
@@ -32,10 +43,41 @@ struct NodeMetadata {
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
   SIZE_T numkeys;
+  SIZE_T rightlink;    // right sibling of an interior node (B-link)
+  SIZE_T highkey;      // offset of the high key in the data area, 0 => none
+  SIZE_T highkeylen;
+  SIZE_T nummessages;  // in an interior node's buffer (buffered format)
+  // The rest are settings of the whole index.  Only the superblock
+  // keeps them on the disk, at the start of its data area; any other
+  // node is given them by the index as it is made or read.
+  SIZE_T format;
+  SIZE_T overflowsize; // values longer than this go to overflow blocks (0 => none)
+  SIZE_T minfill;      // target occupancy after a split, percent
+  SIZE_T leaffill;     // percent of a fixed leaf used before splitting
+  SIZE_T interiorfill; // same for fixed interior nodes
+  SIZE_T linked;       // B-link index: nodes carry high keys and right links
+  SIZE_T shadow;       // shadow paged index: changes go to new blocks
+  SIZE_T filterblocks; // Bloom filter blocks after the root node
 
   SIZE_T GetNumDataBytes() const;
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  // Bytes each fixed leaf entry spends on its value
+  SIZE_T GetLeafValueBytes() const;
+  // Fixed leaves keep every value in an overflow chain
+  bool   HasOverflowValues() const;
+  // Largest slotted record (key plus inline value or pointer) we allow
+  // in a node.  Nodes always keep this much room free so that the next
+  // insert or update fits.
+  SIZE_T GetMaxRecordBytes() const;
+  // Bytes of value carried by each overflow block
+  SIZE_T GetNumOverflowBytes() const;
+  // Bytes a fixed-format B-link node sets aside for its high key
+  SIZE_T GetHighKeyBytes() const;
+  // Bytes a buffered interior node sets aside for its buffer, and the
+  // messages that fit in them
+  SIZE_T GetBufferBytes() const;
+  SIZE_T GetNumMessageSlots() const;
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -44,6 +86,11 @@ struct NodeMetadata {
 
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
+// What of NodeMetadata is at the start of every block, and the index's
+// settings that follow it in the superblock
+#define BTREE_NODE_HEADER_BYTES (offsetof(NodeMetadata,format))
+#define BTREE_SETTINGS_BYTES (sizeof(NodeMetadata)-BTREE_NODE_HEADER_BYTES)
+
 
 
 //
@@ -55,7 +102,74 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *Here this pointer is not used, except in a B-link index, where it
+//  is the right link: the block of the next leaf to the right
+//
+// If valuesize exceeds the index's overflowsize, each VALUE is an
+// OverflowRef instead, so the leaf fanout does not depend on valuesize.
+//
+// Slotted node (format BTREE_FORMAT_SLOTTED):
+//
+// PTR HEAPTOP FRAG SLOT SLOT SLOT ... free space ... RECORD RECORD
+//
+// PTR is the leftmost pointer (interior) or unused (leaf).  Each slot
+// locates one record in the heap, which grows down from the end of the
+// block.  A leaf record is KEY VALUE and an interior record is KEY PTR,
+// PTR being the pointer to the right of KEY.  FRAG counts dead heap
+// bytes left behind by replaced records; Compact() reclaims them.
+// A value that does not fit in a record, or is longer than overflowsize,
+// is stored as an OverflowRef to a chain of BTREE_OVERFLOW_NODE blocks.
+//
+// B-link index (linked set in the superblock):
+//
+// Every node but the rightmost of its level has a high key, the
+// largest key that belongs in it, and a right link to the next node of
+// its level.  A leaf's right link is its PTR and an interior node's is
+// rightlink in its metadata.  A fixed node keeps its high key in the
+// last keysize bytes of its data area and a slotted node keeps it as an
+// extra record in its heap.
+//
+// Buffered index (format BTREE_FORMAT_BUFFERED):
+//
+// PTR KEY PTR KEY ... PTR ... free space ... KEY VALUE KEY VALUE
+//
+// Nodes are fixed format, but the last BTREE_BUFFER_PERCENT of an
+// interior node's data area is a buffer of messages, each a key and
+// the value it is to have, laid out and sorted like the entries of a
+// leaf.  A message is newer than any for the same key further down,
+// and than the key's entry in its leaf, and is moved down a level at a
+// time until it is merged into the leaf.
+//
+// Overflow node:
+//
+// NEXT BYTES
+//
+// Filter node:
+//
+// BITS
+//
+// One of the blocks of the index's Bloom filter, which follow the
+// first root node.  Each key sets a few bits of one of them.
+//
+
+struct SlotEntry {
+  SIZE_T offset;   // of the record within the data area
+  SIZE_T keylen;
+  SIZE_T vallen;   // BTREE_SLOT_OVERFLOW set => value is an OverflowRef
+};
+
+#define BTREE_SLOT_OVERFLOW 0x80000000U
+
+struct OverflowRef {
+  SIZE_T block;    // first block of the chain
+  SIZE_T length;   // total length of the value
+};
+
+#define BTREE_SLOTTED_HEADER (3*sizeof(SIZE_T))
+
+// New indexes spill values that would leave fewer than this many
+// entries in a leaf
+#define BTREE_MIN_LEAF_SLOTS 8
 
 
 struct BTreeNode {
@@ -74,12 +188,17 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+	    SIZE_T node_format=BTREE_FORMAT_FIXED);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
+  // Read the superblock, or a node whose settings are already those of
+  // its index
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
+  // Read a node of the index whose superblock is settings
+  ERROR_T Unserialize(BufferCache *b, const SIZE_T block, const NodeMetadata &settings);
 
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
@@ -94,10 +213,50 @@ struct BTreeNode {
 
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
   ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
-  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
+  ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v, const bool overflow=false); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // These work for both formats and shift the following entries right
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v, const bool overflow=false); // leaf
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p); // interior, p goes right of k
+
+  bool   IsSlotted() const { return info.format==BTREE_FORMAT_SLOTTED; }
+  bool   IsValOverflow(const SIZE_T offset) const; // ith value is an OverflowRef (leaf)
+  SIZE_T GetRecordBytes(const SIZE_T offset) const; // heap plus slot bytes used by ith entry (slotted)
+  SIZE_T GetFreeBytes() const;     // contiguous free bytes between slots and heap (slotted)
+  SIZE_T GetReclaimableBytes() const; // free bytes after a Compact() (slotted)
+  void   Compact();                // squeeze out dead heap space (slotted)
+  void   Truncate(const SIZE_T numkeys); // drop all entries from numkeys on
+
+  // The message buffer of a buffered interior node.  Values are as
+  // stored in a leaf.  InsertMessage shifts the following messages
+  // right and gives ERROR_NOSPACE if the buffer is full.  FindMessage
+  // gives the first message whose key is at least k, and whether it
+  // is k.
+  ERROR_T GetMessage(const SIZE_T offset, KEY_T &k, VALUE_T &v) const;
+  ERROR_T SetMessageVal(const SIZE_T offset, const VALUE_T &v);
+  ERROR_T InsertMessage(const SIZE_T offset, const KEY_T &k, const VALUE_T &v);
+  void    RemoveMessages(const SIZE_T first, const SIZE_T num);
+  SIZE_T  FindMessage(const KEY_T &k, bool &found) const;
+
+  // B-link high key and right link; a node without a high key is the
+  // rightmost of its level
+  bool    HasHighKey() const { return info.highkey!=0; }
+  ERROR_T GetHighKey(KEY_T &k) const;
+  ERROR_T SetHighKey(const KEY_T &k);
+  SIZE_T  GetRightLink() const;
+  void    SetRightLink(const SIZE_T &p);
+
   ostream &Print(ostream &rhs) const;
+
+ private:
+  SlotEntry *ResolveSlot(const SIZE_T offset) const;
+  char      *ResolveMessage(const SIZE_T offset) const;
+  SIZE_T    &HeapTop() const;
+  SIZE_T    &Frag() const;
+  ERROR_T    AllocRecord(const SIZE_T len, SIZE_T &off);
+  ERROR_T    InsertSlot(const SIZE_T offset, const SIZE_T keylen, const SIZE_T vallen, SlotEntry *&slot);
+  ERROR_T    ReplaceRecord(const SIZE_T offset, const KEY_T &k, const char *v, const SIZE_T vallen, const bool overflow);
 };
 
 
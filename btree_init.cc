@@ -4,7 +4,7 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [fixed|slotted|buffered]\n";
 }
 
 
@@ -13,11 +13,22 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  SIZE_T format=BTREE_FORMAT_FIXED;
 
-  if (argc!=5) { 
+  if (argc!=5 && argc!=6) { 
     usage();
     return -1;
   }
+  if (argc==6) { 
+    if (string(argv[5])=="slotted") { 
+      format=BTREE_FORMAT_SLOTTED;
+    } else if (string(argv[5])=="buffered") { 
+      format=BTREE_FORMAT_BUFFERED;
+    } else if (string(argv[5])!="fixed") { 
+      usage();
+      return -1;
+    }
+  }
 
   filestem=argv[1];
   cachesize=atoi(argv[2]);
@@ -26,7 +37,7 @@ int main(int argc, char **argv)
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format);
   
   ERROR_T rc;
 
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+//
+// Insert cost of a plain index versus a buffered one
+//
+// Builds a fresh fixed format index on the disk by inserting numkeys
+// distinct keys in random order, writes everything back, and prints a
+// line with the cost of an insert: time taken, disk reads, disk
+// writes and simulated time, counting the final write back.  Then
+// does the same with a buffered index, whose inserts wait in buffers
+// on the interior nodes and reach the leaves in batches.  With a
+// cache much smaller than the tree, a plain insert reads and later
+// writes back a leaf of its own, while a buffered one shares them.
+// -t adds a third run, of a fixed index with a memtable of that many
+// changes in front of it, which takes inserts in memory and merges
+// them into the leaves in batches.  Every key is then looked up again
+// and any that are missing are reported as lost.
+//
+
+void usage()
+{
+  cerr << "usage: btree_insertbench [-s seed] [-t memtablesize] filestem cachesize keysize valuesize numkeys\n";
+}
+
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+// Build an index of the given format from order and report on it
+static int RunOne(char *filestem, const SIZE_T cachesize, const SIZE_T keysize, const SIZE_T valuesize,
+		  const SIZE_T format, const SIZE_T memtablesize, const vector<SIZE_T> &order)
+{
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format);
+  string value(valuesize,'v');
+  SIZE_T superblocknum;
+  BTreeStats stats;
+  ERROR_T rc;
+  SIZE_T i;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR || (rc=btree.SetMemtableSize(memtablesize))!=ERROR_NOERROR) {
+    cerr << "Can't create index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  SIZE_T diskreads=cache.GetNumDiskReads();
+  SIZE_T diskwrites=cache.GetNumDiskWrites();
+  double simtime=cache.GetCurrentTime();
+  double start=Now();
+
+  for (i=0;i<order.size();i++) {
+    if ((rc=btree.Insert(KEY_T(MakeKey(keysize,order[i]).c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) {
+      cerr << "Can't insert key "<<i<<" due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+  if ((rc=btree.GetStats(stats))!=ERROR_NOERROR) {
+    cerr << "Can't get statistics due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  double elapsed=Now()-start;
+  double n=order.size();
+  diskreads=cache.GetNumDiskReads()-diskreads;
+  diskwrites=cache.GetNumDiskWrites()-diskwrites;
+  simtime=cache.GetCurrentTime()-simtime;
+
+  // the lookups are not what we are measuring
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.Attach(0,false))!=ERROR_NOERROR) {
+    cerr << "Can't attach index due to error "<<rc<<endl;
+    return -1;
+  }
+  SIZE_T lost=0;
+  VALUE_T val;
+  for (i=0;i<order.size();i++) {
+    if (btree.Lookup(KEY_T(MakeKey(keysize,order[i]).c_str()),val)!=ERROR_NOERROR) {
+      lost++;
+    }
+  }
+
+  cout << (memtablesize ? "memtable" : format==BTREE_FORMAT_BUFFERED ? "buffered" : "fixed")
+       << "\t" << stats.height << "\t" << stats.nummessages
+       << "\t" << elapsed*1e6/n
+       << "\t" << diskreads/n << "\t" << diskwrites/n
+       << "\t" << simtime/n << "\t" << lost << endl;
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+  return lost ? -1 : 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+  unsigned int seed=1;
+  SIZE_T memtablesize=0;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"s:t:"))!=-1) {
+    switch (opt) {
+    case 's':
+      seed=atoi(optarg);
+      break;
+    case 't':
+      memtablesize=atoi(optarg);
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (argc-optind != 5) {
+    usage();
+    return -1;
+  }
+
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
+  SIZE_T keysize=atoi(argv[optind+2]);
+  SIZE_T valuesize=atoi(argv[optind+3]);
+  SIZE_T numkeys=atoi(argv[optind+4]);
+  SIZE_T i;
+  int failed=0;
+
+  if (numkeys<1) {
+    usage();
+    return -1;
+  }
+  if (MakeKey(keysize,numkeys).empty()) {
+    cerr << "keysize "<<keysize<<" has too few digits for "<<numkeys<<" keys\n";
+    return -1;
+  }
+
+  // The same keys in the same order for each
+  srand(seed);
+  vector<SIZE_T> order(numkeys);
+  for (i=0;i<numkeys;i++) {
+    order[i]=i;
+  }
+  for (i=numkeys;i>1;i--) {
+    SIZE_T j=rand()%i;
+    SIZE_T tmp=order[i-1];
+    order[i-1]=order[j];
+    order[j]=tmp;
+  }
+
+  cout << "format\theight\tmessages\tus/insert\tdiskreads/insert\tdiskwrites/insert\tsimtime/insert\tlost\n";
+
+  failed|=RunOne(filestem,cachesize,keysize,valuesize,BTREE_FORMAT_FIXED,0,order);
+  failed|=RunOne(filestem,cachesize,keysize,valuesize,BTREE_FORMAT_BUFFERED,0,order);
+  if (memtablesize) {
+    failed|=RunOne(filestem,cachesize,keysize,valuesize,BTREE_FORMAT_FIXED,memtablesize,order);
+  }
+
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,384 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+//
+// Throughput of one index shared by many threads
+//
+// Builds a fresh index holding numkeys keys, then for 1, 2, 4, ... up
+// to maxthreads threads has every thread run opsperthread operations
+// against it.  writepercent of them insert new keys and the rest look
+// up keys known to be in the tree.  Prints operations per second and
+// the speedup over one thread, then checks the tree.  -b builds a
+// B-link index instead of a latch crabbing one, and -p makes lookups
+// latch their way down instead of reading optimistically.  -n splits
+// the buffer cache into that many shards.
+//
+// -l logs every insert to filestem.wal and syncs the log before the
+// insert returns, and then also prints how many inserts each sync
+// covered and how long an insert took on average.  More threads give
+// group commit more to gather; -d makes each sync wait that many
+// microseconds first, so that it gathers more still.
+//
+// -c builds a shadow paged index instead, whose writers go one at a
+// time and sync the disk twice per insert.  With it, -a has one more
+// thread walk the whole tree over and over while the others run, each
+// walk from a snapshot, and prints how many walks it made.  A walk
+// that finds fewer keys than the one before counts as a failure.
+//
+// -t puts a memtable of that many changes in front of the index once
+// it is loaded, so inserts go to memory and are merged in batches.  It
+// can't be used with -l, as the memtable is not logged.
+//
+// -v puts a result cache of that many keys in front of the index once
+// it is loaded, and -h sends hotpercent of the lookups to the first
+// hotkeys keys, so that there are hot keys for it to keep.  The hit
+// rate is printed at the end.
+//
+
+void usage()
+{
+  cerr << "usage: btree_mtbench [-f fixed|slotted|buffered] [-s seed] [-w writepercent] [-b] [-p] [-n numshards] [-l] [-d groupdelay] [-c [-a]] [-t memtablesize] [-v resultcachesize] [-h hotpercent -k hotkeys] filestem cachesize keysize valuesize numkeys opsperthread maxthreads\n";
+}
+
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+struct Worker {
+  pthread_t    thread;
+  BTreeIndex  *btree;
+  SIZE_T       keysize;
+  string       value;
+  SIZE_T       numkeys;       // keys 0..numkeys-1 are in the tree
+  SIZE_T       firstnew;      // this thread inserts keys from here on
+  SIZE_T       numops;
+  unsigned int writepercent;
+  unsigned int hotpercent;     // of lookups, to keys 0..hotkeys-1
+  SIZE_T       hotkeys;
+  unsigned int seed;
+  SIZE_T       failures;
+  SIZE_T       numwrites;
+  double       writetime;     // seconds spent in inserts
+};
+
+
+struct Scanner {
+  pthread_t    thread;
+  BTreeIndex  *btree;
+  int          stop;
+  SIZE_T       numscans;
+  SIZE_T       failures;
+};
+
+
+static void *RunScanner(void *arg)
+{
+  Scanner *s=(Scanner *)arg;
+  SIZE_T last=0;
+  BTreeStats stats;
+
+  while (!__atomic_load_n(&s->stop,__ATOMIC_ACQUIRE)) { 
+    if (s->btree->GetStats(stats)!=ERROR_NOERROR || stats.numkeys<last) { 
+      s->failures++;
+    }
+    last=stats.numkeys;
+    s->numscans++;
+  }
+  return 0;
+}
+
+
+static void *RunWorker(void *arg)
+{
+  Worker *w=(Worker *)arg;
+  SIZE_T next=w->firstnew;
+  VALUE_T val;
+
+  for (SIZE_T i=0;i<w->numops;i++) {
+    ERROR_T rc;
+    if ((unsigned)(rand_r(&w->seed)%100) < w->writepercent) {
+      double start=Now();
+      rc=w->btree->Insert(KEY_T(MakeKey(w->keysize,next++).c_str()),VALUE_T(w->value.c_str()));
+      w->writetime+=Now()-start;
+      w->numwrites++;
+    } else {
+      bool hot=(unsigned)(rand_r(&w->seed)%100) < w->hotpercent;
+      SIZE_T key=rand_r(&w->seed)%(hot ? w->hotkeys : w->numkeys);
+      rc=w->btree->Lookup(KEY_T(MakeKey(w->keysize,key).c_str()),val);
+    }
+    if (rc!=ERROR_NOERROR) {
+      w->failures++;
+    }
+  }
+  return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+  SIZE_T format=BTREE_FORMAT_FIXED;
+  unsigned int seed=1;
+  unsigned int writepercent=0;
+  bool linked=false;
+  bool optimistic=true;
+  SIZE_T numshards=1;
+  bool logged=false;
+  SIZE_T groupdelay=0;
+  bool shadow=false;
+  bool scan=false;
+  SIZE_T memtablesize=0;
+  SIZE_T resultcachesize=0;
+  unsigned int hotpercent=0;
+  SIZE_T hotkeys=1;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"f:s:w:bpn:ld:cat:v:h:k:"))!=-1) {
+    switch (opt) {
+    case 'f':
+      if (string(optarg)=="slotted") {
+	format=BTREE_FORMAT_SLOTTED;
+      } else if (string(optarg)=="buffered") {
+	format=BTREE_FORMAT_BUFFERED;
+      } else if (string(optarg)=="fixed") {
+	format=BTREE_FORMAT_FIXED;
+      } else {
+	usage();
+	return -1;
+      }
+      break;
+    case 's':
+      seed=atoi(optarg);
+      break;
+    case 'w':
+      writepercent=atoi(optarg);
+      break;
+    case 'b':
+      linked=true;
+      break;
+    case 'p':
+      optimistic=false;
+      break;
+    case 'n':
+      numshards=atoi(optarg);
+      break;
+    case 'l':
+      logged=true;
+      break;
+    case 'd':
+      groupdelay=atoi(optarg);
+      break;
+    case 'c':
+      shadow=true;
+      break;
+    case 'a':
+      scan=true;
+      break;
+    case 't':
+      memtablesize=atoi(optarg);
+      break;
+    case 'v':
+      resultcachesize=atoi(optarg);
+      break;
+    case 'h':
+      hotpercent=atoi(optarg);
+      break;
+    case 'k':
+      hotkeys=atoi(optarg);
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (argc-optind != 7) {
+    usage();
+    return -1;
+  }
+
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
+  SIZE_T keysize=atoi(argv[optind+2]);
+  SIZE_T valuesize=atoi(argv[optind+3]);
+  SIZE_T numkeys=atoi(argv[optind+4]);
+  SIZE_T opsperthread=atoi(argv[optind+5]);
+  SIZE_T maxthreads=atoi(argv[optind+6]);
+  SIZE_T superblocknum;
+  ERROR_T rc;
+  SIZE_T i, t;
+
+  // every run of every thread gets its own range of new keys
+  SIZE_T maxkey=numkeys+3*maxthreads*opsperthread;
+
+  if (numkeys<1 || maxthreads<1 || (scan && !shadow) || hotkeys<1 || hotkeys>numkeys || (memtablesize && logged)) { 
+    usage();
+    return -1;
+  }
+  if (MakeKey(keysize,maxkey).empty()) {
+    cerr << "keysize "<<keysize<<" has too few digits for "<<maxkey<<" keys\n";
+    return -1;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize,numshards);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format,BTREE_DEFAULT_MINFILL,
+		   BTREE_DEFAULT_FILL,BTREE_DEFAULT_FILL,linked,shadow);
+
+  btree.SetOptimistic(optimistic);
+
+  if (logged) {
+    if ((rc=cache.SetWriteAheadLog(filestem))!=ERROR_NOERROR) {
+      cerr << "Can't open log due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't create index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  // Load the initial keys in a random order
+  srand(seed);
+  vector<SIZE_T> order(numkeys);
+  for (i=0;i<numkeys;i++) {
+    order[i]=i;
+  }
+  for (i=numkeys;i>1;i--) {
+    SIZE_T j=rand()%i;
+    SIZE_T tmp=order[i-1];
+    order[i-1]=order[j];
+    order[j]=tmp;
+  }
+  string value(valuesize,'v');
+  for (i=0;i<numkeys;i++) {
+    if ((rc=btree.Insert(KEY_T(MakeKey(keysize,order[i]).c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) {
+      cerr << "Can't insert key "<<i<<" due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  // the load is not what we are measuring
+  if (logged) {
+    cache.GetWriteAheadLog()->SetGroupDelay(groupdelay);
+  }
+  if ((rc=btree.SetMemtableSize(memtablesize))!=ERROR_NOERROR) {
+    cerr << "Can't set up memtable due to error "<<rc<<endl;
+    return -1;
+  }
+  btree.SetResultCacheSize(resultcachesize);
+
+  cout << "threads\tops/s\tspeedup\tfailures\trestarts" << (logged ? "\tcommits/sync\tinsert us" : "")
+       << (scan ? "\tscans" : "") << "\n";
+
+  SIZE_T nextkey=numkeys;
+  double base=0;
+  SIZE_T totalfailures=0;
+
+  for (t=1;t<=maxthreads;t=(t*2>maxthreads && t<maxthreads) ? maxthreads : t*2) {
+    vector<Worker> workers(t);
+    double start=Now();
+    SIZE_T restarts=btree.GetNumRestarts();
+    SIZE_T commits=logged ? cache.GetWriteAheadLog()->GetNumCommits() : 0;
+    SIZE_T syncs=logged ? cache.GetWriteAheadLog()->GetNumForces() : 0;
+    Scanner scanner;
+
+    if (scan) { 
+      scanner.btree=&btree;
+      scanner.stop=0;
+      scanner.numscans=0;
+      scanner.failures=0;
+      pthread_create(&scanner.thread,0,RunScanner,&scanner);
+    }
+
+    for (i=0;i<t;i++) {
+      workers[i].btree=&btree;
+      workers[i].keysize=keysize;
+      workers[i].value=value;
+      workers[i].numkeys=numkeys;
+      workers[i].firstnew=nextkey;
+      workers[i].numops=opsperthread;
+      workers[i].writepercent=writepercent;
+      workers[i].hotpercent=hotpercent;
+      workers[i].hotkeys=hotkeys;
+      workers[i].seed=seed+t*1000+i;
+      workers[i].failures=0;
+      workers[i].numwrites=0;
+      workers[i].writetime=0;
+      nextkey+=opsperthread;
+      pthread_create(&workers[i].thread,0,RunWorker,&workers[i]);
+    }
+
+    SIZE_T failures=0, writes=0;
+    double writetime=0;
+    for (i=0;i<t;i++) {
+      pthread_join(workers[i].thread,0);
+      failures+=workers[i].failures;
+      writes+=workers[i].numwrites;
+      writetime+=workers[i].writetime;
+    }
+    if (scan) { 
+      __atomic_store_n(&scanner.stop,1,__ATOMIC_RELEASE);
+      pthread_join(scanner.thread,0);
+      failures+=scanner.failures;
+    }
+
+    double rate=t*opsperthread/(Now()-start);
+    if (t==1) {
+      base=rate;
+    }
+    totalfailures+=failures;
+    cout << t << "\t" << rate << "\t" << rate/base << "\t" << failures
+	 << "\t" << btree.GetNumRestarts()-restarts;
+    if (logged) {
+      commits=cache.GetWriteAheadLog()->GetNumCommits()-commits;
+      syncs=cache.GetWriteAheadLog()->GetNumForces()-syncs;
+      cout << "\t" << (syncs ? (double)commits/syncs : 0)
+	   << "\t" << (writes ? writetime/writes*1e6 : 0);
+    }
+    if (scan) { 
+      cout << "\t" << scanner.numscans;
+    }
+    cout << endl;
+  }
+
+  if ((rc=btree.SanityCheck())!=ERROR_NOERROR) {
+    cerr << "Sanity check failed due to error "<<rc<<endl;
+    return -1;
+  }
+  BTreeStats stats;
+  if (btree.GetStats(stats)==ERROR_NOERROR) {
+    cerr << stats;
+  }
+  if (resultcachesize) {
+    const ResultCache *r=btree.GetResultCache();
+    cerr << "result cache hit rate "<<(r->GetNumLookups() ? (double)r->GetNumHits()/r->GetNumLookups() : 0)<<endl;
+  }
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+
+  return totalfailures ? -1 : 0;
+}
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "btree.h"
+
+//
+// Recovery time versus log size
+//
+// For no checkpoints at all, and then for checkpoints every
+// mininterval, 2*mininterval, ... up to maxinterval kilobytes of log,
+// builds a fresh logged index on the disk by inserting numkeys
+// distinct keys in random order, crashes, and recovers.  Prints a line
+// for each with the checkpoints taken, the size of the log recovery
+// had to read, the updates it replayed, the blocks it wrote, and how
+// long it took, in simulated time and in seconds.  Blocks are written
+// in block order, so the simulated time depends more on how many
+// there are and how far apart than on how many updates went into
+// them.  Every key is then looked up again and any that are missing
+// are reported as lost.  The log is written but not synced.
+//
+
+void usage()
+{
+  cerr << "usage: btree_recoverybench [-f fixed|slotted|buffered] [-s seed] filestem cachesize keysize valuesize numkeys mininterval maxinterval\n";
+}
+
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+// Build, crash and recover with a checkpoint every intervalkb, or none
+static int RunOne(char *filestem, const SIZE_T cachesize, const SIZE_T keysize, const SIZE_T valuesize,
+		  const SIZE_T format, const vector<SIZE_T> &order, const SIZE_T intervalkb)
+{
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format);
+  string value(valuesize,'v');
+  SIZE_T superblocknum;
+  ERROR_T rc;
+  SIZE_T i;
+
+  if ((rc=cache.SetWriteAheadLog(filestem,false))!=ERROR_NOERROR) {
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+  cache.SetCheckpointInterval(intervalkb*1024.0);
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't create index due to error "<<rc<<endl;
+    return -1;
+  }
+  for (i=0;i<order.size();i++) {
+    if ((rc=btree.Insert(KEY_T(MakeKey(keysize,order[i]).c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) {
+      cerr << "Can't insert key "<<i<<" due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  WriteAheadLog *log=cache.GetWriteAheadLog();
+  SIZE_T checkpoints=log->GetNumCheckpoints();
+
+  cache.Crash();
+  double start=Now();
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't recover due to error "<<rc<<endl;
+    return -1;
+  }
+  double elapsed=Now()-start;
+  if ((rc=btree.Attach(0,false))!=ERROR_NOERROR) {
+    cerr << "Can't attach index due to error "<<rc<<endl;
+    return -1;
+  }
+
+  SIZE_T lost=0;
+  VALUE_T val;
+  for (i=0;i<order.size();i++) {
+    if (btree.Lookup(KEY_T(MakeKey(keysize,order[i]).c_str()),val)!=ERROR_NOERROR) {
+      lost++;
+    }
+  }
+
+  if (intervalkb) {
+    cout << intervalkb;
+  } else {
+    cout << "none";
+  }
+  cout << "\t" << checkpoints << "\t" << log->GetRecoveredBytes()/1024
+       << "\t" << log->GetNumRecoveredRecords() << "\t" << log->GetNumRecoveredBlocks()
+       << "\t" << log->GetRecoveryTime()
+       << "\t" << elapsed << "\t" << lost << endl;
+
+  if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+    cerr <<"Can't detach from index due to error "<<rc<<endl;
+    return -1;
+  }
+  if ((rc=cache.Detach())!=ERROR_NOERROR) {
+    cerr <<"Can't detach from cache due to error "<<rc<<endl;
+    return -1;
+  }
+  return lost ? -1 : 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+  SIZE_T format=BTREE_FORMAT_FIXED;
+  unsigned int seed=1;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"f:s:"))!=-1) {
+    switch (opt) {
+    case 'f':
+      if (string(optarg)=="slotted") {
+	format=BTREE_FORMAT_SLOTTED;
+      } else if (string(optarg)=="buffered") {
+	format=BTREE_FORMAT_BUFFERED;
+      } else if (string(optarg)=="fixed") {
+	format=BTREE_FORMAT_FIXED;
+      } else {
+	usage();
+	return -1;
+      }
+      break;
+    case 's':
+      seed=atoi(optarg);
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (argc-optind != 7) {
+    usage();
+    return -1;
+  }
+
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
+  SIZE_T keysize=atoi(argv[optind+2]);
+  SIZE_T valuesize=atoi(argv[optind+3]);
+  SIZE_T numkeys=atoi(argv[optind+4]);
+  SIZE_T mininterval=atoi(argv[optind+5]);
+  SIZE_T maxinterval=atoi(argv[optind+6]);
+  SIZE_T i;
+  int failed=0;
+
+  if (numkeys<1 || mininterval<1 || maxinterval<mininterval) {
+    usage();
+    return -1;
+  }
+  if (MakeKey(keysize,numkeys).empty()) {
+    cerr << "keysize "<<keysize<<" has too few digits for "<<numkeys<<" keys\n";
+    return -1;
+  }
+
+  // The same keys in the same order every time
+  srand(seed);
+  vector<SIZE_T> order(numkeys);
+  for (i=0;i<numkeys;i++) {
+    order[i]=i;
+  }
+  for (i=numkeys;i>1;i--) {
+    SIZE_T j=rand()%i;
+    SIZE_T tmp=order[i-1];
+    order[i-1]=order[j];
+    order[j]=tmp;
+  }
+
+  cout << "interval(KB)\tcheckpoints\tlog(KB)\treplayed\tblocks\trecovery time\trecovery s\tlost\n";
+
+  failed|=RunOne(filestem,cachesize,keysize,valuesize,format,order,0);
+  for (i=mininterval;i<=maxinterval;i*=2) {
+    failed|=RunOne(filestem,cachesize,keysize,valuesize,format,order,i);
+  }
+
+  return failed ? -1 : 0;
+}
@@ -44,6 +44,10 @@ int main(int argc, char **argv)
     } else {
       cerr <<"Sanity check succeded\n";
     }
+    BTreeStats stats;
+    if ((rc=btree.GetStats(stats))==ERROR_NOERROR) { 
+      cerr << stats;
+    }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
       return -1;
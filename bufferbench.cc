@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <vector>
+
+#include "buffercache.h"
+
+//
+// Buffer cache contention
+//
+// For 1, 2, 4, ... up to maxshards shards, makes a cache of cachesize
+// blocks and reads blocks 0..numblocks-1 into it.  Then for 1, 2, 4,
+// ... up to maxthreads threads has every thread read opsperthread
+// random blocks of these, and prints the reads per second, the
+// speedup over one thread with the same shards and the hit ratio.
+// With numblocks no larger than cachesize every read is a hit, so this
+// measures only the cost of getting at the cache.
+//
+
+void usage()
+{
+  cerr << "usage: bufferbench [-s seed] filestem cachesize numblocks opsperthread maxthreads maxshards\n";
+}
+
+
+static double Now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+
+static SIZE_T Next(const SIZE_T n, const SIZE_T max)
+{
+  return (n*2>max && n<max) ? max : n*2;
+}
+
+
+struct Reader {
+  pthread_t    thread;
+  BufferCache *cache;
+  SIZE_T       numblocks;
+  SIZE_T       numops;
+  unsigned int seed;
+  SIZE_T       failures;
+};
+
+
+static void *RunReader(void *arg)
+{
+  Reader *r=(Reader *)arg;
+  Block block;
+
+  for (SIZE_T i=0;i<r->numops;i++) {
+    if (r->cache->ReadBlock(rand_r(&r->seed)%r->numblocks,block)!=ERROR_NOERROR) {
+      r->failures++;
+    }
+  }
+  return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+  unsigned int seed=1;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"s:"))!=-1) {
+    switch (opt) {
+    case 's':
+      seed=atoi(optarg);
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (argc-optind != 6) {
+    usage();
+    return -1;
+  }
+
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
+  SIZE_T numblocks=atoi(argv[optind+2]);
+  SIZE_T opsperthread=atoi(argv[optind+3]);
+  SIZE_T maxthreads=atoi(argv[optind+4]);
+  SIZE_T maxshards=atoi(argv[optind+5]);
+  SIZE_T i, s, t;
+  ERROR_T rc;
+
+  DiskSystem disk(filestem);
+
+  if (numblocks<1 || numblocks>disk.GetNumBlocks() || maxthreads<1 || maxshards<1) {
+    usage();
+    return -1;
+  }
+
+  cout << "shards\tthreads\treads/s\tspeedup\thitratio\n";
+
+  SIZE_T totalfailures=0;
+
+  for (s=1;s<=maxshards;s=Next(s,maxshards)) {
+    BufferCache cache(&disk,cachesize,s);
+
+    if ((rc=cache.Attach())!=ERROR_NOERROR) {
+      cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+      return -1;
+    }
+
+    Block block;
+    for (i=0;i<numblocks;i++) {
+      if ((rc=cache.ReadBlock(i,block))!=ERROR_NOERROR) {
+	cerr << "Can't read block "<<i<<" due to error "<<rc<<endl;
+	return -1;
+      }
+    }
+
+    double base=0;
+
+    for (t=1;t<=maxthreads;t=Next(t,maxthreads)) {
+      vector<Reader> readers(t);
+      SIZE_T reads=cache.GetNumReads();
+      SIZE_T diskreads=cache.GetNumDiskReads();
+      double start=Now();
+
+      for (i=0;i<t;i++) {
+	readers[i].cache=&cache;
+	readers[i].numblocks=numblocks;
+	readers[i].numops=opsperthread;
+	readers[i].seed=seed+s*1000+t*100+i;
+	readers[i].failures=0;
+	pthread_create(&readers[i].thread,0,RunReader,&readers[i]);
+      }
+      for (i=0;i<t;i++) {
+	pthread_join(readers[i].thread,0);
+	totalfailures+=readers[i].failures;
+      }
+
+      double rate=t*opsperthread/(Now()-start);
+      if (t==1) {
+	base=rate;
+      }
+      double n=cache.GetNumReads()-reads;
+      cout << s << "\t" << t << "\t" << rate << "\t" << rate/base
+	   << "\t" << (n>0 ? 1-(cache.GetNumDiskReads()-diskreads)/n : 0) << endl;
+    }
+
+    if ((rc=cache.Detach())!=ERROR_NOERROR) {
+      cerr << "Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  if (totalfailures) {
+    cerr << totalfailures << " reads failed\n";
+  }
+  return totalfailures ? -1 : 0;
+}
@@ -1,53 +1,186 @@
+#include <algorithm>
+#include <string.h>
 #include "buffercache.h"
 
-ERROR_T BufferCache::CheckDeleteOldest()
+// Bring blocknum into the shard's policy, writing back and dropping
+// the block it replaces if the shard is full.  A shard that has been
+// shrunk also lets go of a few more blocks each time, until it fits.
+ERROR_T BufferCache::Admit(CacheShard &shard, const SIZE_T blocknum)
 {
-  // In a real buffer cache, we would use a priority queue to make this O(1)
+  SIZE_T victim;
+  ERROR_T rc;
 
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator oldestptr=blockmap.end();
-  double oldest = curtime+1;
+  for (SIZE_T i=0;i<BUFFERCACHE_SHRINK_STEP && shard.blockmap.size()>shard.cachesize;i++) { 
+    if (!shard.policy->Evict(victim)) { 
+      break;
+    }
+    if ((rc=DropBlock(shard,victim))!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
 
-  // Only delete if the cache is full
-  if (blockmap.size() < cachesize) {
+  if (!shard.policy->Admit(blocknum,shard.blockmap.size()>=shard.cachesize,victim)) {
     return ERROR_NOERROR;
   }
+  return DropBlock(shard,victim);
+}
 
-  // Find oldest
+// Write back the victim of the shard's policy if it is dirty, and
+// drop it, unless an operation that has not committed changed it
+ERROR_T BufferCache::DropBlock(CacheShard &shard, const SIZE_T victim)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator v=shard.blockmap.find(victim);
+  SIZE_T ignored;
+  ERROR_T rc;
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
-	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
-	 oldestptr=i;
-	 oldest=(*i).second.lastaccessed;
-       }
+  if (v==shard.blockmap.end()) { 
+    return ERROR_NOERROR;
   }
-  
-  // write and delete it if it exists
- 
-  if (oldestptr!=blockmap.end()) { 
-    if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+  if (!shard.inflight.empty() && shard.inflight.count(victim)) { 
+    // back in line; the shard runs over its size until the commit
+    shard.policy->Admit(victim,false,ignored);
+    return ERROR_NOERROR;
+  }
+  if (shard.tier) { 
+    // the tier knows nothing of the log, so the log goes first
+    if ((rc=LogAhead(shard,victim))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    shard.tier->Put(victim,(*v).second,(*v).second.dirty);
+    shard.blockmap.erase(v);
+    return SpillTier(shard,false);
+  }
+  if ((*v).second.dirty) {
+    if ((rc=WriteBack(shard,(*v).first,(*v).second))!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  shard.blockmap.erase(v);
+  return ERROR_NOERROR;
+}
+
+// Make the log durable up to the last change to blocknum, which is
+// about to leave the cache
+ERROR_T BufferCache::LogAhead(CacheShard &shard, const SIZE_T blocknum)
+{
+  map<SIZE_T, LSN_T>::iterator l=shard.lsns.find(blocknum);
+
+  if (l!=shard.lsns.end()) { 
+    ERROR_T rc=log->Force((*l).second);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    shard.lsns.erase(l);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::WriteBack(CacheShard &shard, const SIZE_T blocknum, const Block &block)
+{
+  double reqtime;
+  ERROR_T rc;
+
+  if ((rc=LogAhead(shard,blocknum))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  rc=disk->Write(blocknum,block,reqtime);
+  shard.curtime+=reqtime;
+  shard.diskwrites++;
+  if (rc==ERROR_NOERROR && !shard.reclsns.empty()) { 
+    shard.reclsns.erase(blocknum);
+  }
+  return rc;
+}
+
+// Write back a block if it is dirty and no operation is changing it,
+// but keep it cached
+ERROR_T BufferCache::CleanBlock(CacheShard &shard, const SIZE_T blocknum)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b=shard.blockmap.find(blocknum);
+  ERROR_T rc;
+
+  if (b!=shard.blockmap.end()) { 
+    if (!(*b).second.dirty || (!shard.inflight.empty() && shard.inflight.count(blocknum))) { 
+      return ERROR_NOERROR;
+    }
+    if ((rc=WriteBack(shard,blocknum,(*b).second))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    (*b).second.dirty=false;
+    return ERROR_NOERROR;
+  }
+  Block block(disk->GetBlockSize());
+  bool dirty;
+  if (shard.tier && shard.tier->Take(blocknum,block,dirty)) { 
+    if (dirty && (rc=WriteBack(shard,blocknum,block))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    shard.tier->Put(blocknum,block,false);
+  }
+  return ERROR_NOERROR;
+}
+
+// Let go of the blocks the shard's tier has no room for, or all of
+// them, writing back the dirty ones
+ERROR_T BufferCache::SpillTier(CacheShard &shard, const bool all)
+{
+  Block block(disk->GetBlockSize());
+  SIZE_T blocknum;
+  bool dirty;
+
+  while (shard.tier && (all || shard.tier->Overfull()) &&
+	 shard.tier->EvictOldest(blocknum,block,dirty)) { 
+    if (dirty) { 
+      ERROR_T rc=WriteBack(shard,blocknum,block);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
-    blockmap.erase(oldestptr);
   }
   return ERROR_NOERROR;
 }
 
 BufferCache::BufferCache(DiskSystem *d,
-			 SIZE_T cs) : 
-   disk(d), cachesize(cs), curtime(0),
-   allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
-{}
+			 SIZE_T cs,
+			 SIZE_T ns,
+			 SIZE_T p) : 
+   disk(d), cachesize(cs), policy(p), pinnedlevels(0), mrc(0), log(0),
+   checkpointinterval(0), checkpointbytes(0), lastcheckpoint(0)
+{
+  pthread_mutex_init(&mrclock,0);
+  pthread_mutex_init(&checkpointlock,0);
+  if (policy>CACHE_POLICY_CLOCKPRO) { 
+    policy=CACHE_POLICY_LRU;
+  }
+  // every shard needs room for at least one block
+  if (cachesize<1) { 
+    cachesize=1;
+  }
+  numshards = (ns<1) ? 1 : (ns>cachesize) ? cachesize : ns;
+  shards=new CacheShard [numshards];
+  for (SIZE_T i=0;i<numshards;i++) { 
+    // the first cachesize%numshards shards take one block more
+    shards[i].cachesize=cachesize/numshards + (i<cachesize%numshards ? 1 : 0);
+    shards[i].policy=ReplacementPolicy::Create(policy,shards[i].cachesize);
+    shards[i].maxpinned=shards[i].cachesize*BUFFERCACHE_MAX_PINNED_PERCENT/100;
+    shards[i].shadow=0;
+    shards[i].tier=0;
+    shards[i].curtime=0;
+    shards[i].allocs=shards[i].deallocs=0;
+    shards[i].reads=shards[i].writes=0;
+    shards[i].diskreads=shards[i].diskwrites=0;
+    shards[i].shadowdiskreads=0;
+    shards[i].tierhits=0;
+    pthread_mutex_init(&shards[i].lock,0);
+  }
+  numlatches=disk->GetNumBlocks();
+  latches=new pthread_rwlock_t [numlatches];
+  versions=new SIZE_T [numlatches];
+  for (SIZE_T i=0;i<numlatches;i++) { 
+    pthread_rwlock_init(&latches[i],0);
+    versions[i]=0;
+  }
+}
 
 
 BufferCache::~BufferCache()
@@ -55,42 +188,175 @@ BufferCache::~BufferCache()
   if (disk) { 
     Detach();
   }
-  disk=0; cachesize=0; curtime=0;
+  for (SIZE_T i=0;i<numlatches;i++) { 
+    pthread_rwlock_destroy(&latches[i]);
+  }
+  delete [] latches;
+  delete [] versions;
+  for (SIZE_T i=0;i<numshards;i++) { 
+    pthread_mutex_destroy(&shards[i].lock);
+    delete shards[i].policy;
+    delete shards[i].shadow;
+    delete shards[i].tier;
+  }
+  delete [] shards;
+  delete mrc;
+  pthread_mutex_destroy(&mrclock);
+  pthread_mutex_destroy(&checkpointlock);
+  delete log;
+  disk=0; cachesize=0;
+}
+
+
+CacheShard & BufferCache::GetShard(const SIZE_T blocknum) const
+{
+  // Fibonacci hashing, scaled to the number of shards by its top bits,
+  // so that strided block numbers spread out too
+  unsigned int h=(unsigned int)blocknum*2654435761U;
+  return shards[(SIZE_T)(((unsigned long long)h*numshards)>>32)];
 }
 
+
+SIZE_T BufferCache::SumStat(SIZE_T CacheShard::*stat) const
+{
+  SIZE_T sum=0;
+  for (SIZE_T i=0;i<numshards;i++) { 
+    MutexGuard guard(&shards[i].lock);
+    sum+=shards[i].*stat;
+  }
+  return sum;
+}
+
+
 ERROR_T BufferCache::Attach()
 {
-  blockmap.clear();
-  return ERROR_NOERROR;
+  for (SIZE_T i=0;i<numshards;i++) { 
+    MutexGuard guard(&shards[i].lock);
+    shards[i].blockmap.clear();
+    shards[i].inflight.clear();
+    shards[i].lsns.clear();
+    shards[i].reclsns.clear();
+    ResetPolicies(shards[i]);
+  }
+  lastcheckpoint=0;
+  if (!log) { 
+    return ERROR_NOERROR;
+  }
+  // the disk is behind the log if we did not detach last time
+  ERROR_T rc=log->Recover(disk);
+  checkpointbytes=log->GetNumBytes();
+  return rc;
 }
 
-ERROR_T BufferCache::Detach()
+// start the shard's policies over, for an empty shard
+void BufferCache::ResetPolicies(CacheShard &shard)
 {
-  // write out all of our data and then throw it away
+  delete shard.policy;
+  shard.policy=ReplacementPolicy::Create(policy,shard.cachesize);
+  shard.pinned.clear();
+  delete shard.shadow;
+  shard.shadow=pinnedlevels ? ReplacementPolicy::Create(policy,shard.cachesize) : 0;
+  shard.shadowblocks.clear();
+}
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
+// write out all of a shard's data and then throw it away
+ERROR_T BufferCache::FlushShard(CacheShard &shard)
+{
+  MutexGuard guard(&shard.lock);
+
+  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=shard.blockmap.begin();
+	 i!=shard.blockmap.end();
 	 ++i) {
     if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+      ERROR_T rc=WriteBack(shard,(*i).first,(*i).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
   }
-  blockmap.clear();
+  shard.blockmap.clear();
+  shard.inflight.clear();
+  ResetPolicies(shard);
+  return SpillTier(shard,true);
+}
+
+ERROR_T BufferCache::Detach()
+{
+  for (SIZE_T i=0;i<numshards;i++) { 
+    ERROR_T rc=FlushShard(shards[i]);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+  if (log) { 
+    // everything the log holds is on the disk now
+    lastcheckpoint=0;
+    ERROR_T rc=disk->Sync(log->IsSynced());
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    return log->Truncate();
+  }
   return ERROR_NOERROR;
 }
 
 
 SIZE_T BufferCache::GetCacheSize() const
 {
-  return cachesize;
+  return __atomic_load_n(&cachesize,__ATOMIC_SEQ_CST);
+}
+
+
+// Shards take their new shares at once.  A shard that grows just has
+// room for more blocks, and one that shrinks keeps what it has until
+// Admit or Trim lets go of the excess.  No shard goes below one block,
+// so the cache keeps at least numshards blocks.
+ERROR_T BufferCache::Resize(const SIZE_T requested)
+{
+  SIZE_T newsize = (requested<numshards) ? numshards : requested;
+
+  __atomic_store_n(&cachesize,newsize,__ATOMIC_SEQ_CST);
+  for (SIZE_T i=0;i<numshards;i++) { 
+    CacheShard &shard=shards[i];
+    MutexGuard guard(&shard.lock);
+    shard.cachesize=newsize/numshards + (i<newsize%numshards ? 1 : 0);
+    shard.maxpinned=shard.cachesize*BUFFERCACHE_MAX_PINNED_PERCENT/100;
+    while (shard.pinned.size()>shard.maxpinned) { 
+      Unpin(shard,*shard.pinned.begin());
+    }
+    shard.policy->SetCapacity(shard.cachesize);
+    if (shard.shadow) { 
+      SIZE_T victim;
+      shard.shadow->SetCapacity(shard.cachesize);
+      while (shard.shadowblocks.size()>shard.cachesize && shard.shadow->Evict(victim)) { 
+	shard.shadowblocks.erase(victim);
+      }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::Trim(const SIZE_T maxblocks, SIZE_T &excess)
+{
+  SIZE_T victim;
+  SIZE_T dropped=0;
+  ERROR_T rc;
+
+  excess=0;
+  for (SIZE_T i=0;i<numshards;i++) { 
+    CacheShard &shard=shards[i];
+    MutexGuard guard(&shard.lock);
+    while (dropped<maxblocks && shard.blockmap.size()>shard.cachesize && shard.policy->Evict(victim)) { 
+      if ((rc=DropBlock(shard,victim))!=ERROR_NOERROR) { 
+	return rc;
+      }
+      dropped++;
+    }
+    if (shard.blockmap.size()>shard.cachesize) { 
+      excess+=shard.blockmap.size()-shard.cachesize;
+    }
+  }
+  return ERROR_NOERROR;
 }
 
 
@@ -104,20 +370,34 @@ SIZE_T BufferCache::GetNumBlocks() const
   return disk->GetNumBlocks();
 }
 
+// The disk serves one request at a time, so its busy time adds up
 double BufferCache::GetCurrentTime() const
 {
-  return curtime;
+  double t=0;
+  for (SIZE_T i=0;i<numshards;i++) { 
+    MutexGuard guard(&shards[i].lock);
+    t+=shards[i].curtime;
+  }
+  return t;
 }
 
 ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 {
-  allocs++;
+  CacheShard &shard=GetShard(outblocknum);
+  MutexGuard guard(&shard.lock);
+
+  shard.allocs++;
   return disk->NotifyAllocateBlocks(outblocknum,1);
 }
 
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
-  deallocs++;
+  CacheShard &shard=GetShard(inblocknum);
+  MutexGuard guard(&shard.lock);
+
+  shard.deallocs++;
+  // it is garbage now, so let it age out
+  Unpin(shard,inblocknum);
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
 
@@ -130,71 +410,148 @@ bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 
 ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
 {
+  CacheShard &shard=GetShard(inblocknum);
+  MutexGuard guard(&shard.lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
 
-  b = blockmap.find(inblocknum);
+  TraceAccess(inblocknum,true);
 
-  if (b!=blockmap.end()) {
+  b = shard.blockmap.find(inblocknum);
+
+  if (b!=shard.blockmap.end()) {
     // It's in  cache, just update its lastaccessed and return it
     outblock=(*b).second;
-    (*b).second.lastaccessed=curtime;
-    reads++;
+    (*b).second.lastaccessed=shard.curtime;
+    if (shard.pinned.empty() || !shard.pinned.count(inblocknum)) { 
+      shard.policy->Hit(inblocknum);
+    }
+    ShadowAccess(shard,inblocknum,true);
+    shard.reads++;
     return ERROR_NOERROR;
   } else {
-    // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
-    // read it from disk
-    if (!(disk->IsBlockAllocated(inblocknum))) { 
-      if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
-	cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
-      }
-    }
-    double reqtime;
-    int rc = disk->Read(inblocknum,
-			outblock,
-			reqtime);
-    curtime+=reqtime;
-    diskreads++;
-    if (rc!=ERROR_NOERROR) { 
-      return rc;
-    } else {
-      outblock.lastaccessed=curtime;
-      outblock.dirty=false;
-      blockmap[inblocknum]=outblock;
-      reads++;
+    return Fetch(shard,inblocknum,outblock);
+  }
+} 
+
+// Bring a block that is not cached into the cache, from the
+// compressed tier or the disk
+ERROR_T BufferCache::Fetch(CacheShard &shard, const SIZE_T inblocknum, Block &outblock)
+{
+  // It's not in cache, so time to allocate it
+  Admit(shard,inblocknum);
+  // it may be in the compressed tier
+  if (shard.tier) { 
+    Block myblock(disk->GetBlockSize());
+    bool dirty;
+    if (shard.tier->Take(inblocknum,myblock,dirty)) { 
+      myblock.lastaccessed=shard.curtime;
+      myblock.dirty=dirty;
+      shard.blockmap[inblocknum]=myblock;
+      outblock=myblock;
+      ShadowAccess(shard,inblocknum,true);
+      shard.tierhits++;
+      shard.reads++;
       return ERROR_NOERROR;
     }
   }
-} 
+  // read it from disk
+  if (!(disk->IsBlockAllocated(inblocknum))) { 
+    if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
+      cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
+    }
+  }
+  double reqtime;
+  int rc = disk->Read(inblocknum,
+		      outblock,
+		      reqtime);
+  shard.curtime+=reqtime;
+  shard.diskreads++;
+  if (rc!=ERROR_NOERROR) { 
+    shard.policy->Remove(inblocknum);
+    return rc;
+  } else {
+    outblock.lastaccessed=shard.curtime;
+    outblock.dirty=false;
+    shard.blockmap[inblocknum]=outblock;
+    ShadowAccess(shard,inblocknum,true);
+    shard.reads++;
+    return ERROR_NOERROR;
+  }
+}
  
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
+  CacheShard &shard=GetShard(inblocknum);
+  MutexGuard guard(&shard.lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  bool logged = log && log->InOperation();
+  ERROR_T rc;
   
-  b = blockmap.find(inblocknum);
+  TraceAccess(inblocknum,false);
+
+  b = shard.blockmap.find(inblocknum);
 
-  if (b!=blockmap.end()) {
+  if (logged) { 
+    // the change is logged against the block as it was, so that
+    // must be here
+    if (b==shard.blockmap.end()) { 
+      Block before;
+      if ((rc=Fetch(shard,inblocknum,before))!=ERROR_NOERROR) { 
+	return rc;
+      }
+      b = shard.blockmap.find(inblocknum);
+    }
+    bool first;
+    LSN_T lsn=log->LogWrite(inblocknum,(*b).second,inblock,first);
+    if (lsn) { 
+      shard.lsns[inblocknum]=lsn;
+      if (!shard.reclsns.count(inblocknum)) { 
+	shard.reclsns[inblocknum]=lsn;
+      }
+    }
+    if (first) { 
+      shard.inflight[inblocknum]++;
+    }
+  }
+
+  if (b!=shard.blockmap.end()) {
     // It's in  cache, so just replace the block
     (*b).second=inblock;
-    (*b).second.lastaccessed=curtime;
+    (*b).second.lastaccessed=shard.curtime;
     (*b).second.dirty=true;
-    writes++;
-    return ERROR_NOERROR;
+    if (shard.pinned.empty() || !shard.pinned.count(inblocknum)) { 
+      shard.policy->Hit(inblocknum);
+    }
+    ShadowAccess(shard,inblocknum,false);
+    shard.writes++;
   } else {
     // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
+    Admit(shard,inblocknum);
+    // and any older copy in the tier is stale
+    if (shard.tier) { 
+      shard.tier->Remove(inblocknum);
+    }
     if (!(disk->IsBlockAllocated(inblocknum))) { 
       if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
 	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
       }
     }
     Block myblock=inblock;
-    myblock.lastaccessed=curtime;
+    myblock.lastaccessed=shard.curtime;
     myblock.dirty=true;
-    blockmap[inblocknum]=myblock;
-    writes++;
-    return ERROR_NOERROR;
+    b=shard.blockmap.insert(make_pair(inblocknum,myblock)).first;
+    ShadowAccess(shard,inblocknum,false);
+    shard.writes++;
   }
+
+  if (log && !logged) { 
+    // nothing in the log would bring it back
+    if ((rc=WriteBack(shard,inblocknum,(*b).second))!=ERROR_NOERROR) { 
+      return rc;
+    }
+    (*b).second.dirty=false;
+  }
+  return ERROR_NOERROR;
 }
   
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
@@ -205,51 +562,447 @@ ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
   
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
+  CacheShard &shard=GetShard(blocknum);
+  MutexGuard guard(&shard.lock);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
-  b = blockmap.find(blocknum);
+  b = shard.blockmap.find(blocknum);
 
-  if (b==blockmap.end()) { 
+  if (b==shard.blockmap.end()) { 
+    // an evicted block may still be waiting in the tier
+    Block block(disk->GetBlockSize());
+    bool dirty;
+    if (shard.tier && shard.tier->Take(blocknum,block,dirty) && dirty) { 
+      return WriteBack(shard,blocknum,block);
+    }
     return ERROR_NOERROR;
   } else {
+    if (!shard.inflight.empty() && shard.inflight.count(blocknum)) { 
+      // an operation that has not committed changed it
+      return ERROR_CONFLICT;
+    }
     if ((*b).second.dirty) { 
-      double reqtime;
-      int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
-		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
+      int rc=WriteBack(shard,(*b).first,(*b).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
     }
-    blockmap.erase(b);
+    shard.blockmap.erase(b);
+    if (!shard.pinned.erase(blocknum)) { 
+      shard.policy->Remove(blocknum);
+    }
+    if (shard.shadow && shard.shadowblocks.erase(blocknum)) { 
+      shard.shadow->Remove(blocknum);
+    }
     return ERROR_NOERROR;
   }
 }
+
+ERROR_T BufferCache::CleanBlock(const SIZE_T blocknum)
+{
+  CacheShard &shard=GetShard(blocknum);
+  MutexGuard guard(&shard.lock);
+
+  return CleanBlock(shard,blocknum);
+}
+
+ERROR_T BufferCache::SyncDisk(const bool durable)
+{
+  return disk->Sync(durable);
+}
+
+ERROR_T BufferCache::LatchBlock(const SIZE_T blocknum, const bool exclusive)
+{
+  if (blocknum>=numlatches) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  if (exclusive ? pthread_rwlock_wrlock(&latches[blocknum]) : pthread_rwlock_rdlock(&latches[blocknum])) { 
+    // e.g. we already hold it exclusively
+    return ERROR_GENERAL;
+  }
+  if (exclusive) { 
+    __atomic_add_fetch(&versions[blocknum],1,__ATOMIC_SEQ_CST);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::UnlatchBlock(const SIZE_T blocknum)
+{
+  if (blocknum>=numlatches) { 
+    return ERROR_NOSUCHBLOCK;
+  }
+  // Only the exclusive holder can see an odd version here, and it
+  // makes it even again before anyone else can latch the block
+  if (__atomic_load_n(&versions[blocknum],__ATOMIC_SEQ_CST) & 1) { 
+    __atomic_add_fetch(&versions[blocknum],1,__ATOMIC_SEQ_CST);
+  }
+  if (pthread_rwlock_unlock(&latches[blocknum])) { 
+    return ERROR_GENERAL;
+  }
+  return ERROR_NOERROR;
+}
+
+SIZE_T BufferCache::GetBlockVersion(const SIZE_T blocknum) const
+{
+  if (blocknum>=numlatches) { 
+    return 1;
+  }
+  return __atomic_load_n(&versions[blocknum],__ATOMIC_SEQ_CST);
+}
+  
+void BufferCache::SetPinnedLevels(const SIZE_T levels)
+{
+  pinnedlevels=levels;
+  for (SIZE_T i=0;i<numshards;i++) { 
+    CacheShard &shard=shards[i];
+    MutexGuard guard(&shard.lock);
+    while (!shard.pinned.empty()) { 
+      Unpin(shard,*shard.pinned.begin());
+    }
+    // the shadow starts out holding what the cache holds
+    delete shard.shadow;
+    shard.shadow=0;
+    shard.shadowblocks.clear();
+    if (levels) { 
+      shard.shadow=ReplacementPolicy::Create(policy,shard.cachesize);
+      for (map<SIZE_T, Block, cache_compare_lessthan>::iterator b=shard.blockmap.begin();
+	   b!=shard.blockmap.end();
+	   ++b) { 
+	ShadowAccess(shard,(*b).first,false);
+      }
+    }
+  }
+}
+
+void BufferCache::SetBlockLevel(const SIZE_T blocknum, const SIZE_T level)
+{
+  CacheShard &shard=GetShard(blocknum);
+  MutexGuard guard(&shard.lock);
+
+  if (shard.blockmap.find(blocknum)==shard.blockmap.end()) { 
+    return;
+  }
+  if (level>=pinnedlevels) { 
+    // e.g. a root that has since grown a new root above it
+    Unpin(shard,blocknum);
+  } else if (!shard.pinned.count(blocknum) && shard.pinned.size()<shard.maxpinned) { 
+    shard.policy->Remove(blocknum);
+    shard.pinned.insert(blocknum);
+  }
+}
+
+// hand a pinned block back to the policy, as if just brought in
+void BufferCache::Unpin(CacheShard &shard, const SIZE_T blocknum)
+{
+  SIZE_T victim;
+
+  if (shard.pinned.erase(blocknum)) { 
+    shard.policy->Admit(blocknum,false,victim);
+  }
+}
+
+void BufferCache::ShadowAccess(CacheShard &shard, const SIZE_T blocknum, const bool read)
+{
+  SIZE_T victim;
+
+  if (!shard.shadow) { 
+    return;
+  }
+  if (shard.shadowblocks.count(blocknum)) { 
+    shard.shadow->Hit(blocknum);
+    return;
+  }
+  if (read) { 
+    shard.shadowdiskreads++;
+  }
+  if (shard.shadow->Admit(blocknum,shard.shadowblocks.size()>=shard.cachesize,victim)) { 
+    shard.shadowblocks.erase(victim);
+  }
+  shard.shadowblocks.insert(blocknum);
+}
+
+SIZE_T BufferCache::GetNumUnpinnedDiskReads() const
+{
+  return pinnedlevels ? SumStat(&CacheShard::shadowdiskreads) : GetNumDiskReads();
+}
+
+void BufferCache::SetMissRatioSampling(const double rate)
+{
+  MutexGuard guard(&mrclock);
+
+  delete mrc;
+  mrc = rate>0 ? new MissRatioCurve(rate) : 0;
+}
+
+void BufferCache::TraceAccess(const SIZE_T blocknum, const bool read)
+{
+  if (mrc) { 
+    MutexGuard guard(&mrclock);
+    mrc->Access(blocknum,read);
+  }
+}
+
+ostream & BufferCache::PrintMissRatioCurve(ostream &os) const
+{
+  MutexGuard guard(&mrclock);
+
+  if (mrc) { 
+    mrc->Print(os,GetCacheSize());
+  }
+  return os;
+}
+
+ERROR_T BufferCache::SetCompressedTier(const SIZE_T bytes)
+{
+  for (SIZE_T i=0;i<numshards;i++) { 
+    CacheShard &shard=shards[i];
+    MutexGuard guard(&shard.lock);
+    ERROR_T rc=SpillTier(shard,true);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    delete shard.tier;
+    shard.tier = bytes ? new CompressedTier(bytes/numshards + (i<bytes%numshards ? 1 : 0)) : 0;
+  }
+  return ERROR_NOERROR;
+}
+
+double BufferCache::GetTierCompressionRatio() const
+{
+  double raw=0, packed=0;
+
+  for (SIZE_T i=0;i<numshards;i++) { 
+    MutexGuard guard(&shards[i].lock);
+    if (shards[i].tier) { 
+      raw+=shards[i].tier->GetRawBytes();
+      packed+=shards[i].tier->GetPackedBytes();
+    }
+  }
+  return packed>0 ? raw/packed : 0;
+}
+
+ERROR_T BufferCache::SetWriteAheadLog(const string &filestem, const bool sync)
+{
+  delete log;
+  log=0;
+  if (filestem.empty()) { 
+    return ERROR_NOERROR;
+  }
+  log=new WriteAheadLog(filestem,sync);
+  ERROR_T rc=log->Open();
+  if (rc!=ERROR_NOERROR) { 
+    delete log;
+    log=0;
+  }
+  return rc;
+}
+
+void BufferCache::BeginOperation()
+{
+  if (log) { 
+    log->BeginOperation();
+  }
+}
+
+// The blocks may go once the commit is durable, and not before
+LSN_T BufferCache::CommitOperation()
+{
+  vector<SIZE_T> blocks;
+  LSN_T lsn;
+
+  if (!log) { 
+    return 0;
+  }
+  lsn=log->CommitOperation(blocks);
+  for (SIZE_T i=0;i<blocks.size();i++) { 
+    CacheShard &shard=GetShard(blocks[i]);
+    MutexGuard guard(&shard.lock);
+    map<SIZE_T, SIZE_T>::iterator f=shard.inflight.find(blocks[i]);
+    if (f!=shard.inflight.end() && --(*f).second==0) { 
+      shard.inflight.erase(f);
+    }
+    if (shard.lsns[blocks[i]]<lsn) { 
+      shard.lsns[blocks[i]]=lsn;
+    }
+  }
+  return lsn;
+}
+
+// The blocks are still here, as nothing uncommitted is written back.
+// Only the bytes the operation changed are put back, as others may
+// hold the changes of other operations, and a block's version moves on
+// so that optimistic readers of what is undone start over.
+void BufferCache::AbortOperation()
+{
+  vector<SIZE_T> blocks;
+  vector<WalUndo> undo;
+
+  if (!log) { 
+    return;
+  }
+  log->AbortOperation(blocks,undo);
+  for (SIZE_T i=undo.size();i>0;i--) { 
+    const WalUndo &u=undo[i-1];
+    CacheShard &shard=GetShard(u.blocknum);
+    MutexGuard guard(&shard.lock);
+    map<SIZE_T, Block, cache_compare_lessthan>::iterator b=shard.blockmap.find(u.blocknum);
+    if (b!=shard.blockmap.end()) { 
+      memcpy((*b).second.data+u.offset,u.bytes.data(),u.bytes.size());
+    }
+  }
+  for (SIZE_T i=0;i<blocks.size();i++) { 
+    CacheShard &shard=GetShard(blocks[i]);
+    MutexGuard guard(&shard.lock);
+    map<SIZE_T, SIZE_T>::iterator f=shard.inflight.find(blocks[i]);
+    if (f!=shard.inflight.end() && --(*f).second==0) { 
+      shard.inflight.erase(f);
+    }
+    if (blocks[i]<numlatches) { 
+      __atomic_add_fetch(&versions[blocks[i]],2,__ATOMIC_SEQ_CST);
+    }
+  }
+}
+
+ERROR_T BufferCache::ForceLog(const LSN_T lsn)
+{
+  ERROR_T rc;
+
+  if (!log) { 
+    return ERROR_NOERROR;
+  }
+  if ((rc=log->Force(lsn))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  // if one is due and no one else is taking it
+  if (checkpointinterval>0 && pthread_mutex_trylock(&checkpointlock)==0) { 
+    if (log->GetNumBytes()-checkpointbytes>=checkpointinterval) { 
+      rc=TakeCheckpoint();
+    }
+    pthread_mutex_unlock(&checkpointlock);
+  }
+  return rc;
+}
+
+ERROR_T BufferCache::Checkpoint()
+{
+  MutexGuard guard(&checkpointlock);
+
+  return TakeCheckpoint();
+}
+
+// Fuzzy: each shard is looked at in turn and writers carry on.  A block
+// dirtied after its shard was looked at is dirtied by a record after
+// begin, which recovery replays whatever the checkpoint says.
+ERROR_T BufferCache::TakeCheckpoint()
+{
+  vector<pair<LSN_T, SIZE_T> > old;
+  map<SIZE_T, LSN_T> dirty;
+  LSN_T begin, redo, lsn;
+  SIZE_T i;
+  ERROR_T rc;
+
+  if (!log) { 
+    return ERROR_NOERROR;
+  }
+  begin=log->GetNextLSN();
+  checkpointbytes=log->GetNumBytes();
+
+  // write back, oldest first, what has been dirty since before the
+  // last checkpoint
+  for (i=0;i<numshards;i++) { 
+    MutexGuard guard(&shards[i].lock);
+    for (map<SIZE_T, LSN_T>::iterator d=shards[i].reclsns.begin(); d!=shards[i].reclsns.end(); ++d) { 
+      if ((*d).second<lastcheckpoint) { 
+	old.push_back(make_pair((*d).second,(*d).first));
+      }
+    }
+  }
+  sort(old.begin(),old.end());
+  for (i=0;i<old.size();i++) { 
+    CacheShard &shard=GetShard(old[i].second);
+    MutexGuard guard(&shard.lock);
+    if ((rc=CleanBlock(shard,old[i].second))!=ERROR_NOERROR) { 
+      return rc;
+    }
+  }
+
+  // then note what is still dirty
+  redo=begin;
+  for (i=0;i<numshards;i++) { 
+    MutexGuard guard(&shards[i].lock);
+    for (map<SIZE_T, LSN_T>::iterator d=shards[i].reclsns.begin(); d!=shards[i].reclsns.end(); ++d) { 
+      dirty.insert(*d);
+      redo=((*d).second<redo) ? (*d).second : redo;
+    }
+  }
+  lsn=log->LogCheckpoint(begin,dirty);
+  if ((rc=log->Force(lsn))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  // what was written back must be on the disk before the log forgets it
+  if ((rc=disk->Sync(log->IsSynced()))!=ERROR_NOERROR) { 
+    return rc;
+  }
+  lastcheckpoint=begin;
+  return log->DropBefore(redo);
+}
+
+void BufferCache::Crash()
+{
+  for (SIZE_T i=0;i<numshards;i++) { 
+    CacheShard &shard=shards[i];
+    MutexGuard guard(&shard.lock);
+    shard.blockmap.clear();
+    shard.inflight.clear();
+    shard.lsns.clear();
+    shard.reclsns.clear();
+    ResetPolicies(shard);
+    if (shard.tier) { 
+      SIZE_T capacity=shard.tier->GetCapacity();
+      delete shard.tier;
+      shard.tier=new CompressedTier(capacity);
+    }
+  }
+  if (log) { 
+    log->DropBuffer();
+  }
+}
+
+double BufferCache::GetHitRatio() const
+{
+  SIZE_T reads=GetNumReads();
+  return reads ? 1-(double)GetNumDiskReads()/reads : 0;
+}
   
 ostream & BufferCache::Print(ostream &os) const
 {
-  os << "BufferCache(cachesize="<<cachesize
+  os << "BufferCache(cachesize="<<GetCacheSize()
+     << ", numshards="<<numshards
+     << ", policy="<<ReplacementPolicy::GetName(policy)
+     << ", pinnedlevels="<<pinnedlevels
      << ", blocksize="<<GetBlockSize()
-     << ", curtime="<<curtime
-     << ", allocs="<<allocs
-     << ", deallocs="<<deallocs
-     << ", reads="<<reads
-     << ", writes="<<writes
-     << ", diskreads="<<diskreads
-     << ", diskwrites="<<diskwrites
+     << ", curtime="<<GetCurrentTime()
+     << ", allocs="<<GetNumAllocs()
+     << ", deallocs="<<GetNumDeallocs()
+     << ", reads="<<GetNumReads()
+     << ", writes="<<GetNumWrites()
+     << ", diskreads="<<GetNumDiskReads()
+     << ", diskwrites="<<GetNumDiskWrites()
      << ", blocks = {";
 
   
-  for (map<SIZE_T, Block, cache_compare_lessthan>::const_iterator b=blockmap.begin(); 
-       b!=blockmap.end(); 
-       ++b) {
-    if (b!=blockmap.begin()) { 
-      os << ", ";
+  bool first=true;
+  for (SIZE_T i=0;i<numshards;i++) { 
+    MutexGuard guard(&shards[i].lock);
+    for (map<SIZE_T, Block, cache_compare_lessthan>::const_iterator b=shards[i].blockmap.begin(); 
+	 b!=shards[i].blockmap.end(); 
+	 ++b) {
+      if (!first) { 
+	os << ", ";
+      }
+      first=false;
+      os << (*b).first << ((*b).second.dirty ? "(dirty)" : "");
     }
-    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "");
   }
   os << "}, disk="<<*disk<<")";
   
@@ -3,10 +3,16 @@
 
 #include <iostream>
 #include <map>
+#include <set>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "latch.h"
+#include "replacement.h"
+#include "mrc.h"
+#include "compressedtier.h"
+#include "wal.h"
 
 using namespace std;
 
@@ -17,24 +23,122 @@ struct cache_compare_lessthan {
 };
 
 
+// One partition of a buffer cache.  A block always goes to the same
+// shard, which has its own map, replacement policy, clock and
+// statistics behind its own mutex.
+struct CacheShard {
+  map<SIZE_T, Block, cache_compare_lessthan> blockmap;
+  ReplacementPolicy *policy;
+  set<SIZE_T> pinned;           // cached, but kept out of the policy
+  SIZE_T maxpinned;
+  ReplacementPolicy *shadow;    // what the policy would do without pins
+  set<SIZE_T> shadowblocks;
+  CompressedTier *tier;         // 0 unless asked for
+  SIZE_T cachesize;
+  double curtime;
+  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  SIZE_T shadowdiskreads;
+  SIZE_T tierhits;
+  map<SIZE_T, SIZE_T> inflight; // blocks changed by operations not yet
+                                // committed, and by how many
+  map<SIZE_T, LSN_T> lsns;      // dirty blocks' last log record
+  map<SIZE_T, LSN_T> reclsns;   // and the first since written back
+  pthread_mutex_t lock;         // all of the above
+};
+
+// Share of a shard that pinned blocks may take
+#define BUFFERCACHE_MAX_PINNED_PERCENT 50
+// Extra blocks a shrunk shard lets go of each time it brings one in
+#define BUFFERCACHE_SHRINK_STEP 4
+
+
 //
-// LRU block cache with single step prefetch
+// Block cache with single step prefetch and pluggable replacement
 //
 // Write Back
 // Write Allocate
+//
+// Safe to share between threads.  Each block also has a reader/writer
+// latch that callers hold while they read, modify and write it back.
+// Blocks are copied in and out of the cache, so a latch belongs to the
+// block number and outlives the block's stay in the cache.  So does the
+// block's version, which lets readers go without latches: it is odd
+// while the block is latched exclusive and moves on each time that
+// latch is taken or released.
+//
+// The cache is split into shards by a hash of the block number, each
+// holding its share of cachesize blocks and choosing its own victims,
+// so threads touching different blocks seldom meet.  Statistics and the
+// simulated time are summed over the shards when asked for.  With one
+// shard and the default policy this is a plain LRU cache.
+//
+// A client may say how deep in its structure a block sits.  Blocks
+// above a chosen depth are pinned: kept out of the replacement policy,
+// and so in the cache, up to a share of each shard.  A shadow copy of
+// the policy then sees every access with nothing pinned, to count the
+// disk reads pinning saved.
+//
+// The cache can also follow a sample of the blocks read and written to
+// estimate the hit ratio it would have had at other sizes.
+//
+// Below the cache there may be a compressed tier: evicted blocks are
+// compressed into memory and found there on a later miss instead of on
+// the disk.  Finding one there costs no simulated time.
+//
+// With a write-ahead log, the writes a thread makes inside an operation
+// are logged, and the blocks it changed stay in the cache, over its
+// size if need be, until the operation commits.  A dirty block is only
+// written back once the log is durable up to its last change.  Writes
+// made outside any operation are not logged, and are written through
+// to the disk at once instead.  Attach replays the log onto the disk,
+// and Detach empties it once every block is back on the disk.
+//
+// So that the log does not grow without bound, a checkpoint notes
+// which blocks are dirty and since when, without holding up writers,
+// and drops the log before the oldest of them.  Each checkpoint first
+// writes back, oldest first, the blocks that have been dirty since
+// before the last one, so the log holds about two intervals' worth.
 class BufferCache {
  private:
   DiskSystem *disk;
   SIZE_T cachesize;
-  map<SIZE_T, Block, cache_compare_lessthan> blockmap;
-  double curtime;
-  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  CacheShard *shards;
+  SIZE_T numshards;
+  SIZE_T policy;                // CACHE_POLICY_*
+  SIZE_T pinnedlevels;
+  MissRatioCurve *mrc;          // 0 unless asked for
+  mutable pthread_mutex_t mrclock;
+  WriteAheadLog *log;           // 0 unless asked for
+  pthread_mutex_t checkpointlock; // the three below
+  double checkpointinterval;    // log bytes, 0 for none
+  double checkpointbytes;       // logged when the last one was begun
+  LSN_T lastcheckpoint;         // its beginning
+  pthread_rwlock_t *latches;    // one per block of the disk
+  SIZE_T *versions;             // and its version
+  SIZE_T numlatches;
  protected:
-  ERROR_T CheckDeleteOldest();
+  CacheShard &GetShard(const SIZE_T blocknum) const;
+  ERROR_T Admit(CacheShard &shard, const SIZE_T blocknum);
+  ERROR_T Fetch(CacheShard &shard, const SIZE_T blocknum, Block &outblock);
+  ERROR_T LogAhead(CacheShard &shard, const SIZE_T blocknum);
+  ERROR_T WriteBack(CacheShard &shard, const SIZE_T blocknum, const Block &block);
+  ERROR_T DropBlock(CacheShard &shard, const SIZE_T victim);
+  ERROR_T CleanBlock(CacheShard &shard, const SIZE_T blocknum);
+  ERROR_T TakeCheckpoint();
+  ERROR_T SpillTier(CacheShard &shard, const bool all);
+  ERROR_T FlushShard(CacheShard &shard);
+  void    ResetPolicies(CacheShard &shard);
+  void    Unpin(CacheShard &shard, const SIZE_T blocknum);
+  void    ShadowAccess(CacheShard &shard, const SIZE_T blocknum, const bool read);
+  void    TraceAccess(const SIZE_T blocknum, const bool read);
+  SIZE_T  SumStat(SIZE_T CacheShard::*stat) const;
  public:
-  // Cache size is in number of blocks
+  // Cache size is in number of blocks, at least one.  There are at
+  // most as many shards as blocks.  An unknown policy means LRU.
   BufferCache(DiskSystem *disk,
-	      const SIZE_T cachesize);
+	      const SIZE_T cachesize,
+	      const SIZE_T numshards=1,
+	      const SIZE_T policy=CACHE_POLICY_LRU);
   BufferCache() { throw 0; }
   BufferCache(const BufferCache &rhs) { throw 0; } 
   BufferCache & operator=(const BufferCache &rhs) { throw 0; return *this; } 
@@ -47,6 +151,18 @@ class BufferCache {
 
   // Number of blocks in the cache
   SIZE_T GetCacheSize() const;
+  // Change the number of blocks in the cache, while it is in use.
+  // Growing takes effect at once.  Shrinking does not write back or
+  // drop anything by itself: each shard over its new size lets go of
+  // a few extra blocks each time it brings one in, and Trim lets go of
+  // more, e.g. from a background thread.  The cache is never made
+  // smaller than one block per shard.
+  ERROR_T Resize(const SIZE_T newsize);
+  // Let go of up to maxblocks blocks of shards over their size,
+  // writing back the dirty ones.  excess is how many are still over.
+  ERROR_T Trim(const SIZE_T maxblocks, SIZE_T &excess);
+  SIZE_T GetNumShards() const { return numshards; }
+  SIZE_T GetPolicy() const { return policy; }
   // Number of bytes per block
   SIZE_T GetBlockSize() const;
   // Number of blocks in the underlying device
@@ -80,14 +196,82 @@ class BufferCache {
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
   ERROR_T FlushBlock(const SIZE_T blocknum);
+  // Write a block back now if it is dirty, but keep it cached.  Blocks
+  // written back in block order go to the disk one after another.
+  ERROR_T CleanBlock(const SIZE_T blocknum);
+  // Make everything written back so far durable, or, without durable,
+  // just hand it to the operating system
+  ERROR_T SyncDisk(const bool durable=true);
+
+  // Take a shared or exclusive latch on a block, waiting for it if
+  // needed, and release it again.  Latches are advisory: ReadBlock and
+  // WriteBlock do not check them.
+  ERROR_T LatchBlock(const SIZE_T blocknum, const bool exclusive);
+  ERROR_T UnlatchBlock(const SIZE_T blocknum);
+
+  // Version of a block.  An optimistic reader reads it before and after
+  // reading the block, and starts over if it was odd or has changed.
+  SIZE_T  GetBlockVersion(const SIZE_T blocknum) const;
+
+  // Pin blocks at depths 0..levels-1, 0 meaning none (the default).
+  // Call before the cache is shared between threads.
+  void    SetPinnedLevels(const SIZE_T levels);
+  SIZE_T  GetPinnedLevels() const { return pinnedlevels; }
+  // The block at blocknum, if cached, sits at this depth
+  void    SetBlockLevel(const SIZE_T blocknum, const SIZE_T level);
   
  
-  SIZE_T GetNumAllocs() const { return allocs; }
-  SIZE_T GetNumDeallocs() const { return deallocs; }
-  SIZE_T GetNumReads() const { return reads;}
-  SIZE_T GetNumWrites() const { return writes;}
-  SIZE_T GetNumDiskReads() const { return diskreads;}
-  SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  SIZE_T GetNumAllocs() const { return SumStat(&CacheShard::allocs); }
+  SIZE_T GetNumDeallocs() const { return SumStat(&CacheShard::deallocs); }
+  SIZE_T GetNumReads() const { return SumStat(&CacheShard::reads);}
+  SIZE_T GetNumWrites() const { return SumStat(&CacheShard::writes);}
+  SIZE_T GetNumDiskReads() const { return SumStat(&CacheShard::diskreads);}
+  SIZE_T GetNumDiskWrites() const { return SumStat(&CacheShard::diskwrites);}
+  // Fraction of reads that did not go to the disk
+  double GetHitRatio() const;
+  // Disk reads the same accesses would have cost with nothing pinned
+  SIZE_T GetNumUnpinnedDiskReads() const;
+
+  // Follow a fraction rate (0,1] of the blocks to estimate the miss
+  // ratio curve, or stop following them with rate 0.  Starts over.
+  // Call before the cache is shared between threads.
+  void    SetMissRatioSampling(const double rate);
+  // Estimated LRU hit ratios at a range of cache sizes, if followed
+  ostream & PrintMissRatioCurve(ostream &os) const;
+
+  // Keep evicted blocks compressed in up to bytes of memory, or not
+  // with bytes 0.  Call before the cache is shared between threads.
+  ERROR_T SetCompressedTier(const SIZE_T bytes);
+  bool    HasCompressedTier() const { return shards[0].tier!=0; }
+  // Cache misses served by the tier instead of the disk
+  SIZE_T  GetNumTierHits() const { return SumStat(&CacheShard::tierhits); }
+  // Bytes of the blocks put in the tier over bytes they took there
+  double  GetTierCompressionRatio() const;
+
+  // Log changes in filestem.wal, syncing it on each force if sync, or
+  // stop logging with an empty filestem.  Call before Attach, which
+  // recovers whatever the log already holds.
+  ERROR_T SetWriteAheadLog(const string &filestem, const bool sync=true);
+  WriteAheadLog *GetWriteAheadLog() const { return log; }
+  // Make the calling thread's writes until the matching commit one
+  // atomic operation; they may nest (see WriteAheadLog).  Commit hands
+  // back the record ForceLog must reach for it to be durable.  Without
+  // a log these do nothing.  Abort ends an operation that failed part
+  // way through: it is not logged as committed, and the cached blocks
+  // get back the bytes it changed.
+  void    BeginOperation();
+  LSN_T   CommitOperation();
+  void    AbortOperation();
+  ERROR_T ForceLog(const LSN_T lsn);
+  // Take a checkpoint of their own accord once the log has grown by
+  // bytes since the last, or never with bytes 0 (the default).  The
+  // thread whose force finds it due takes it.
+  void    SetCheckpointInterval(const double bytes) { checkpointinterval=bytes; }
+  // Take a checkpoint now, e.g. from an idle thread
+  ERROR_T Checkpoint();
+  // Lose every cached block and whatever the log has not yet written,
+  // as a crash would, for testing.  Attach again to recover.
+  void    Crash();
 
   ostream & Print(ostream &os) const;
   
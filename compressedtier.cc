@@ -0,0 +1,100 @@
+#include <string.h>
+#include <zlib.h>
+
+#include "compressedtier.h"
+
+
+CompressedTier::CompressedTier(const SIZE_T c) :
+  capacity(c), used(0), numputs(0), rawbytes(0), packedbytes(0)
+{
+}
+
+
+void CompressedTier::Put(const SIZE_T blocknum, const Block &block, const bool dirty)
+{
+  Entry e;
+  uLongf packedlen=compressBound(block.length);
+
+  Remove(blocknum);
+
+  // the fastest level: this stands in for LZ4 or zstd
+  e.data.resize(packedlen);
+  if (compress2((Bytef *)&e.data[0],&packedlen,block.data,block.length,1)==Z_OK &&
+      packedlen<block.length) {
+    e.data.resize(packedlen);
+    e.raw=false;
+  } else {
+    e.data.assign((const char *)block.data,block.length);
+    e.raw=true;
+  }
+  e.dirty=dirty;
+
+  numputs++;
+  rawbytes+=block.length;
+  packedbytes+=e.data.size();
+  used+=e.data.size();
+  entries[blocknum]=e;
+  order.PushFront(blocknum);
+}
+
+
+ERROR_T CompressedTier::Inflate(const Entry &e, Block &block) const
+{
+  if (e.raw) {
+    if (e.data.size()!=block.length) {
+      return ERROR_WRONGSIZEBLOCK;
+    }
+    memcpy(block.data,e.data.data(),block.length);
+    return ERROR_NOERROR;
+  }
+  uLongf len=block.length;
+  if (uncompress(block.data,&len,(const Bytef *)e.data.data(),e.data.size())!=Z_OK ||
+      len!=block.length) {
+    return ERROR_WRONGSIZEBLOCK;
+  }
+  return ERROR_NOERROR;
+}
+
+
+bool CompressedTier::Take(const SIZE_T blocknum, Block &block, bool &dirty)
+{
+  map<SIZE_T, Entry>::iterator i=entries.find(blocknum);
+
+  if (i==entries.end() || Inflate((*i).second,block)!=ERROR_NOERROR) {
+    return false;
+  }
+  dirty=(*i).second.dirty;
+  used-=(*i).second.data.size();
+  entries.erase(i);
+  order.Erase(blocknum);
+  return true;
+}
+
+
+void CompressedTier::Remove(const SIZE_T blocknum)
+{
+  map<SIZE_T, Entry>::iterator i=entries.find(blocknum);
+
+  if (i!=entries.end()) {
+    used-=(*i).second.data.size();
+    entries.erase(i);
+    order.Erase(blocknum);
+  }
+}
+
+
+bool CompressedTier::EvictOldest(SIZE_T &blocknum, Block &block, bool &dirty)
+{
+  while (order.Size()>0) {
+    blocknum=order.PopBack();
+    map<SIZE_T, Entry>::iterator i=entries.find(blocknum);
+    bool ok=(Inflate((*i).second,block)==ERROR_NOERROR);
+    dirty=(*i).second.dirty;
+    used-=(*i).second.data.size();
+    entries.erase(i);
+    if (ok) {
+      return true;
+    }
+  }
+  return false;
+}
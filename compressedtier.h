@@ -0,0 +1,65 @@
+#ifndef _compressedtier
+#define _compressedtier
+
+#include <map>
+#include <string>
+
+#include "global.h"
+#include "block.h"
+#include "replacement.h"
+
+using namespace std;
+
+//
+// Blocks let go of by a buffer cache, kept compressed in memory
+//
+// A cache puts each block it evicts here, clean or dirty, and looks
+// here before going to the disk.  A block found here is inflated and
+// handed back to the cache, leaving the tier, so a block is never in
+// both.  When the compressed blocks outgrow capacity bytes, the least
+// recently put ones go, and the cache writes back those that are
+// dirty.  Blocks that do not compress are kept as they are.
+//
+// Not locked: each cache shard has its own tier.
+//
+class CompressedTier {
+ private:
+  struct Entry {
+    string data;                // compressed unless raw
+    bool   raw;
+    bool   dirty;
+  };
+
+  SIZE_T capacity;              // bytes
+  SIZE_T used;
+  map<SIZE_T, Entry> entries;
+  BlockList order;
+  SIZE_T numputs;
+  double rawbytes, packedbytes; // over every block put
+
+  ERROR_T Inflate(const Entry &e, Block &block) const;
+ public:
+  CompressedTier(const SIZE_T capacity);
+
+  // Keep block, which the cache is letting go of.  The tier may then
+  // be Overfull.
+  void    Put(const SIZE_T blocknum, const Block &block, const bool dirty);
+  // If blocknum is here, inflate it into block, which must be of the
+  // right size, and take it out of the tier
+  bool    Take(const SIZE_T blocknum, Block &block, bool &dirty);
+  // Forget blocknum, e.g. because the cache has a newer copy
+  void    Remove(const SIZE_T blocknum);
+
+  bool    Overfull() const { return used>capacity; }
+  // Take out the least recently put block, e.g. while Overfull
+  bool    EvictOldest(SIZE_T &blocknum, Block &block, bool &dirty);
+
+  SIZE_T  GetCapacity() const { return capacity; }
+  SIZE_T  GetBytesUsed() const { return used; }
+  SIZE_T  GetNumBlocks() const { return entries.size(); }
+  SIZE_T  GetNumPuts() const { return numputs; }
+  double  GetRawBytes() const { return rawbytes; }
+  double  GetPackedBytes() const { return packedbytes; }
+};
+
+#endif
@@ -99,6 +99,12 @@ DiskSystem::DiskSystem(const string &filestem,
   trackseeklatency(trackseek),
   rotationallatency(rotlat)
 {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&lock,&attr);
+  pthread_mutexattr_destroy(&attr);
+
   if (create) { 
     // Only in this case are the parameters used:
     InitFromInMemoryConfig();
@@ -115,6 +121,7 @@ DiskSystem::~DiskSystem()
   fclose(bitmapfilefd);
   fclose(datafilefd);
   delete [] bitmap;
+  pthread_mutex_destroy(&lock);
 }
 
 ERROR_T DiskSystem::SanityCheckConfig()
@@ -380,7 +387,6 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   SIZE_T req_sectorstart=  (offblock) % (numheads*blockspertrack);
 
   SIZE_T req_trackend = (offblock+numblock-1) / (numheads*blockspertrack);
-  SIZE_T req_sectorend=  (offblock+numblock-1) % (numheads*blockspertrack);
 
   SIZE_T trackhop = (SIZE_T) fabs((double)req_trackstart-(double)last_track);
   double trackhopfrac = (double)trackhop/(double)numtracks;
@@ -406,8 +412,10 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   // The total number of sectors read
   double timeinreadsectors = rotationallatency*((double)numblock/(double)blockspertrack);
 
-  last_track=req_trackend;
-  last_sector=req_sectorend;
+  // The head is left just past the last block, so an access that
+  // carries on from there waits for neither a seek nor the platter
+  last_track=(offblock+numblock) / (numheads*blockspertrack);
+  last_sector=(offblock+numblock) % (numheads*blockspertrack);
 
   return timeinseek+timeinrotation+timeintrackbytrackhops+timeinreadsectors;
 }
@@ -418,6 +426,8 @@ ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
 			 vector<Block> &blocks,
 			 double        &reqtime)
 {
+  MutexGuard guard(&lock);
+
   reqtime=0;
 
   if (inoffblock+numblock > numblocks) { 
@@ -449,6 +459,8 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
 			  const vector<Block> &blocks,
 			  double        &reqtime)
 {
+  MutexGuard guard(&lock);
+
   reqtime=0;
 
   if (inoffblock+numblock > numblocks) { 
@@ -505,6 +517,18 @@ ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &
 }
 
 
+ERROR_T DiskSystem::Sync(const bool durable)
+{
+  MutexGuard guard(&lock);
+
+  if (fflush(datafilefd) || (durable && fsync(fileno(datafilefd)))) { 
+    cerr << "DiskSystem::Sync: can't sync data file"<<endl;
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+
 SIZE_T DiskSystem::GetBlockSize() const
 {
   return blocksize;
@@ -524,12 +548,16 @@ SIZE_T DiskSystem::GetNumBlocks() const
 
 bool DiskSystem::IsBlockAllocated(const SIZE_T block)
 {
+  MutexGuard guard(&lock);
+
   return GETBIT(block);
 }
 
 
 ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innumblocks)
 {
+  MutexGuard guard(&lock);
+
   if (offset+innumblocks > numblocks) { 
     cerr << "Disksystem: NotifyAllocateBlocks: Attempt to allocate"<<offset<<" to "<<(offset+innumblocks-1)<<" but maximum block is "<<(numblocks-1)<<endl;
     return ERROR_NOSUCHBLOCK;
@@ -550,6 +578,8 @@ ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innum
 
 ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innumblocks)
 {
+  MutexGuard guard(&lock);
+
   if (offset+innumblocks > numblocks) { 
     cerr << "Disksystem: NotifyDeallocateBlocks: Attempt to deallocate"<<offset<<" to "<<(offset+innumblocks-1)<<" but maximum block is "<<(numblocks-1)<<endl;
     return ERROR_NOSUCHBLOCK;
@@ -6,12 +6,16 @@
 #include <vector>
 
 #include "global.h"
+#include "latch.h"
 #include "block.h"
 
 using namespace std;
 
 // Models a single disk with a single outstanding request
 //
+// Requests from several threads are serialized, since they share the
+// file handles, the bitmap and the head position.
+//
 // Includes storage allocator and free space bitmap to 
 // simplify project - REAL DISKS DO NOT HAVE ALLOCATORS OR BITMAPS
 //
@@ -21,6 +25,7 @@ class DiskSystem {
   FILE*  datafilefd;
   FILE*  configfilefd;
   FILE*  bitmapfilefd;
+  pthread_mutex_t lock;  // recursive, Read and Write check the bitmap
 
 
   //
@@ -94,6 +99,10 @@ class DiskSystem {
 		const Block &blocks,
 		double &reqtime);
 
+  // Hand every block written so far to the operating system, and if
+  // durable, wait for it to reach the device
+  ERROR_T Sync(const bool durable=true);
+
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
 
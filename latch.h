@@ -0,0 +1,19 @@
+#ifndef _latch
+#define _latch
+
+#include <pthread.h>
+
+// Holds a mutex for the lifetime of the guard, so that every return
+// path of a function releases it
+class MutexGuard {
+ private:
+  pthread_mutex_t *mutex;
+ public:
+  MutexGuard(pthread_mutex_t *m) : mutex(m) { pthread_mutex_lock(mutex); }
+  ~MutexGuard() { pthread_mutex_unlock(mutex); }
+ private:
+  MutexGuard(const MutexGuard &rhs);
+  MutexGuard & operator=(const MutexGuard &rhs);
+};
+
+#endif
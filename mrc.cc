@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <math.h>
+
+#include "mrc.h"
+
+
+// Bit mixing from MurmurHash3, so that the sample does not line up
+// with the shards, which are chosen by a multiplicative hash
+static unsigned long long SampleHash(const SIZE_T blocknum)
+{
+  unsigned long long h=blocknum;
+  h^=h>>33;
+  h*=0xff51afd7ed558ccdULL;
+  h^=h>>33;
+  h*=0xc4ceb9fe1a85ec53ULL;
+  h^=h>>33;
+  return h & 0xffffffffULL;
+}
+
+
+MissRatioCurve::MissRatioCurve(const double r) :
+  rate(r), now(0), reads(0), coldreads(0), allreads(0)
+{
+  if (rate<=0 || rate>1) {
+    rate=1;
+  }
+  threshold=(unsigned long long)(rate*4294967296.0);
+  tree.resize(1024,0);
+}
+
+
+void MissRatioCurve::Add(SIZE_T time, const long delta)
+{
+  for (;time<tree.size();time+=time & (~time+1)) {
+    tree[time]+=delta;
+  }
+}
+
+SIZE_T MissRatioCurve::Count(SIZE_T time) const
+{
+  SIZE_T sum=0;
+  for (;time>0;time-=time & (~time+1)) {
+    sum+=tree[time];
+  }
+  return sum;
+}
+
+
+// Give the blocks followed times 1..n again in the same order, so that
+// the tree need only be as large as the number of blocks
+void MissRatioCurve::Renumber()
+{
+  vector<pair<SIZE_T, SIZE_T> > order;
+
+  for (map<SIZE_T, SIZE_T>::const_iterator i=last.begin(); i!=last.end(); ++i) {
+    order.push_back(make_pair((*i).second,(*i).first));
+  }
+  sort(order.begin(),order.end());
+
+  tree.assign(order.size()*4>1024 ? order.size()*4 : 1024, 0);
+  for (SIZE_T i=0;i<order.size();i++) {
+    last[order[i].second]=i+1;
+    Add(i+1,1);
+  }
+  now=order.size();
+}
+
+
+void MissRatioCurve::Access(const SIZE_T blocknum, const bool read)
+{
+  if (read) {
+    allreads++;
+  }
+  if (SampleHash(blocknum)>=threshold) {
+    return;
+  }
+  if (now+1>=tree.size()) {
+    Renumber();
+  }
+  now++;
+
+  map<SIZE_T, SIZE_T>::iterator l=last.find(blocknum);
+
+  if (l==last.end()) {
+    if (read) {
+      reads++;
+      coldreads++;
+    }
+    last[blocknum]=now;
+  } else {
+    if (read) {
+      // the block itself and every other one touched since
+      SIZE_T distance=Count(now-1)-Count((*l).second)+1;
+      SIZE_T scaled=(SIZE_T)ceil(distance/rate);
+      if (scaled>=hist.size()) {
+	hist.resize(scaled+1,0);
+      }
+      hist[scaled]++;
+      reads++;
+    }
+    Add((*l).second,-1);
+    (*l).second=now;
+  }
+  Add(now,1);
+}
+
+
+double MissRatioCurve::GetHitRatio(const SIZE_T cachesize) const
+{
+  double expected=allreads*rate;
+  double hits;
+
+  if (reads==0 || cachesize==0) {
+    return 0;
+  }
+  hits=expected-reads;
+  for (SIZE_T d=1;d<hist.size() && d<=cachesize;d++) {
+    hits+=hist[d];
+  }
+  hits/=expected;
+  return hits<0 ? 0 : hits>1 ? 1 : hits;
+}
+
+
+ostream & MissRatioCurve::Print(ostream &os, const SIZE_T cachesize) const
+{
+  SIZE_T maxsize=GetMaxUsefulSize();
+  bool shown=false;
+
+  os << "cachesize\thitratio\t(lru, "<<rate*100<<"% of blocks sampled, "
+     << reads<<" reads, "<<coldreads<<" cold)"<<endl;
+  for (SIZE_T c=1;;c*=2) {
+    if (!shown && cachesize<=c) {
+      if (cachesize<c) {
+	os << cachesize<<"\t\t"<<GetHitRatio(cachesize)<<"\t(this cache)"<<endl;
+      }
+      shown=true;
+    }
+    os << c<<"\t\t"<<GetHitRatio(c)<<(c==cachesize ? "\t(this cache)" : "")<<endl;
+    if (c>=maxsize && shown) {
+      break;
+    }
+  }
+  return os;
+}
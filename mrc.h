@@ -0,0 +1,64 @@
+#ifndef _mrc
+#define _mrc
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// Miss ratio curve of an LRU cache, estimated from one stream of block
+// accesses
+//
+// An LRU cache of c blocks hits on a read exactly when fewer than c
+// other blocks were touched since the block was last touched (its
+// reuse distance), so one histogram of reuse distances gives the hit
+// ratio at every cache size at once.  To keep this cheap only blocks
+// whose hash falls below rate are followed (SHARDS sampling): their
+// distances among themselves are scaled up by 1/rate.  A few hot
+// blocks, such as a tree's root, may or may not be among those
+// followed and sway the estimate, so the difference between the reads
+// a fair sample would have seen and those it did is put down to the
+// shortest distance (SHARDS-adj).  With rate 1 every block is followed
+// and the curve is exact.
+//
+// Writes move a block to the front as they do in the cache, but only
+// reads count as hits or misses.
+//
+class MissRatioCurve {
+ private:
+  double rate;
+  unsigned long long threshold; // follow blocks whose hash is below this
+  SIZE_T now;                   // sampled accesses so far, renumbered
+  map<SIZE_T, SIZE_T> last;     // block to the time it was last touched
+  vector<SIZE_T> tree;          // Fenwick tree over times, counting the
+                                // times that are some block's last
+  vector<SIZE_T> hist;          // sampled reads by scaled reuse distance
+  SIZE_T reads, coldreads;      // sampled reads, and those of new blocks
+  SIZE_T allreads;              // sampled or not
+
+  void   Add(SIZE_T time, const long delta);
+  SIZE_T Count(SIZE_T time) const;    // last times up to time
+  void   Renumber();
+ public:
+  // rate is the fraction of blocks followed, in (0,1]
+  MissRatioCurve(const double rate);
+
+  void   Access(const SIZE_T blocknum, const bool read);
+
+  double GetRate() const { return rate; }
+  SIZE_T GetNumSampledReads() const { return reads; }
+  // Estimated hit ratio of an LRU cache of cachesize blocks
+  double GetHitRatio(const SIZE_T cachesize) const;
+  // Smallest cache size that would have hit on every repeated read
+  SIZE_T GetMaxUsefulSize() const { return hist.size()>0 ? hist.size()-1 : 0; }
+
+  // Hit ratio at cache sizes 1, 2, 4, ... up to the largest useful
+  // one, and at cachesize
+  ostream & Print(ostream &os, const SIZE_T cachesize) const;
+};
+
+#endif
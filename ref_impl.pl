@@ -19,15 +19,22 @@ if (!($op eq "INIT")) {
 }
 
 %content=();
+# changes of the open transaction, if any
+%pending=();
+$intxn=0;
 
 while ($line=<STDIN>) { 
   $line=~/^(\S+)\s+(.*)$/;
   $op=$1; $rest=$2; 
   if ($op eq "INSERT") {
     ($key, $value) = split(/\s+/,$rest);
-    if (defined $content{$key} || Bug()) { 
+    if (defined $content{$key} || defined $pending{$key} || Bug()) { 
       print STDERR "Inserting ($key, $value) failed because $key already exists\n" if $debug;
       print "FAIL\n";
+    } elsif ($intxn) { 
+      $pending{$key}=$value;
+      print STDERR "Inserted ($key, $value) in the transaction\n" if $debug;
+      print "OK\n";
     } else {
       $content{$key}=$value;
       print STDERR "Inserted ($key, $value)\n" if $debug;
@@ -35,9 +42,13 @@ while ($line=<STDIN>) {
     }
   } elsif ($op eq "UPDATE") { 
     ($key, $value) = split(/\s+/,$rest);
-    if (!(defined $content{$key}) || Bug()) { 
+    if (!(defined $content{$key} || defined $pending{$key}) || Bug()) { 
       print STDERR "Updating ($key, $value) failed because $key does not exist\n" if $debug;
       print "FAIL\n";
+    } elsif ($intxn) { 
+      $pending{$key}=$value;
+      print STDERR "Updated ($key, $value) in the transaction\n" if $debug;
+      print "OK\n";
     } else {
       $content{$key}=$value;
       print STDERR "Updated ($key, $value)\n" if $debug;
@@ -45,7 +56,7 @@ while ($line=<STDIN>) {
     }
   } elsif ($op eq "DELETE") { 
     ($key)=split(/\s+/,$rest);
-    if (!(defined $content{$key}) || Bug() ) { 
+    if ($intxn || !(defined $content{$key}) || Bug() ) { 
       print STDERR "Deleting ($key) failed because $key does not exist\n" if $debug;
       print "FAIL\n";
     } else {
@@ -55,11 +66,11 @@ while ($line=<STDIN>) {
     }
   } elsif ($op eq "LOOKUP") { 
     ($key)=split(/\s+/,$rest);
-    if (!(defined $content{$key}) || Bug() ) { 
+    if (!(defined $content{$key} || defined $pending{$key}) || Bug() ) { 
       print STDERR "Looking up ($key) failed because $key does not exist\n" if $debug;
       print "FAIL\n";
     } else {
-      $value= $content{$key};
+      $value= defined $pending{$key} ? $pending{$key} : $content{$key};
       print STDERR "Lookup ($key) found $value\n" if $debug;
       print "OK $value\n";
     }
@@ -70,6 +81,38 @@ while ($line=<STDIN>) {
       print "($key, $content{$key})\n";
     }
     print "OK END DISPLAY\n";
+  } elsif ($op eq "RESIZE") {
+    print STDERR "Resizing the cache, which we do not have\n" if $debug;
+    print "OK\n";
+  } elsif ($op eq "BEGIN") {
+    if ($intxn) { 
+      print STDERR "Beginning failed because a transaction is open\n" if $debug;
+      print "FAIL\n";
+    } else {
+      $intxn=1;
+      print STDERR "Began a transaction\n" if $debug;
+      print "OK\n";
+    }
+  } elsif ($op eq "COMMIT" || $op eq "ABORT") {
+    if (!$intxn) { 
+      print STDERR "Ending failed because no transaction is open\n" if $debug;
+      print "FAIL\n";
+    } else {
+      if ($op eq "COMMIT") { 
+	foreach $key (keys %pending) {
+	  $content{$key}=$pending{$key};
+	}
+      }
+      %pending=();
+      $intxn=0;
+      print STDERR "Ended the transaction with $op\n" if $debug;
+      print "OK\n";
+    }
+  } elsif ($op eq "CRASH") {
+    print STDERR "Crashing, which loses nothing that was committed\n" if $debug;
+    %pending=();
+    $intxn=0;
+    print "OK\n";
   } elsif ($op eq "DEINIT") {
     print STDERR "Got a deinit.  Finishing up now\n" if $debug;
     print "OK\n";
@@ -0,0 +1,563 @@
+#include "replacement.h"
+
+
+ReplacementPolicy *ReplacementPolicy::Create(const SIZE_T policy, const SIZE_T capacity)
+{
+  switch (policy) {
+  case CACHE_POLICY_LRU:
+    return new LruPolicy;
+  case CACHE_POLICY_CLOCK:
+    return new ClockPolicy;
+  case CACHE_POLICY_2Q:
+    return new TwoQueuePolicy(capacity);
+  case CACHE_POLICY_ARC:
+    return new ArcPolicy(capacity);
+  case CACHE_POLICY_CLOCKPRO:
+    return new ClockProPolicy(capacity);
+  default:
+    return 0;
+  }
+}
+
+const char *ReplacementPolicy::GetName(const SIZE_T policy)
+{
+  switch (policy) {
+  case CACHE_POLICY_LRU:      return "lru";
+  case CACHE_POLICY_CLOCK:    return "clock";
+  case CACHE_POLICY_2Q:       return "2q";
+  case CACHE_POLICY_ARC:      return "arc";
+  case CACHE_POLICY_CLOCKPRO: return "clockpro";
+  default:                    return "unknown";
+  }
+}
+
+bool ReplacementPolicy::Parse(const string &name, SIZE_T &policy)
+{
+  for (SIZE_T p=CACHE_POLICY_LRU; p<=CACHE_POLICY_CLOCKPRO; p++) {
+    if (name==GetName(p)) {
+      policy=p;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void BlockList::PushFront(const SIZE_T blocknum)
+{
+  order.push_front(blocknum);
+  where[blocknum]=order.begin();
+}
+
+bool BlockList::Erase(const SIZE_T blocknum)
+{
+  map<SIZE_T, list<SIZE_T>::iterator>::iterator w=where.find(blocknum);
+  if (w==where.end()) {
+    return false;
+  }
+  order.erase(w->second);
+  where.erase(w);
+  return true;
+}
+
+SIZE_T BlockList::PopBack()
+{
+  SIZE_T blocknum=order.back();
+  order.pop_back();
+  where.erase(blocknum);
+  return blocknum;
+}
+
+void BlockList::MoveToFront(const SIZE_T blocknum)
+{
+  map<SIZE_T, list<SIZE_T>::iterator>::iterator w=where.find(blocknum);
+  if (w!=where.end()) {
+    order.splice(order.begin(),order,w->second);
+  }
+}
+
+
+//
+// LRU
+//
+
+void LruPolicy::Hit(const SIZE_T blocknum)
+{
+  blocks.MoveToFront(blocknum);
+}
+
+bool LruPolicy::Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim)
+{
+  bool evicted = full && Evict(victim);
+  blocks.PushFront(blocknum);
+  return evicted;
+}
+
+bool LruPolicy::Evict(SIZE_T &victim)
+{
+  if (blocks.Size()==0) {
+    return false;
+  }
+  victim=blocks.PopBack();
+  return true;
+}
+
+void LruPolicy::Remove(const SIZE_T blocknum)
+{
+  blocks.Erase(blocknum);
+}
+
+
+//
+// CLOCK
+//
+
+void ClockPolicy::Hit(const SIZE_T blocknum)
+{
+  map<SIZE_T, SIZE_T>::iterator f=frameof.find(blocknum);
+  if (f!=frameof.end()) {
+    referenced[f->second]=true;
+  }
+}
+
+bool ClockPolicy::Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim)
+{
+  bool evicted = full && Evict(victim);
+  SIZE_T frame;
+
+  if (!freeframes.empty()) {
+    frame=freeframes.back();
+    freeframes.pop_back();
+  } else {
+    frame=frames.size();
+    frames.push_back(0);
+    referenced.push_back(false);
+    used.push_back(false);
+  }
+  frames[frame]=blocknum;
+  referenced[frame]=true;
+  used[frame]=true;
+  frameof[blocknum]=frame;
+  return evicted;
+}
+
+bool ClockPolicy::Evict(SIZE_T &victim)
+{
+  if (frameof.empty()) {
+    return false;
+  }
+  // at most two turns: the first clears every bit
+  while (true) {
+    if (hand>=frames.size()) {
+      hand=0;
+    }
+    if (used[hand] && !referenced[hand]) {
+      break;
+    }
+    referenced[hand]=false;
+    hand++;
+  }
+  victim=frames[hand++];
+  Remove(victim);
+  return true;
+}
+
+void ClockPolicy::Remove(const SIZE_T blocknum)
+{
+  map<SIZE_T, SIZE_T>::iterator f=frameof.find(blocknum);
+  if (f!=frameof.end()) {
+    used[f->second]=false;
+    referenced[f->second]=false;
+    freeframes.push_back(f->second);
+    frameof.erase(f);
+  }
+}
+
+
+//
+// 2Q, with the sizes the paper suggests: a1in a quarter of the cache
+// and a1out remembering half as many blocks as the cache holds
+//
+
+TwoQueuePolicy::TwoQueuePolicy(const SIZE_T capacity)
+{
+  SetCapacity(capacity);
+}
+
+void TwoQueuePolicy::SetCapacity(const SIZE_T capacity)
+{
+  kin = capacity/4>0 ? capacity/4 : 1;
+  kout = capacity/2>0 ? capacity/2 : 1;
+  while (a1out.Size()>kout) {
+    a1out.PopBack();
+  }
+}
+
+void TwoQueuePolicy::Hit(const SIZE_T blocknum)
+{
+  // a hit in a1in means nothing yet: it may be the same burst
+  am.MoveToFront(blocknum);
+}
+
+bool TwoQueuePolicy::Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim)
+{
+  bool evicted = full && Evict(victim);
+
+  if (a1out.Erase(blocknum)) {
+    am.PushFront(blocknum);
+  } else {
+    a1in.PushFront(blocknum);
+  }
+  return evicted;
+}
+
+bool TwoQueuePolicy::Evict(SIZE_T &victim)
+{
+  if (a1in.Size()>0 && (a1in.Size()>kin || am.Size()==0)) {
+    victim=a1in.PopBack();
+    a1out.PushFront(victim);
+    if (a1out.Size()>kout) {
+      a1out.PopBack();
+    }
+    return true;
+  }
+  if (am.Size()>0) {
+    victim=am.PopBack();
+    return true;
+  }
+  return false;
+}
+
+void TwoQueuePolicy::Remove(const SIZE_T blocknum)
+{
+  if (!a1in.Erase(blocknum)) {
+    am.Erase(blocknum);
+  }
+}
+
+
+//
+// ARC
+//
+
+void ArcPolicy::SetCapacity(const SIZE_T capacity)
+{
+  c=capacity;
+  if (p>c) {
+    p=c;
+  }
+  // the ghosts remember no more than the cache holds
+  while (b1.Size()>0 && t1.Size()+b1.Size()>c) {
+    b1.PopBack();
+  }
+  while (b2.Size()>0 && t1.Size()+t2.Size()+b1.Size()+b2.Size()>2*c) {
+    b2.PopBack();
+  }
+}
+
+void ArcPolicy::Hit(const SIZE_T blocknum)
+{
+  if (t1.Erase(blocknum)) {
+    t2.PushFront(blocknum);
+  } else {
+    t2.MoveToFront(blocknum);
+  }
+}
+
+// Evict from t1 if it is over its target size p, otherwise from t2,
+// remembering the victim in b1 or b2
+bool ArcPolicy::Replace(const bool inb2, SIZE_T &victim)
+{
+  if (t1.Size()>0 && (t1.Size()>p || (inb2 && t1.Size()==p) || t2.Size()==0)) {
+    victim=t1.PopBack();
+    b1.PushFront(victim);
+    return true;
+  }
+  if (t2.Size()>0) {
+    victim=t2.PopBack();
+    b2.PushFront(victim);
+    return true;
+  }
+  return false;
+}
+
+bool ArcPolicy::Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim)
+{
+  bool evicted=false;
+
+  if (b1.Contains(blocknum)) {
+    SIZE_T d = b2.Size()>b1.Size() ? b2.Size()/b1.Size() : 1;
+    p = (p+d<c) ? p+d : c;
+    if (full) {
+      evicted=Replace(false,victim);
+    }
+    b1.Erase(blocknum);
+    t2.PushFront(blocknum);
+  } else if (b2.Contains(blocknum)) {
+    SIZE_T d = b1.Size()>b2.Size() ? b1.Size()/b2.Size() : 1;
+    p = (p>d) ? p-d : 0;
+    if (full) {
+      evicted=Replace(true,victim);
+    }
+    b2.Erase(blocknum);
+    t2.PushFront(blocknum);
+  } else {
+    if (t1.Size()+b1.Size()>=c) {
+      if (t1.Size()<c) {
+	b1.PopBack();
+	if (full) {
+	  evicted=Replace(false,victim);
+	}
+      } else if (full && t1.Size()>0) {
+	// t1 is the whole cache: drop its oldest without remembering it
+	victim=t1.PopBack();
+	evicted=true;
+      } else if (full) {
+	// c is 0, so t1 is empty as well
+	evicted=Replace(false,victim);
+      }
+    } else if (t1.Size()+t2.Size()+b1.Size()+b2.Size()>=c) {
+      if (t1.Size()+t2.Size()+b1.Size()+b2.Size()>=2*c && b2.Size()>0) {
+	b2.PopBack();
+      }
+      if (full) {
+	evicted=Replace(false,victim);
+      }
+    } else if (full) {
+      evicted=Replace(false,victim);
+    }
+    t1.PushFront(blocknum);
+  }
+  return evicted;
+}
+
+bool ArcPolicy::Evict(SIZE_T &victim)
+{
+  return Replace(false,victim);
+}
+
+void ArcPolicy::Remove(const SIZE_T blocknum)
+{
+  if (!t1.Erase(blocknum)) {
+    t2.Erase(blocknum);
+  }
+}
+
+
+//
+// CLOCK-Pro
+//
+
+ClockProPolicy::ClockProPolicy(const SIZE_T capacity) :
+  m(capacity), mc(1), numhot(0), numcold(0), numnonresident(0)
+{
+  handhot=handcold=handtest=ring.end();
+}
+
+void ClockProPolicy::Advance(Pos &hand)
+{
+  if (ring.empty()) {
+    hand=ring.end();
+    return;
+  }
+  if (hand!=ring.end()) {
+    ++hand;
+  }
+  if (hand==ring.end()) {
+    hand=ring.begin();
+  }
+}
+
+void ClockProPolicy::Unlink(Pos pos)
+{
+  if (handhot==pos) { Advance(handhot); }
+  if (handcold==pos) { Advance(handcold); }
+  if (handtest==pos) { Advance(handtest); }
+  where.erase(pos->blocknum);
+  ring.erase(pos);
+  if (ring.empty()) {
+    handhot=handcold=handtest=ring.end();
+  }
+}
+
+// New entries go at the head of the list, just behind the hot hand,
+// so that it is the last one every hand comes to
+void ClockProPolicy::Insert(const Entry &e)
+{
+  Pos pos=ring.insert(handhot,e);
+  where[e.blocknum]=pos;
+  if (ring.size()==1) {
+    handhot=handcold=handtest=pos;
+  }
+}
+
+// A cold block's test ended without it being seen again
+void ClockProPolicy::EndTest(Entry &e)
+{
+  if (e.test) {
+    e.test=false;
+    if (mc>1) {
+      mc--;
+    }
+  }
+}
+
+// Turn the first unreferenced hot block cold, ending the tests the hand
+// passes on the way
+void ClockProPolicy::RunHandHot()
+{
+  while (numhot>0) {
+    Pos pos=handhot;
+    Advance(handhot);
+    Entry &e=*pos;
+    if (e.hot) {
+      if (e.referenced) {
+	e.referenced=false;
+      } else {
+	e.hot=false;
+	numhot--;
+	numcold++;
+	return;
+      }
+    } else if (e.test) {
+      EndTest(e);
+      if (!e.resident) {
+	numnonresident--;
+	Unlink(pos);
+      }
+    }
+  }
+}
+
+// Forget remembered blocks until there are no more of them than the
+// cache holds
+void ClockProPolicy::RunHandTest()
+{
+  while (numnonresident>m) {
+    Pos pos=handtest;
+    Advance(handtest);
+    Entry &e=*pos;
+    if (!e.hot && e.test) {
+      EndTest(e);
+      if (!e.resident) {
+	numnonresident--;
+	Unlink(pos);
+      }
+    }
+  }
+}
+
+void ClockProPolicy::Hit(const SIZE_T blocknum)
+{
+  map<SIZE_T, Pos>::iterator w=where.find(blocknum);
+  if (w!=where.end() && w->second->resident) {
+    w->second->referenced=true;
+  }
+}
+
+void ClockProPolicy::SetCapacity(const SIZE_T capacity)
+{
+  m=capacity;
+  if (mc>1 && mc>=m) {
+    mc = (m>1) ? m-1 : 1;
+  }
+  RunHandTest();
+}
+
+bool ClockProPolicy::Evict(SIZE_T &victim)
+{
+  SIZE_T maxcold = (m>1) ? m-1 : 1;
+
+  while (numhot+numcold>0) {
+    if (numcold==0) {
+      RunHandHot();
+    }
+    Pos pos=handcold;
+    Advance(handcold);
+    Entry &e=*pos;
+    if (e.hot || !e.resident) {
+      continue;
+    }
+    if (e.referenced) {
+      e.referenced=false;
+      if (e.test) {
+	// seen again during its test
+	e.test=false;
+	e.hot=true;
+	numcold--;
+	numhot++;
+	if (mc<maxcold) {
+	  mc++;
+	}
+	ring.splice(handhot,ring,pos);
+	while (numhot>m-mc) {
+	  RunHandHot();
+	}
+      } else {
+	e.test=true;
+	ring.splice(handhot,ring,pos);
+      }
+    } else {
+      victim=e.blocknum;
+      numcold--;
+      if (e.test) {
+	// remember it until its test ends
+	e.resident=false;
+	numnonresident++;
+      } else {
+	Unlink(pos);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ClockProPolicy::Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim)
+{
+  bool evicted = full && Evict(victim);
+  SIZE_T maxcold = (m>1) ? m-1 : 1;
+
+  Entry e;
+  e.blocknum=blocknum;
+  e.referenced=false;
+  e.resident=true;
+
+  map<SIZE_T, Pos>::iterator w=where.find(blocknum);
+  if (w!=where.end()) {
+    // back during its test, so it comes back hot
+    if (mc<maxcold) {
+      mc++;
+    }
+    numnonresident--;
+    Unlink(w->second);
+    e.hot=true;
+    e.test=false;
+    Insert(e);
+    numhot++;
+    while (numhot>0 && numhot>m-mc) {
+      RunHandHot();
+    }
+  } else {
+    e.hot=false;
+    e.test=true;
+    Insert(e);
+    numcold++;
+  }
+  RunHandTest();
+  return evicted;
+}
+
+void ClockProPolicy::Remove(const SIZE_T blocknum)
+{
+  map<SIZE_T, Pos>::iterator w=where.find(blocknum);
+  if (w==where.end() || !w->second->resident) {
+    return;
+  }
+  if (w->second->hot) {
+    numhot--;
+  } else {
+    numcold--;
+  }
+  Unlink(w->second);
+}
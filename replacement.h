@@ -0,0 +1,177 @@
+#ifndef _replacement
+#define _replacement
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+// Replacement policies a buffer cache may use
+#define CACHE_POLICY_LRU      0   // least recently used
+#define CACHE_POLICY_CLOCK    1   // second chance
+#define CACHE_POLICY_2Q       2   // Johnson and Shasha
+#define CACHE_POLICY_ARC      3   // Megiddo and Modha
+#define CACHE_POLICY_CLOCKPRO 4   // Jiang, Chen and Zhang
+
+//
+// Decides which block a full cache lets go of.  The cache tells it
+// about every hit, every block it brings in and every block it drops
+// by other means.  A policy may remember blocks that are no longer
+// cached.  Each cache shard has its own policy, so a policy needs no
+// locking of its own.
+//
+class ReplacementPolicy {
+ public:
+  virtual ~ReplacementPolicy() {}
+
+  // blocknum, which is cached, was read or written
+  virtual void Hit(const SIZE_T blocknum)=0;
+  // blocknum is being brought in.  If the cache is full, returns true
+  // and the cached block it replaces in victim.
+  virtual bool Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim)=0;
+  // blocknum left the cache without being chosen, e.g. it was flushed
+  virtual void Remove(const SIZE_T blocknum)=0;
+  // Choose a cached block to let go of without bringing one in, e.g.
+  // as the cache shrinks.  Returns false if there is none.
+  virtual bool Evict(SIZE_T &victim)=0;
+  // The cache now holds capacity blocks
+  virtual void SetCapacity(const SIZE_T capacity) {}
+
+  // A new policy for a cache of capacity blocks, or 0 for a bad policy
+  static ReplacementPolicy *Create(const SIZE_T policy, const SIZE_T capacity);
+  static const char *GetName(const SIZE_T policy);
+  // Policy number from its name ("lru", "clock", "2q", "arc", "clockpro")
+  static bool Parse(const string &name, SIZE_T &policy);
+};
+
+
+// Blocks in recency order, most recent first, with constant time
+// lookup by block number.  The building block of most of the policies.
+class BlockList {
+ private:
+  list<SIZE_T> order;
+  map<SIZE_T, list<SIZE_T>::iterator> where;
+ public:
+  bool   Contains(const SIZE_T blocknum) const { return where.find(blocknum)!=where.end(); }
+  SIZE_T Size() const { return where.size(); }
+  void   PushFront(const SIZE_T blocknum);
+  // Unlinks blocknum, returning false if it was not there
+  bool   Erase(const SIZE_T blocknum);
+  SIZE_T PopBack();
+  void   MoveToFront(const SIZE_T blocknum);
+};
+
+
+class LruPolicy : public ReplacementPolicy {
+ private:
+  BlockList blocks;
+ public:
+  void Hit(const SIZE_T blocknum);
+  bool Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim);
+  void Remove(const SIZE_T blocknum);
+  bool Evict(SIZE_T &victim);
+};
+
+
+// Blocks sit in a ring of frames with a reference bit each.  The hand
+// clears set bits as it goes round and takes the first block whose bit
+// is already clear.
+class ClockPolicy : public ReplacementPolicy {
+ private:
+  vector<SIZE_T> frames;
+  vector<bool>   referenced;
+  vector<bool>   used;
+  vector<SIZE_T> freeframes;
+  map<SIZE_T, SIZE_T> frameof;
+  SIZE_T hand;
+ public:
+  ClockPolicy() : hand(0) {}
+  void Hit(const SIZE_T blocknum);
+  bool Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim);
+  void Remove(const SIZE_T blocknum);
+  bool Evict(SIZE_T &victim);
+};
+
+
+// New blocks go to a FIFO, a1in, and are remembered for a while in
+// a1out after leaving it.  Only a block seen again while in a1out
+// enters the LRU list am, so a scan passes through a1in alone.
+class TwoQueuePolicy : public ReplacementPolicy {
+ private:
+  SIZE_T kin, kout;
+  BlockList a1in, a1out, am;
+ public:
+  TwoQueuePolicy(const SIZE_T capacity);
+  void SetCapacity(const SIZE_T capacity);
+  void Hit(const SIZE_T blocknum);
+  bool Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim);
+  void Remove(const SIZE_T blocknum);
+  bool Evict(SIZE_T &victim);
+};
+
+
+// t1 holds blocks seen once recently and t2 blocks seen at least
+// twice.  b1 and b2 remember blocks evicted from each.  A hit in b1
+// grows p, the share of the cache given to t1, and a hit in b2 shrinks
+// it.
+class ArcPolicy : public ReplacementPolicy {
+ private:
+  SIZE_T c, p;
+  BlockList t1, t2, b1, b2;
+  bool Replace(const bool inb2, SIZE_T &victim);
+ public:
+  ArcPolicy(const SIZE_T capacity) : c(capacity), p(0) {}
+  void SetCapacity(const SIZE_T capacity);
+  void Hit(const SIZE_T blocknum);
+  bool Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim);
+  void Remove(const SIZE_T blocknum);
+  bool Evict(SIZE_T &victim);
+};
+
+
+// All blocks, cached or only remembered, sit on one clock.  A cached
+// block is hot or cold.  A cold block is on test for a while after it
+// comes in or is seen again: referenced again during its test it turns
+// hot, and a block that comes back while remembered comes back hot.
+// Three hands go round: the cold hand evicts cold blocks, the hot hand
+// turns unreferenced hot blocks cold, and the test hand ends tests and
+// forgets remembered blocks.  mc, the number of cold blocks aimed for,
+// grows with each block that turns hot during its test and shrinks
+// with each test that ends without one.
+class ClockProPolicy : public ReplacementPolicy {
+ private:
+  struct Entry {
+    SIZE_T blocknum;
+    bool   hot;
+    bool   referenced;
+    bool   test;
+    bool   resident;
+  };
+  typedef list<Entry>::iterator Pos;
+
+  SIZE_T m, mc;
+  SIZE_T numhot, numcold, numnonresident;
+  list<Entry> ring;
+  map<SIZE_T, Pos> where;
+  Pos handhot, handcold, handtest;
+
+  void Advance(Pos &hand);
+  void Unlink(Pos pos);
+  void Insert(const Entry &e);
+  void EndTest(Entry &e);
+  void RunHandHot();
+  void RunHandTest();
+ public:
+  ClockProPolicy(const SIZE_T capacity);
+  void SetCapacity(const SIZE_T capacity);
+  void Hit(const SIZE_T blocknum);
+  bool Admit(const SIZE_T blocknum, const bool full, SIZE_T &victim);
+  void Remove(const SIZE_T blocknum);
+  bool Evict(SIZE_T &victim);
+};
+
+#endif
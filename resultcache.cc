@@ -0,0 +1,205 @@
+#include "resultcache.h"
+
+
+ResultCache::ResultCache(const SIZE_T c) :
+  capacity(c), hand(0), samples(0),
+  numlookups(0), numhits(0), numadmits(0), numrejects(0), numforgets(0)
+{
+  SIZE_T n;
+
+  entries.resize(capacity);
+  // at most half full, so runs stay short
+  for (n=1; n<2*capacity; n*=2) {
+  }
+  table.assign(n,0);
+  for (sketchwidth=64; sketchwidth<4*capacity; sketchwidth*=2) {
+  }
+  sketch.assign(RESULTCACHE_SKETCH_ROWS*sketchwidth,0);
+  for (SIZE_T i=0;i<RESULTCACHE_STRIPES;i++) {
+    generations[i]=0;
+  }
+  Clear();
+}
+
+
+// FNV-1a, then mixed (splitmix64) so that the low bits are good
+unsigned long long ResultCache::Hash(const KEY_T &key)
+{
+  unsigned long long h=14695981039346656037ULL;
+
+  for (SIZE_T i=0;i<key.length;i++) {
+    h=(h^key.data[i])*1099511628211ULL;
+  }
+  h+=0x9e3779b97f4a7c15ULL;
+  h=(h^(h>>30))*0xbf58476d1ce4e5b9ULL;
+  h=(h^(h>>27))*0x94d049bb133111ebULL;
+  return h^(h>>31);
+}
+
+
+SIZE_T ResultCache::Find(const KEY_T &key, const unsigned long long hash) const
+{
+  SIZE_T mask=table.size()-1;
+  SIZE_T pos=hash&mask;
+
+  while (table[pos]) {
+    const Entry &e=entries[table[pos]-1];
+    if (e.hash==hash && e.key==key) {
+      break;
+    }
+    pos=(pos+1)&mask;
+  }
+  return pos;
+}
+
+
+// Empty table[pos] and shift back the entries after it in its run that
+// could no longer be found past the hole
+void ResultCache::RemoveAt(SIZE_T pos)
+{
+  SIZE_T mask=table.size()-1;
+  SIZE_T next=pos;
+
+  freeslots.push_back(table[pos]-1);
+  while (true) {
+    next=(next+1)&mask;
+    if (!table[next]) {
+      break;
+    }
+    SIZE_T home=entries[table[next]-1].hash&mask;
+    // home lies cyclically in (pos,next] if the entry is fine where it is
+    bool stays = (pos<=next) ? (pos<home && home<=next) : (pos<home || home<=next);
+    if (!stays) {
+      table[pos]=table[next];
+      pos=next;
+    }
+  }
+  table[pos]=0;
+}
+
+
+void ResultCache::Count(const unsigned long long hash)
+{
+  SIZE_T a=hash>>32, b=(hash>>16)|1;
+
+  for (SIZE_T r=0;r<RESULTCACHE_SKETCH_ROWS;r++) {
+    unsigned char &c=sketch[r*sketchwidth+((a+r*b)&(sketchwidth-1))];
+    if (c<RESULTCACHE_SKETCH_MAX) {
+      c++;
+    }
+  }
+  if (++samples>=10*capacity) {
+    for (SIZE_T i=0;i<sketch.size();i++) {
+      sketch[i]>>=1;
+    }
+    samples=0;
+  }
+}
+
+
+SIZE_T ResultCache::Frequency(const unsigned long long hash) const
+{
+  SIZE_T a=hash>>32, b=(hash>>16)|1;
+  SIZE_T f=RESULTCACHE_SKETCH_MAX;
+
+  for (SIZE_T r=0;r<RESULTCACHE_SKETCH_ROWS;r++) {
+    SIZE_T c=sketch[r*sketchwidth+((a+r*b)&(sketchwidth-1))];
+    if (c<f) {
+      f=c;
+    }
+  }
+  return f;
+}
+
+
+bool ResultCache::Lookup(const KEY_T &key, VALUE_T &value, SIZE_T &generation)
+{
+  unsigned long long hash=Hash(key);
+  SIZE_T pos=Find(key,hash);
+
+  numlookups++;
+  Count(hash);
+  generation=generations[hash%RESULTCACHE_STRIPES];
+  if (!table[pos]) {
+    return false;
+  }
+  Entry &e=entries[table[pos]-1];
+  e.referenced=true;
+  value=e.value;
+  numhits++;
+  return true;
+}
+
+
+void ResultCache::Put(const KEY_T &key, const VALUE_T &value, const SIZE_T generation)
+{
+  unsigned long long hash=Hash(key);
+  SIZE_T pos, slot;
+
+  if (capacity==0 || generations[hash%RESULTCACHE_STRIPES]!=generation) {
+    return;
+  }
+  pos=Find(key,hash);
+  if (table[pos]) {
+    // another lookup got here first
+    entries[table[pos]-1].value=value;
+    return;
+  }
+  if (freeslots.empty()) {
+    // the first key the hand finds not looked up since it last went by
+    while (entries[hand].referenced) {
+      entries[hand].referenced=false;
+      hand=(hand+1)%capacity;
+    }
+    Entry &victim=entries[hand];
+    if (Frequency(hash)<=Frequency(victim.hash)) {
+      numrejects++;
+      return;
+    }
+    RemoveAt(Find(victim.key,victim.hash));
+    hand=(hand+1)%capacity;
+    // the hole may have moved our key's place up
+    pos=Find(key,hash);
+  }
+  slot=freeslots.back();
+  freeslots.pop_back();
+  Entry &e=entries[slot];
+  e.hash=hash;
+  e.key=key;
+  e.value=value;
+  e.referenced=false;
+  table[pos]=slot+1;
+  numadmits++;
+}
+
+
+void ResultCache::Forget(const KEY_T &key)
+{
+  unsigned long long hash=Hash(key);
+  SIZE_T pos;
+
+  generations[hash%RESULTCACHE_STRIPES]++;
+  if (capacity==0) {
+    return;
+  }
+  pos=Find(key,hash);
+  if (table[pos]) {
+    RemoveAt(pos);
+    numforgets++;
+  }
+}
+
+
+void ResultCache::Clear()
+{
+  table.assign(table.size(),0);
+  freeslots.clear();
+  for (SIZE_T i=capacity;i>0;i--) {
+    entries[i-1].referenced=false;
+    freeslots.push_back(i-1);
+  }
+  for (SIZE_T i=0;i<RESULTCACHE_STRIPES;i++) {
+    generations[i]++;
+  }
+  hand=0;
+}
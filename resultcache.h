@@ -0,0 +1,89 @@
+#ifndef _resultcache
+#define _resultcache
+
+#include <vector>
+
+#include "global.h"
+#include "btree_ds.h"
+
+using namespace std;
+
+// Stripes of invalidation generations; a key's stripe is picked by its
+// hash
+#define RESULTCACHE_STRIPES 64
+// Rows of the frequency sketch, and the largest count it keeps
+#define RESULTCACHE_SKETCH_ROWS 4
+#define RESULTCACHE_SKETCH_MAX 15
+
+//
+// Values of recently looked up keys, kept in front of an index
+//
+// A lookup that finds its key here takes the value from one probe of
+// an open addressed hash table, without going down the tree.  Up to
+// capacity keys are kept; once full, a CLOCK hand picks the key to
+// give up for a new one, skipping those looked up since it last went
+// by.  A new key only gets in if it has been looked up more often
+// lately than the one it would replace (TinyLFU).  How often is kept
+// in a small count-min sketch of every key looked up, whose counts are
+// halved every 10*capacity lookups, so that keys that were once hot
+// give way to those that are now.
+//
+// Only keys that were found are kept.  A writer calls Forget once its
+// change can be seen, which also moves on the generation of the key's
+// stripe: a lookup that read the tree before then, and so may have the
+// old value, passes in the generation it started with and Put turns it
+// away.
+//
+// Not locked: the index holds a lock around every call.
+//
+class ResultCache {
+ private:
+  struct Entry {
+    unsigned long long hash;
+    KEY_T              key;
+    VALUE_T            value;
+    bool               referenced;  // looked up since the hand went by
+  };
+
+  SIZE_T capacity;
+  vector<Entry> entries;        // capacity slots
+  vector<SIZE_T> freeslots;
+  vector<SIZE_T> table;         // slot+1, or 0 for none
+  SIZE_T hand;
+  SIZE_T generations[RESULTCACHE_STRIPES];
+  vector<unsigned char> sketch; // RESULTCACHE_SKETCH_ROWS rows
+  SIZE_T sketchwidth;
+  SIZE_T samples;
+  SIZE_T numlookups, numhits, numadmits, numrejects, numforgets;
+
+  static unsigned long long Hash(const KEY_T &key);
+  // The position in table of the slot holding key, or of the empty one
+  // that ends its run
+  SIZE_T  Find(const KEY_T &key, const unsigned long long hash) const;
+  void    RemoveAt(SIZE_T pos);
+  void    Count(const unsigned long long hash);
+  SIZE_T  Frequency(const unsigned long long hash) const;
+ public:
+  ResultCache(const SIZE_T capacity);
+
+  // If key is here, its value.  Either way, the generation to hand to
+  // Put after looking in the tree.
+  bool    Lookup(const KEY_T &key, VALUE_T &value, SIZE_T &generation);
+  // Keep value as key's, unless key has been written since generation
+  // or is not worth what it would replace
+  void    Put(const KEY_T &key, const VALUE_T &value, const SIZE_T generation);
+  // key's value has changed, or it is gone
+  void    Forget(const KEY_T &key);
+  // Forget everything
+  void    Clear();
+
+  SIZE_T  GetCapacity() const { return capacity; }
+  SIZE_T  GetNumKeys() const { return capacity-freeslots.size(); }
+  SIZE_T  GetNumLookups() const { return numlookups; }
+  SIZE_T  GetNumHits() const { return numhits; }
+  SIZE_T  GetNumAdmits() const { return numadmits; }
+  SIZE_T  GetNumRejects() const { return numrejects; }
+  SIZE_T  GetNumForgets() const { return numforgets; }
+};
+
+#endif
@@ -1,9 +1,11 @@
 #include <iostream>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <string>
 #include <strstream>
 #include <fstream>
+#include <vector>
 #include "btree.h"
 
 
@@ -11,7 +13,62 @@ using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim [-f fixed|slotted|buffered] [-m minfill] [-l leaffill] [-i interiorfill] [-b] [-n numshards] [-r lru|clock|2q|arc|clockpro] [-p pinnedlevels] [-c samplerate] [-z tierkilobytes] [-g batchsize] [-w] [-k checkpointkilobytes] [-s] [-t memtablesize] [-e filterblocks] [-v resultcachesize] filestem cachesize < specfile \n";
+}
+
+
+// The reply to a LOOKUP
+static void PrintLookup(const ERROR_T rc, const VALUE_T &lookup_value)
+{
+  if (rc!=ERROR_NOERROR) { 
+    cout <<"FAIL"<< endl;
+    cerr <<"Can't lookup due to error "<<rc<<endl;
+  } else {
+    cout <<"OK ";
+    for (unsigned int k=0; k<lookup_value.length; k++) {
+      cout << lookup_value.data[k];
+    }
+    cout << endl;
+  }
+}
+
+
+// Run the LOOKUPs or INSERTs waiting in keys (and values) as one
+// MultiLookup or InsertBatch, and reply to each in order
+static void RunBatch(BTreeIndex *btree, BufferCache &cache, const string &action,
+		     vector<KEY_T> &keys, vector<VALUE_T> &values,
+		     SIZE_T &numlookups, SIZE_T &lookupdiskreads, SIZE_T &lookupunpinned)
+{
+  vector<ERROR_T> results;
+  ERROR_T rc;
+
+  if (action == "INSERT") { 
+    if ((rc=btree->InsertBatch(keys,values,results))!=ERROR_NOERROR) { 
+      results.assign(keys.size(),rc);
+    }
+    for (SIZE_T i=0;i<keys.size();i++) { 
+      if (results[i]!=ERROR_NOERROR) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't insert due to error "<<results[i]<<"\n";
+      } else {
+	cout <<"OK\n";
+      }
+    }
+  } else {
+    SIZE_T diskreads=cache.GetNumDiskReads();
+    SIZE_T unpinned=cache.GetNumUnpinnedDiskReads();
+    if ((rc=btree->MultiLookup(keys,values,results))!=ERROR_NOERROR) { 
+      results.assign(keys.size(),rc);
+    }
+    numlookups+=keys.size();
+    lookupdiskreads+=cache.GetNumDiskReads()-diskreads;
+    lookupunpinned+=cache.GetNumUnpinnedDiskReads()-unpinned;
+    for (SIZE_T i=0;i<keys.size();i++) { 
+      PrintLookup(results[i],values[i]);
+    }
+  }
+  keys.clear();
+  values.clear();
 }
 
 
@@ -20,27 +77,143 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  SIZE_T format=BTREE_FORMAT_FIXED;
+  SIZE_T minfill=BTREE_DEFAULT_MINFILL;
+  SIZE_T leaffill=BTREE_DEFAULT_FILL;
+  SIZE_T interiorfill=BTREE_DEFAULT_FILL;
+  bool linked=false;
+  SIZE_T numshards=1;
+  SIZE_T policy=CACHE_POLICY_LRU;
+  SIZE_T pinnedlevels=0;
+  double samplerate=0;
+  SIZE_T tierkb=0;
+  SIZE_T batchsize=1;
+  bool logged=false;
+  SIZE_T checkpointkb=0;
+  bool shadow=false;
+  SIZE_T memtablesize=0;
+  SIZE_T filterblocks=0;
+  SIZE_T resultcachesize=0;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"f:m:l:i:bn:r:p:c:z:g:wk:st:e:v:"))!=-1) { 
+    switch (opt) { 
+    case 'f':
+      if (string(optarg)=="slotted") { 
+	format=BTREE_FORMAT_SLOTTED;
+      } else if (string(optarg)=="buffered") { 
+	format=BTREE_FORMAT_BUFFERED;
+      } else if (string(optarg)=="fixed") { 
+	format=BTREE_FORMAT_FIXED;
+      } else {
+	usage();
+	return 1;
+      }
+      break;
+    case 'm':
+      minfill=atoi(optarg);
+      break;
+    case 'l':
+      leaffill=atoi(optarg);
+      break;
+    case 'i':
+      interiorfill=atoi(optarg);
+      break;
+    case 'b':
+      linked=true;
+      break;
+    case 'n':
+      numshards=atoi(optarg);
+      break;
+    case 'r':
+      if (!ReplacementPolicy::Parse(string(optarg),policy)) { 
+	usage();
+	return 1;
+      }
+      break;
+    case 'p':
+      pinnedlevels=atoi(optarg);
+      break;
+    case 'c':
+      samplerate=atof(optarg);
+      if (samplerate<0 || samplerate>1) { 
+	usage();
+	return 1;
+      }
+      break;
+    case 'z':
+      tierkb=atoi(optarg);
+      break;
+    case 'g':
+      batchsize=atoi(optarg);
+      break;
+    case 'w':
+      logged=true;
+      break;
+    case 'k':
+      checkpointkb=atoi(optarg);
+      break;
+    case 's':
+      shadow=true;
+      break;
+    case 't':
+      memtablesize=atoi(optarg);
+      break;
+    case 'e':
+      filterblocks=atoi(optarg);
+      break;
+    case 'v':
+      resultcachesize=atoi(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc-optind != 2){
     usage();
     return 1;
   }
+  if (logged && memtablesize) { 
+    // the memtable is not logged, so CRASH would lose changes
+    cerr << "A memtable (-t) can't be used with the log (-w)\n";
+    return 1;
+  }
 
-  char *filestem=argv[1];
-  SIZE_T cachesize=atoi(argv[2]);
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
   SIZE_T superblocknum;
 
   FILE *file; 
-  char line[1024];
-  int max = 8192;
+  char line[65536];
+  int max = sizeof(line);
   ERROR_T rc;
   
   // We'll connect to the btree only once and then
   // run lots of operations
   // so we need to do this outside the loop
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
-  // will be set on init
-  BTreeIndex *btree;
+  BufferCache cache(&disk,cachesize,numshards,policy);
+  cache.SetPinnedLevels(pinnedlevels);
+  cache.SetMissRatioSampling(samplerate);
+  cache.SetCompressedTier(tierkb*1024);
+  // the log is written but not synced: a simulated crash only loses
+  // the process
+  if (logged && (rc=cache.SetWriteAheadLog(filestem,false))!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<"\n";
+    return -1;
+  }
+  cache.SetCheckpointInterval(checkpointkb*1024.0);
+  // will be set on init, and is 0 until an init succeeds
+  BTreeIndex *btree=0;
+  // disk reads made by lookups, and those they would have made
+  // with nothing pinned
+  SIZE_T numlookups=0, lookupdiskreads=0, lookupunpinned=0;
+  // consecutive lookups or inserts waiting to be run together
+  vector<KEY_T> batch;
+  vector<VALUE_T> batchvalues;
+  string batchaction;
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
@@ -58,11 +231,49 @@ int main(int argc, char *argv[])
     istrstream is(line2.c_str(),line2.size());
     is >> action >> key >> value;
 
+    // there is nothing to run anything else against
+    if (!btree && action != "INIT") { 
+      if (!action.empty()) { 
+	cout << "FAIL\n";
+	cerr << "Can't "<<action<<" without an index\n";
+      }
+      continue;
+    }
+
+    bool batched=(action == "LOOKUP" || action == "INSERT") && batchsize>1;
+    if (!batch.empty() && (!batched || action != batchaction)) { 
+      RunBatch(btree,cache,batchaction,batch,batchvalues,numlookups,lookupdiskreads,lookupunpinned);
+    }
+    if (batched) { 
+      batch.push_back(KEY_T(key.c_str()));
+      batchvalues.push_back(VALUE_T(value.c_str()));
+      batchaction=action;
+      if (batch.size()>=batchsize) { 
+	RunBatch(btree,cache,batchaction,batch,batchvalues,numlookups,lookupdiskreads,lookupunpinned);
+      }
+      continue;
+    }
+
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
-      if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
+      // the index there is detached first, and left on the disk as
+      // DEINIT leaves it
+      if (btree && (rc=btree->Detach(superblocknum))!=ERROR_NOERROR) { 
+	cout << "FAIL"<<endl;
+	cerr << "Can't detach btree due to error "<<rc<<endl;
+	continue;
+      }
+      delete btree;
+      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache,true,format,minfill,
+			     leaffill,interiorfill,linked,shadow);
+      // like the log, commits are not synced
+      btree->SetShadowSync(false);
+      btree->SetFilterBlocks(filterblocks);
+      btree->SetResultCacheSize(resultcachesize);
+      if ((rc=btree->Attach(0, true))!=ERROR_NOERROR || (rc=btree->SetMemtableSize(memtablesize))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
+	delete btree;
+	btree=0;
       } else {
 	cout << "OK\n";
       }
@@ -89,15 +300,55 @@ int main(int argc, char *argv[])
       }
     } else if (action == "LOOKUP"){
       VALUE_T lookup_value;
-      if ((rc=btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
-        cout <<"FAIL"<< endl;
-	cerr <<"Can't lookup due to error "<<rc<<endl;
+      SIZE_T diskreads=cache.GetNumDiskReads();
+      SIZE_T unpinned=cache.GetNumUnpinnedDiskReads();
+      rc=btree->Lookup(KEY_T(key.c_str()),lookup_value);
+      numlookups++;
+      lookupdiskreads+=cache.GetNumDiskReads()-diskreads;
+      lookupunpinned+=cache.GetNumUnpinnedDiskReads()-unpinned;
+      PrintLookup(rc,lookup_value);
+    } else if (action == "RESIZE") {
+      // the cache, not the tree: blocks stay where they are
+      if ((rc=cache.Resize(atoi(key.c_str())))!=ERROR_NOERROR) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't resize cache due to error "<<rc<<endl;
       } else {
-        cout <<"OK ";
- 	for (unsigned int k=0; k<lookup_value.length; k++) {
- 	    cout << lookup_value.data[k];
-	}
- 	cout << endl;
+	cout <<"OK\n";
+      }
+    } else if (action == "BEGIN") {
+      if ((rc=btree->Begin())!=ERROR_NOERROR) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't begin transaction due to error "<<rc<<endl;
+      } else {
+	cout <<"OK\n";
+      }
+    } else if (action == "COMMIT") {
+      if ((rc=btree->Commit())!=ERROR_NOERROR) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't commit transaction due to error "<<rc<<endl;
+      } else {
+	cout <<"OK\n";
+      }
+    } else if (action == "ABORT") {
+      if ((rc=btree->Abort())!=ERROR_NOERROR) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't abort transaction due to error "<<rc<<endl;
+      } else {
+	cout <<"OK\n";
+      }
+    } else if (action == "CRASH") {
+      // lose the cache, as a crash would, and come back up from the
+      // disk and the log.  A transaction not yet committed is lost too,
+      // and so is the memtable.
+      if (btree->InTransaction()) { 
+	btree->Abort();
+      }
+      cache.Crash();
+      if ((rc=cache.Attach())!=ERROR_NOERROR || (rc=btree->Attach(0, false))!=ERROR_NOERROR) { 
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't recover due to error "<<rc<<endl;
+      } else {
+	cout <<"OK\n";
       }
     } else if (action == "DISPLAY") {
       // This should always be OK
@@ -113,12 +364,100 @@ int main(int argc, char *argv[])
 	  cout <<"FAIL"<<endl;
 	  cerr <<"Can't detach cache due to error "<<rc<<endl;
 	} else {
+	  cerr << "Performance statistics:\n";
+
+	  cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+	  cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+	  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+	  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+	  cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+	  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+	  cerr << "hitratio        = "<<cache.GetHitRatio()<<" ("<<ReplacementPolicy::GetName(policy)<<")"<<endl;
+	  if (cache.HasCompressedTier()) { 
+	    SIZE_T tierhits=cache.GetNumTierHits();
+	    SIZE_T misses=tierhits+cache.GetNumDiskReads();
+	    cerr << "tierhits        = "<<tierhits<<" ("<<(misses ? (double)tierhits/misses : 0)
+		 <<" of cache misses)"<<endl;
+	    cerr << "tierratio       = "<<cache.GetTierCompressionRatio()<<endl;
+	  }
+	  if (samplerate>0) { 
+	    cerr << endl;
+	    cache.PrintMissRatioCurve(cerr);
+	  }
+	  cerr << endl;
+
+	  if (numlookups>0) { 
+	    cerr << "lookupdiskreads = "<<lookupdiskreads<<" ("<<(double)lookupdiskreads/numlookups<<" per lookup)"<<endl;
+	    if (pinnedlevels>0) { 
+	      // may be negative: pins take room from the policy
+	      double saved=(double)lookupunpinned-(double)lookupdiskreads;
+	      cerr << "pinsaved        = "<<saved<<" ("<<saved/numlookups<<" per lookup, "
+		   <<pinnedlevels<<" levels pinned)"<<endl;
+	    }
+	  }
+	  cerr << endl;
+
+	  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+	  cerr << endl;
+
+	  if (cache.GetWriteAheadLog()) { 
+	    WriteAheadLog *log=cache.GetWriteAheadLog();
+	    SIZE_T forces=log->GetNumForces();
+	    cerr << "logrecords      = "<<log->GetNumRecords()<<endl;
+	    cerr << "logbytes        = "<<log->GetNumBytes()<<endl;
+	    cerr << "logforces       = "<<forces<<" ("<<(forces ? (double)log->GetNumCommits()/forces : 0)
+		 <<" commits per force)"<<endl;
+	    cerr << "checkpoints     = "<<log->GetNumCheckpoints()<<endl;
+	    cerr << "recoveredops    = "<<log->GetNumRecoveredOps()<<" ("<<log->GetNumRecoveredRecords()
+		 <<" records, simulated time "<<log->GetRecoveryTime()<<")"<<endl;
+	    cerr << "recoveredbytes  = "<<log->GetRecoveredBytes()<<" (log read by the last recovery)"<<endl;
+	    cerr << endl;
+	  }
+
+	  if (memtablesize) { 
+	    SIZE_T merges=btree->GetNumMerges();
+	    cerr << "memtablemerges  = "<<merges<<" ("<<btree->GetNumMergedChanges()<<" changes into "
+		 <<btree->GetNumMergedLeaves()<<" leaf writes)"<<endl;
+	    cerr << endl;
+	  }
+
+	  if (filterblocks) { 
+	    SIZE_T probes=btree->GetNumFilterProbes();
+	    cerr << "filterprobes    = "<<probes<<" ("<<btree->GetNumFilterSkips()<<" skipped the tree)"<<endl;
+	    cerr << endl;
+	  }
+
+	  if (resultcachesize) { 
+	    const ResultCache *r=btree->GetResultCache();
+	    SIZE_T lookups=r->GetNumLookups();
+	    cerr << "resultlookups   = "<<lookups<<" ("<<(lookups ? (double)r->GetNumHits()/lookups : 0)
+		 <<" hit rate, "<<r->GetNumAdmits()<<" admitted, "<<r->GetNumRejects()<<" turned away, "
+		 <<r->GetNumForgets()<<" forgotten)"<<endl;
+	    cerr << endl;
+	  }
+
+	  if (shadow) { 
+	    SIZE_T commits=btree->GetNumCommits();
+	    cerr << "shadowcommits   = "<<commits<<" ("<<(commits ? (double)cache.GetNumDiskWrites()/commits : 0)
+		 <<" disk writes per commit)"<<endl;
+	    cerr << endl;
+	  }
+
+	  BTreeStats stats;
+	  if (btree->GetStats(stats)==ERROR_NOERROR) { 
+	    cerr << stats;
+	  }
 	  delete btree;
+	  btree=0;
 	  cout << "OK\n";
 	}
       }
     }
   }
+  // a script that ends in the middle of a batch still gets its replies
+  if (!batch.empty()) { 
+    RunBatch(btree,cache,batchaction,batch,batchvalues,numlookups,lookupdiskreads,lookupunpinned);
+  }
     
   fclose(file);
 
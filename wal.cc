@@ -0,0 +1,498 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <set>
+#include <zlib.h>
+
+#include "wal.h"
+
+// A record is a header of WAL_HEADER_BYTES, little endian as the
+// machine has it, followed by its payload: for an update, runs of
+// changed bytes, each as offset, length and the bytes themselves
+struct WalHeader {
+  unsigned int length;          // of the whole record
+  unsigned int type;
+  LSN_T lsn;
+  LSN_T op;
+  unsigned int blocknum;
+  unsigned int checksum;        // crc32 of the record, this being 0
+};
+
+// A checkpoint's payload is the LSN it was begun at, then each dirty
+// block as its number and the first record that dirtied it
+struct WalDirtyBlock {
+  unsigned int blocknum;
+  LSN_T reclsn;
+};
+
+
+// Whether a whole, undamaged record starts at pos, and its header
+static bool ParseRecord(string &log, const size_t pos, WalHeader &h)
+{
+  if (pos+WAL_HEADER_BYTES>log.size()) {
+    return false;
+  }
+  memcpy(&h,log.data()+pos,sizeof(h));
+  if (h.length<WAL_HEADER_BYTES || pos+h.length>log.size()) {
+    return false;
+  }
+  unsigned int sum=h.checksum;
+  memset(&log[pos+offsetof(WalHeader,checksum)],0,sizeof(h.checksum));
+  bool ok=(crc32(0,(const Bytef *)log.data()+pos,h.length)==sum);
+  memcpy(&log[pos+offsetof(WalHeader,checksum)],&sum,sizeof(sum));
+  return ok;
+}
+
+
+WriteAheadLog::WriteAheadLog(const string &filestem, const bool s) :
+  filename(filestem+".wal"), file(0), sync(s), groupdelay(0),
+  nextlsn(1), durablelsn(1), nextop(1), flushing(false),
+  filebytes(0), numrecords(0), numcommits(0), numforces(0), numcheckpoints(0),
+  numbytes(0), recoveredops(0), recoveredrecords(0), recoveredblocks(0), recoveredbytes(0), recoverytime(0)
+{
+  pthread_key_create(&current,0);
+  pthread_mutex_init(&lock,0);
+  pthread_cond_init(&flushed,0);
+}
+
+
+WriteAheadLog::~WriteAheadLog()
+{
+  if (file) {
+    fclose(file);
+  }
+  pthread_cond_destroy(&flushed);
+  pthread_mutex_destroy(&lock);
+  pthread_key_delete(current);
+}
+
+
+// Keep what is there: it is what recovery works from
+ERROR_T WriteAheadLog::Open()
+{
+  if ((file=fopen(filename.c_str(),"r+"))==0 &&
+      (file=fopen(filename.c_str(),"w+"))==0) {
+    return ERROR_NOFILE;
+  }
+  fseek(file,0,SEEK_END);
+  filebytes=ftell(file);
+  return ERROR_NOERROR;
+}
+
+
+LSN_T WriteAheadLog::Append(const SIZE_T type, const LSN_T op, const SIZE_T blocknum, const string &payload)
+{
+  MutexGuard guard(&lock);
+  WalHeader h;
+  string record;
+
+  memset(&h,0,sizeof(h));
+  h.length=WAL_HEADER_BYTES+payload.size();
+  h.type=type;
+  h.lsn=nextlsn++;
+  h.op=op;
+  h.blocknum=blocknum;
+  record.assign((const char *)&h,sizeof(h));
+  record+=payload;
+  h.checksum=crc32(0,(const Bytef *)record.data(),record.size());
+  memcpy(&record[0],&h,sizeof(h));
+
+  buffer+=record;
+  numrecords++;
+  numbytes+=record.size();
+  if (type==WAL_RECORD_COMMIT) {
+    numcommits++;
+  } else if (type==WAL_RECORD_CHECKPOINT) {
+    numcheckpoints++;
+  }
+  return h.lsn;
+}
+
+
+void WriteAheadLog::BeginOperation()
+{
+  Operation *op=new Operation;
+
+  {
+    MutexGuard guard(&lock);
+    op->id=nextop++;
+  }
+  op->wrote=false;
+  op->outer=(Operation *)pthread_getspecific(current);
+  pthread_setspecific(current,op);
+}
+
+
+bool WriteAheadLog::InOperation() const
+{
+  return pthread_getspecific(current)!=0;
+}
+
+
+LSN_T WriteAheadLog::LogWrite(const SIZE_T blocknum, const Block &before, const Block &after, bool &first)
+{
+  Operation *op=(Operation *)pthread_getspecific(current);
+  string payload;
+  SIZE_T i, start;
+  unsigned int run[2];
+
+  first=false;
+  if (!op) {
+    return 0;
+  }
+  // Only bytes that changed: those around them may hold another
+  // operation's changes, which are not this one's to log
+  for (i=0;i<after.length;) {
+    if (i<before.length && before.data[i]==after.data[i]) {
+      i++;
+      continue;
+    }
+    for (start=i; i<after.length && (i>=before.length || before.data[i]!=after.data[i]); i++) {
+    }
+    run[0]=start;
+    run[1]=i-start;
+    payload.append((const char *)run,sizeof(run));
+    payload.append((const char *)after.data+start,i-start);
+    if (start<before.length) {
+      WalUndo u;
+      u.blocknum=blocknum;
+      u.offset=start;
+      u.bytes.assign((const char *)before.data+start,(i<before.length ? i : before.length)-start);
+      op->undo.push_back(u);
+    }
+  }
+  if (payload.empty()) {
+    return 0;
+  }
+  for (i=0;i<op->blocks.size() && op->blocks[i]!=blocknum;i++) {
+  }
+  if (i==op->blocks.size()) {
+    op->blocks.push_back(blocknum);
+    first=true;
+  }
+  op->wrote=true;
+  return Append(WAL_RECORD_UPDATE,op->id,blocknum,payload);
+}
+
+
+LSN_T WriteAheadLog::CommitOperation(vector<SIZE_T> &blocks)
+{
+  Operation *op=(Operation *)pthread_getspecific(current);
+  LSN_T lsn=0;
+
+  blocks.clear();
+  if (!op) {
+    return 0;
+  }
+  pthread_setspecific(current,op->outer);
+  if (op->wrote) {
+    lsn=Append(WAL_RECORD_COMMIT,op->id,0,string());
+  }
+  blocks.swap(op->blocks);
+  delete op;
+  return lsn;
+}
+
+
+void WriteAheadLog::AbortOperation(vector<SIZE_T> &blocks, vector<WalUndo> &undo)
+{
+  Operation *op=(Operation *)pthread_getspecific(current);
+
+  blocks.clear();
+  undo.clear();
+  if (!op) {
+    return;
+  }
+  pthread_setspecific(current,op->outer);
+  blocks.swap(op->blocks);
+  undo.swap(op->undo);
+  delete op;
+}
+
+
+// One thread at a time writes the log, taking every record appended
+// so far; the others wait for it and see if it took theirs
+ERROR_T WriteAheadLog::Force(const LSN_T lsn)
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  pthread_mutex_lock(&lock);
+  while (rc==ERROR_NOERROR && lsn>=durablelsn) {
+    if (flushing) {
+      pthread_cond_wait(&flushed,&lock);
+      continue;
+    }
+    flushing=true;
+    if (groupdelay) {
+      pthread_mutex_unlock(&lock);
+      usleep(groupdelay);
+      pthread_mutex_lock(&lock);
+    }
+    string out;
+    out.swap(buffer);
+    LSN_T upto=nextlsn;
+    pthread_mutex_unlock(&lock);
+
+    if (fwrite(out.data(),1,out.size(),file)!=out.size() || fflush(file) ||
+	(sync && fdatasync(fileno(file)))) {
+      rc=ERROR_NOFILE;
+    }
+
+    pthread_mutex_lock(&lock);
+    flushing=false;
+    if (rc==ERROR_NOERROR) {
+      durablelsn=upto;
+      filebytes+=out.size();
+      numforces++;
+    }
+    pthread_cond_broadcast(&flushed);
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+LSN_T WriteAheadLog::GetDurableLSN() const
+{
+  MutexGuard guard(&lock);
+  return durablelsn;
+}
+
+
+LSN_T WriteAheadLog::GetNextLSN() const
+{
+  MutexGuard guard(&lock);
+  return nextlsn;
+}
+
+
+double WriteAheadLog::GetNumBytes() const
+{
+  MutexGuard guard(&lock);
+  return numbytes;
+}
+
+
+LSN_T WriteAheadLog::LogCheckpoint(const LSN_T begin, const map<SIZE_T, LSN_T> &dirty)
+{
+  string payload((const char *)&begin,sizeof(begin));
+
+  for (map<SIZE_T, LSN_T>::const_iterator d=dirty.begin(); d!=dirty.end(); ++d) {
+    WalDirtyBlock b;
+    memset(&b,0,sizeof(b));
+    b.blocknum=(*d).first;
+    b.reclsn=(*d).second;
+    payload.append((const char *)&b,sizeof(b));
+  }
+  return Append(WAL_RECORD_CHECKPOINT,0,0,payload);
+}
+
+
+// The whole of the log file as it is now
+ERROR_T WriteAheadLog::ReadFile(string &log)
+{
+  char buf[65536];
+  size_t n;
+
+  log.clear();
+  rewind(file);
+  while ((n=fread(buf,1,sizeof(buf),file))>0) {
+    log.append(buf,n);
+  }
+  if (ferror(file)) {
+    return ERROR_NOFILE;
+  }
+  fseek(file,0,SEEK_END);
+  return ERROR_NOERROR;
+}
+
+
+// The records kept are copied to a new file that then takes the log's
+// place, so a crash part way leaves one log or the other.  Forces
+// wait meanwhile, as for any other write of the file.
+ERROR_T WriteAheadLog::DropBefore(const LSN_T lsn)
+{
+  string log, tmpname=filename+".tmp";
+  size_t pos=0;
+  WalHeader h;
+  FILE *tmp;
+  ERROR_T rc;
+
+  pthread_mutex_lock(&lock);
+  while (flushing) {
+    pthread_cond_wait(&flushed,&lock);
+  }
+  flushing=true;
+  pthread_mutex_unlock(&lock);
+
+  if ((rc=ReadFile(log))==ERROR_NOERROR) {
+    for (pos=0; ParseRecord(log,pos,h) && h.lsn<lsn; pos+=h.length) {
+    }
+    if (pos>0) {
+      if ((tmp=fopen(tmpname.c_str(),"w+"))==0) {
+	rc=ERROR_NOFILE;
+      } else if (fwrite(log.data()+pos,1,log.size()-pos,tmp)!=log.size()-pos || fflush(tmp) ||
+		 (sync && fdatasync(fileno(tmp))) || rename(tmpname.c_str(),filename.c_str())) {
+	fclose(tmp);
+	rc=ERROR_NOFILE;
+      } else {
+	// the new file is the log now
+	fclose(file);
+	file=tmp;
+	fseek(file,0,SEEK_END);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  flushing=false;
+  if (rc==ERROR_NOERROR) {
+    filebytes=log.size()-pos;
+  }
+  pthread_cond_broadcast(&flushed);
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+
+// Redo only: the updates of operations that did not commit never
+// reached the disk, so there is nothing to undo.  An update holds the
+// bytes as they were after it, so replaying every committed one in
+// order leaves each byte as the last of them left it, whatever had
+// already been written back, and replaying it twice does no harm.
+// Updates older than the last checkpoint are skipped if their block
+// had been written back since.
+ERROR_T WriteAheadLog::Recover(DiskSystem *disk)
+{
+  string log;
+  vector<size_t> records;
+  set<LSN_T> committed;
+  map<SIZE_T, Block> blocks;
+  LSN_T checkpoint=0;
+  map<SIZE_T, LSN_T> dirty;
+  size_t pos;
+  WalHeader h;
+  double reqtime;
+  ERROR_T rc;
+
+  recoveredops=recoveredrecords=recoveredblocks=0;
+  recoverytime=0;
+
+  if ((rc=ReadFile(log))!=ERROR_NOERROR) {
+    return rc;
+  }
+  recoveredbytes=log.size();
+
+  // The log ends at the first record that is cut short or damaged
+  for (pos=0; ParseRecord(log,pos,h); pos+=h.length) {
+    if (h.type==WAL_RECORD_COMMIT) {
+      committed.insert(h.op);
+    } else if (h.type==WAL_RECORD_CHECKPOINT) {
+      const char *p=log.data()+pos+WAL_HEADER_BYTES;
+      const char *end=log.data()+pos+h.length;
+      if (p+sizeof(checkpoint)>end) {
+	return ERROR_INSANE;
+      }
+      memcpy(&checkpoint,p,sizeof(checkpoint));
+      dirty.clear();
+      for (p+=sizeof(checkpoint); p+sizeof(WalDirtyBlock)<=end; p+=sizeof(WalDirtyBlock)) {
+	WalDirtyBlock b;
+	memcpy(&b,p,sizeof(b));
+	dirty[b.blocknum]=b.reclsn;
+      }
+    } else {
+      records.push_back(pos);
+    }
+    if (h.lsn>=nextlsn) {
+      nextlsn=h.lsn+1;
+    }
+    if (h.op>=nextop) {
+      nextop=h.op+1;
+    }
+  }
+  recoveredops=committed.size();
+
+  for (SIZE_T r=0;r<records.size();r++) {
+    memcpy(&h,log.data()+records[r],sizeof(h));
+    if (h.type!=WAL_RECORD_UPDATE || !committed.count(h.op)) {
+      continue;
+    }
+    if (h.lsn<checkpoint) {
+      map<SIZE_T, LSN_T>::iterator d=dirty.find(h.blocknum);
+      if (d==dirty.end() || h.lsn<(*d).second) {
+	continue;
+      }
+    }
+    if (h.blocknum>=disk->GetNumBlocks()) {
+      return ERROR_INSANE;
+    }
+    map<SIZE_T, Block>::iterator b=blocks.find(h.blocknum);
+    if (b==blocks.end()) {
+      Block block;
+      if ((rc=disk->Read(h.blocknum,block,reqtime))!=ERROR_NOERROR) {
+	return rc;
+      }
+      recoverytime+=reqtime;
+      b=blocks.insert(make_pair((SIZE_T)h.blocknum,block)).first;
+    }
+    Block &block=(*b).second;
+    for (pos=records[r]+WAL_HEADER_BYTES; pos+2*sizeof(unsigned int)<=records[r]+h.length;) {
+      unsigned int run[2];
+      memcpy(run,log.data()+pos,sizeof(run));
+      pos+=sizeof(run);
+      if (run[0]+run[1]>block.length || pos+run[1]>records[r]+h.length) {
+	return ERROR_INSANE;
+      }
+      memcpy(block.data+run[0],log.data()+pos,run[1]);
+      pos+=run[1];
+    }
+    recoveredrecords++;
+  }
+
+  // in block order, which the disk likes best
+  for (map<SIZE_T, Block>::iterator b=blocks.begin(); b!=blocks.end(); ++b) {
+    if ((rc=disk->Write((*b).first,(*b).second,reqtime))!=ERROR_NOERROR) {
+      return rc;
+    }
+    recoverytime+=reqtime;
+  }
+  recoveredblocks=blocks.size();
+  if ((rc=disk->Sync(sync))!=ERROR_NOERROR) {
+    return rc;
+  }
+  return Truncate();
+}
+
+
+// Records not yet written go too: what they describe is on the disk
+ERROR_T WriteAheadLog::Truncate()
+{
+  MutexGuard guard(&lock);
+
+  buffer.clear();
+  durablelsn=nextlsn;
+  if (fflush(file) || ftruncate(fileno(file),0) || (sync && fdatasync(fileno(file)))) {
+    return ERROR_NOFILE;
+  }
+  rewind(file);
+  filebytes=0;
+  return ERROR_NOERROR;
+}
+
+
+void WriteAheadLog::DropBuffer()
+{
+  MutexGuard guard(&lock);
+  Operation *op=(Operation *)pthread_getspecific(current);
+
+  buffer.clear();
+  durablelsn=nextlsn;
+  while (op) {
+    Operation *outer=op->outer;
+    delete op;
+    op=outer;
+  }
+  pthread_setspecific(current,0);
+}
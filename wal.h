@@ -0,0 +1,162 @@
+#ifndef _wal
+#define _wal
+
+#include <stdio.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "global.h"
+#include "block.h"
+#include "disksystem.h"
+
+using namespace std;
+
+typedef unsigned long long LSN_T;
+
+#define WAL_RECORD_UPDATE 1
+#define WAL_RECORD_COMMIT 2
+#define WAL_RECORD_CHECKPOINT 3
+
+// Bytes of a record before its payload
+#define WAL_HEADER_BYTES 32
+
+//
+// Write-ahead log of the changes made to blocks, kept in filestem.wal
+//
+// Changes are grouped into operations, each the work of one thread
+// between BeginOperation and CommitOperation, e.g. one insert with the
+// splits it causes.  Every block the operation writes gets an update
+// record naming the block and holding the runs of bytes that changed,
+// and the operation ends with a commit record.  Recovery replays, in
+// order, the updates of the operations whose commit made it into the
+// log and ignores the rest, so an operation is either all there after
+// a crash or not there at all.  That only holds if the blocks an
+// operation has changed are not written back before it commits (the
+// cache keeps them), and if a block is only written back once the log
+// is durable up to the last record that touched it.
+//
+// An operation that fails part way through is aborted instead: it gets
+// no commit record, and hands back what its writes replaced so that
+// the cache can be put back as it was.
+//
+// An operation begun inside another one is nested: it commits on its
+// own, at once, whatever then becomes of the outer one.  This is for
+// changes other operations may build on before the outer one commits,
+// such as taking a block off a shared free list.
+//
+// Commit only appends the record.  Force makes the log durable up to a
+// record, and does so for everyone waiting at the time: while one
+// thread writes and syncs the log, others queue up behind it and the
+// next one to go writes all of their records at once (group commit).
+// A small delay before each write lets bigger groups form.  Without
+// sync the log is written but never synced, which is durable against
+// the process dying but not the machine, and is cheap enough for
+// simulation.
+//
+// A checkpoint record holds the blocks that were dirty in the cache
+// when it was taken, each with the first record that dirtied it since
+// it was last written back.  Recovery need not go back further than
+// the oldest of those, so the log before it can be dropped, and of
+// the records before the checkpoint it only replays those of blocks
+// that were dirty.
+//
+// Bytes an operation replaced in a block, to put back if it aborts
+struct WalUndo {
+  SIZE_T blocknum;
+  SIZE_T offset;
+  string bytes;
+};
+
+class WriteAheadLog {
+ private:
+  struct Operation {
+    LSN_T id;
+    vector<SIZE_T> blocks;      // blocks it wrote, each once
+    vector<WalUndo> undo;       // in the order it wrote them
+    bool wrote;
+    Operation *outer;
+  };
+
+  string filename;
+  FILE *file;
+  bool sync;
+  SIZE_T groupdelay;            // microseconds
+  pthread_key_t current;        // each thread's innermost Operation
+  mutable pthread_mutex_t lock; // all below
+  pthread_cond_t flushed;
+  string buffer;                // records not yet written
+  LSN_T nextlsn;                // of the next record
+  LSN_T durablelsn;             // every record before this is durable
+  LSN_T nextop;
+  bool flushing;                // a thread is writing the log
+  double filebytes;             // in the file since it was last emptied
+  SIZE_T numrecords, numcommits, numforces, numcheckpoints;
+  double numbytes;
+  SIZE_T recoveredops, recoveredrecords, recoveredblocks;
+  double recoveredbytes;
+  double recoverytime;          // simulated
+
+  LSN_T   Append(const SIZE_T type, const LSN_T op, const SIZE_T blocknum, const string &payload);
+  ERROR_T ReadFile(string &log);
+ public:
+  WriteAheadLog(const string &filestem, const bool sync=true);
+  ~WriteAheadLog();
+
+  ERROR_T Open();
+  bool    IsSynced() const { return sync; }
+  void    SetGroupDelay(const SIZE_T usec) { groupdelay=usec; }
+
+  // The calling thread's operations
+  void    BeginOperation();
+  bool    InOperation() const;
+  // Log that blocknum changed from before to after.  Returns the
+  // record's number, or 0 if nothing changed.  first is set if the
+  // operation had not written the block before.
+  LSN_T   LogWrite(const SIZE_T blocknum, const Block &before, const Block &after, bool &first);
+  // End the innermost operation, handing back the blocks it wrote.
+  // Returns the commit record's number, or 0 if it wrote nothing.
+  LSN_T   CommitOperation(vector<SIZE_T> &blocks);
+  // End the innermost operation without committing it, so that
+  // recovery ignores its updates, handing back the blocks it wrote and
+  // the bytes they held before, to put back last first
+  void    AbortOperation(vector<SIZE_T> &blocks, vector<WalUndo> &undo);
+
+  // Make every record up to lsn durable
+  ERROR_T Force(const LSN_T lsn);
+  LSN_T   GetDurableLSN() const;
+  // Number the next record will get
+  LSN_T   GetNextLSN() const;
+
+  // Log a checkpoint taken from begin on, dirty mapping each block that
+  // was dirty to the first record that dirtied it.  Returns its number.
+  LSN_T   LogCheckpoint(const LSN_T begin, const map<SIZE_T, LSN_T> &dirty);
+  // Drop the records before lsn from the log, once a durable
+  // checkpoint no longer needs them
+  ERROR_T DropBefore(const LSN_T lsn);
+
+  // Replay the committed operations in the log onto disk, then empty
+  // the log
+  ERROR_T Recover(DiskSystem *disk);
+  // Empty the log, once everything in it is on the disk and synced
+  ERROR_T Truncate();
+  // Forget the records not yet written, and the calling thread's
+  // operations, as a crash would
+  void    DropBuffer();
+
+  SIZE_T  GetNumRecords() const { return numrecords; }
+  SIZE_T  GetNumCommits() const { return numcommits; }
+  SIZE_T  GetNumForces() const { return numforces; }
+  SIZE_T  GetNumCheckpoints() const { return numcheckpoints; }
+  double  GetNumBytes() const;
+  double  GetFileBytes() const { return filebytes; }
+  SIZE_T  GetNumRecoveredOps() const { return recoveredops; }
+  SIZE_T  GetNumRecoveredRecords() const { return recoveredrecords; }
+  SIZE_T  GetNumRecoveredBlocks() const { return recoveredblocks; }
+  // Size of the log the last recovery read
+  double  GetRecoveredBytes() const { return recoveredbytes; }
+  double  GetRecoveryTime() const { return recoverytime; }
+};
+
+#endif